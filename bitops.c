@@ -0,0 +1,249 @@
+#include <string.h>
+#include <immintrin.h>
+#include "bitops.h"
+
+typedef uint64_t (*count_fn)(const uint8_t *p, size_t len);
+typedef void (*op_fn)(int op, uint8_t *dst, const uint8_t **srcs, int n, size_t len);
+
+static uint64_t count_dispatch(const uint8_t *p, size_t len);
+static void op_dispatch(int op, uint8_t *dst, const uint8_t **srcs, int n, size_t len);
+
+static count_fn count_impl = count_dispatch;
+static op_fn op_impl = op_dispatch;
+static const char *impl_name = "scalar";
+
+// ========== Scalar ==========
+
+static uint64_t count_scalar(const uint8_t *p, size_t len)
+{
+    uint64_t count = 0;
+    size_t i = 0;
+    for (; i + 8 <= len; i += 8)
+    {
+        uint64_t w;
+        memcpy(&w, p + i, 8);
+        count += __builtin_popcountll(w);
+    }
+    for (; i < len; i++)
+        count += __builtin_popcount(p[i]);
+    return count;
+}
+
+static void op_scalar(int op, uint8_t *dst, const uint8_t **srcs, int n, size_t len)
+{
+    for (size_t i = 0; i < len; i++)
+    {
+        uint8_t v = srcs[0][i];
+        for (int j = 1; j < n; j++)
+        {
+            if (op == BITOP_AND)
+                v &= srcs[j][i];
+            else if (op == BITOP_OR)
+                v |= srcs[j][i];
+            else
+                v ^= srcs[j][i];
+        }
+        dst[i] = op == BITOP_NOT ? ~v : v;
+    }
+}
+
+// ========== AVX2 ==========
+
+// Popcount of each byte with a nibble lookup table (vpshufb), summed into
+// 64-bit lanes with vpsadbw.
+__attribute__((target("avx2")))
+static uint64_t count_avx2(const uint8_t *p, size_t len)
+{
+    const __m256i lut = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+                                         0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+    const __m256i low_mask = _mm256_set1_epi8(0x0f);
+    __m256i total = _mm256_setzero_si256();
+    size_t i = 0;
+
+    while (i + 32 <= len)
+    {
+        // Byte counters can hold 255 / 8 = 31 iterations before overflowing
+        __m256i acc = _mm256_setzero_si256();
+        for (int n = 0; n < 31 && i + 32 <= len; n++, i += 32)
+        {
+            __m256i v = _mm256_loadu_si256((const __m256i *)(p + i));
+            __m256i lo = _mm256_and_si256(v, low_mask);
+            __m256i hi = _mm256_and_si256(_mm256_srli_epi16(v, 4), low_mask);
+            acc = _mm256_add_epi8(acc, _mm256_shuffle_epi8(lut, lo));
+            acc = _mm256_add_epi8(acc, _mm256_shuffle_epi8(lut, hi));
+        }
+        total = _mm256_add_epi64(total, _mm256_sad_epu8(acc, _mm256_setzero_si256()));
+    }
+
+    uint64_t lanes[4];
+    _mm256_storeu_si256((__m256i *)lanes, total);
+    return lanes[0] + lanes[1] + lanes[2] + lanes[3] + count_scalar(p + i, len - i);
+}
+
+__attribute__((target("avx2")))
+static void op_avx2(int op, uint8_t *dst, const uint8_t **srcs, int n, size_t len)
+{
+    const __m256i ones = _mm256_set1_epi8(-1);
+    size_t i = 0;
+    for (; i + 32 <= len; i += 32)
+    {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(srcs[0] + i));
+        for (int j = 1; j < n; j++)
+        {
+            __m256i w = _mm256_loadu_si256((const __m256i *)(srcs[j] + i));
+            if (op == BITOP_AND)
+                v = _mm256_and_si256(v, w);
+            else if (op == BITOP_OR)
+                v = _mm256_or_si256(v, w);
+            else
+                v = _mm256_xor_si256(v, w);
+        }
+        if (op == BITOP_NOT)
+            v = _mm256_xor_si256(v, ones);
+        _mm256_storeu_si256((__m256i *)(dst + i), v);
+    }
+    const uint8_t *tail[n];
+    for (int j = 0; j < n; j++)
+        tail[j] = srcs[j] + i;
+    op_scalar(op, dst + i, tail, n, len - i);
+}
+
+// ========== AVX-512 ==========
+
+__attribute__((target("avx512f,avx512vpopcntdq")))
+static uint64_t count_avx512(const uint8_t *p, size_t len)
+{
+    __m512i total = _mm512_setzero_si512();
+    size_t i = 0;
+    for (; i + 64 <= len; i += 64)
+        total = _mm512_add_epi64(total, _mm512_popcnt_epi64(_mm512_loadu_si512(p + i)));
+    return _mm512_reduce_add_epi64(total) + count_scalar(p + i, len - i);
+}
+
+__attribute__((target("avx512f")))
+static void op_avx512(int op, uint8_t *dst, const uint8_t **srcs, int n, size_t len)
+{
+    size_t i = 0;
+    for (; i + 64 <= len; i += 64)
+    {
+        __m512i v = _mm512_loadu_si512(srcs[0] + i);
+        for (int j = 1; j < n; j++)
+        {
+            __m512i w = _mm512_loadu_si512(srcs[j] + i);
+            if (op == BITOP_AND)
+                v = _mm512_and_si512(v, w);
+            else if (op == BITOP_OR)
+                v = _mm512_or_si512(v, w);
+            else
+                v = _mm512_xor_si512(v, w);
+        }
+        if (op == BITOP_NOT)
+            v = _mm512_ternarylogic_epi64(v, v, v, 0x55);
+        _mm512_storeu_si512(dst + i, v);
+    }
+    const uint8_t *tail[n];
+    for (int j = 0; j < n; j++)
+        tail[j] = srcs[j] + i;
+    op_scalar(op, dst + i, tail, n, len - i);
+}
+
+// ========== Dispatch ==========
+
+static void select_impl(void)
+{
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512vpopcntdq"))
+    {
+        count_impl = count_avx512;
+        op_impl = op_avx512;
+        impl_name = "avx512";
+    }
+    else if (__builtin_cpu_supports("avx2"))
+    {
+        count_impl = count_avx2;
+        op_impl = op_avx2;
+        impl_name = "avx2";
+    }
+    else
+    {
+        count_impl = count_scalar;
+        op_impl = op_scalar;
+        impl_name = "scalar";
+    }
+}
+
+static uint64_t count_dispatch(const uint8_t *p, size_t len)
+{
+    select_impl();
+    return count_impl(p, len);
+}
+
+static void op_dispatch(int op, uint8_t *dst, const uint8_t **srcs, int n, size_t len)
+{
+    select_impl();
+    op_impl(op, dst, srcs, n, len);
+}
+
+uint64_t Bitops_count(const uint8_t *p, size_t len)
+{
+    return count_impl(p, len);
+}
+
+// dst = srcs[0] op srcs[1] op ... over len bytes (NOT takes one source).
+// Sources shorter than len (lens[j] < len) read as zero past their end: the
+// vector kernel runs over the common prefix, the rest is done bytewise.
+void Bitops_op(int op, uint8_t *dst, const uint8_t **srcs, const size_t *lens, int n, size_t len)
+{
+    size_t common = len;
+    for (int j = 0; j < n; j++)
+        if (lens[j] < common)
+            common = lens[j];
+    op_impl(op, dst, srcs, n, common);
+
+    for (size_t i = common; i < len; i++)
+    {
+        uint8_t v = i < lens[0] ? srcs[0][i] : 0;
+        for (int j = 1; j < n; j++)
+        {
+            uint8_t w = i < lens[j] ? srcs[j][i] : 0;
+            if (op == BITOP_AND)
+                v &= w;
+            else if (op == BITOP_OR)
+                v |= w;
+            else
+                v ^= w;
+        }
+        dst[i] = op == BITOP_NOT ? ~v : v;
+    }
+}
+
+// Position of the first bit set to `bit` (bit 0 is the most significant bit
+// of the first byte), or -1 if there is none. Whole 64-bit words that cannot
+// match are skipped.
+long long Bitops_pos(const uint8_t *p, size_t len, int bit)
+{
+    const uint64_t skip = bit ? 0 : UINT64_MAX;
+    size_t i = 0;
+    while (i + 8 <= len)
+    {
+        uint64_t w;
+        memcpy(&w, p + i, 8);
+        if (w != skip)
+            break;
+        i += 8;
+    }
+    for (; i < len; i++)
+    {
+        uint8_t b = bit ? p[i] : (uint8_t)~p[i];
+        if (b)
+            return (long long)i * 8 + __builtin_clz((unsigned)b) - 24;
+    }
+    return -1;
+}
+
+const char *Bitops_impl(void)
+{
+    if (count_impl == count_dispatch)
+        select_impl();
+    return impl_name;
+}
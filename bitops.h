@@ -0,0 +1,20 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+// Bit counting and bitwise operations over byte strings. The hot kernels
+// have AVX-512 (VPOPCNTQ), AVX2 and scalar versions; the best one supported
+// by the CPU is picked on first use.
+
+enum
+{
+    BITOP_AND,
+    BITOP_OR,
+    BITOP_XOR,
+    BITOP_NOT,
+};
+
+uint64_t Bitops_count(const uint8_t *p, size_t len);
+void Bitops_op(int op, uint8_t *dst, const uint8_t **srcs, const size_t *lens, int n, size_t len);
+long long Bitops_pos(const uint8_t *p, size_t len, int bit);
+const char *Bitops_impl(void);
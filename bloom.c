@@ -0,0 +1,187 @@
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "bloom.h"
+#include "serial.h"
+
+#define BLOOM_MAX_K 16
+#define BLOOM_MAX_LAYERS 32
+
+static int layer_init(BloomLayer *l, uint64_t capacity, double error_rate)
+{
+    // Optimal bits per item and hash count for a classic Bloom filter. Packing
+    // the bits of an item in one block raises the error rate a little, which
+    // the extra 10% of bits compensates for.
+    double bits_per_item = -log(error_rate) / (M_LN2 * M_LN2);
+    uint64_t bits = (uint64_t)(capacity * bits_per_item * 1.1) + 1;
+
+    l->nblocks = (bits + 511) / 512;
+    l->k = (uint32_t)ceil(M_LN2 * bits_per_item);
+    if (l->k < 1)
+        l->k = 1;
+    if (l->k > BLOOM_MAX_K)
+        l->k = BLOOM_MAX_K;
+    l->capacity = capacity;
+    l->count = 0;
+
+    size_t size = l->nblocks * BLOOM_BLOCK_WORDS * sizeof(uint64_t);
+    l->blocks = aligned_alloc(64, size);
+    if (!l->blocks)
+        return 0;
+    memset(l->blocks, 0, size);
+    return 1;
+}
+
+// Builds the bit mask of an item inside its block and returns the block.
+// The upper 32 bits of the hash choose the block, the lower 32 bits give the
+// two hashes h1 + i * h2 of the bit positions.
+static uint64_t *layer_mask(const BloomLayer *l, uint64_t hash, uint64_t mask[BLOOM_BLOCK_WORDS])
+{
+    uint64_t block = ((hash >> 32) * l->nblocks) >> 32;
+    uint32_t h1 = (uint32_t)hash;
+    uint32_t h2 = ((uint32_t)hash >> 16) | 1;
+
+    memset(mask, 0, BLOOM_BLOCK_WORDS * sizeof(uint64_t));
+    for (uint32_t i = 0; i < l->k; i++)
+    {
+        uint32_t bit = (h1 + i * h2) & 511;
+        mask[bit >> 6] |= 1ULL << (bit & 63);
+    }
+    return l->blocks + block * BLOOM_BLOCK_WORDS;
+}
+
+static int layer_exists(const BloomLayer *l, uint64_t hash)
+{
+    uint64_t mask[BLOOM_BLOCK_WORDS];
+    const uint64_t *block = layer_mask(l, hash, mask);
+    uint64_t missing = 0;
+    for (int i = 0; i < BLOOM_BLOCK_WORDS; i++)
+        missing |= mask[i] & ~block[i];
+    return missing == 0;
+}
+
+Bloom *Bloom_create(uint64_t capacity, double error_rate)
+{
+    if (capacity == 0 || capacity > (1ULL << 40) || !(error_rate > 0 && error_rate < 1))
+        return NULL;
+    Bloom *b = calloc(1, sizeof(Bloom));
+    if (!b)
+        return NULL;
+    b->layers = malloc(sizeof(BloomLayer));
+    if (!b->layers || !layer_init(&b->layers[0], capacity, error_rate))
+    {
+        free(b->layers);
+        free(b);
+        return NULL;
+    }
+    b->nlayers = 1;
+    b->error_rate = error_rate;
+    return b;
+}
+
+void Bloom_free(Bloom *b)
+{
+    if (!b)
+        return;
+    for (int i = 0; i < b->nlayers; i++)
+        free(b->layers[i].blocks);
+    free(b->layers);
+    free(b);
+}
+
+int Bloom_exists(const Bloom *b, uint64_t hash)
+{
+    for (int i = b->nlayers - 1; i >= 0; i--)
+        if (layer_exists(&b->layers[i], hash))
+            return 1;
+    return 0;
+}
+
+// Returns 1 if the item was added, 0 if it was (probably) already present
+// and -1 if a new layer could not be allocated.
+int Bloom_add(Bloom *b, uint64_t hash)
+{
+    if (Bloom_exists(b, hash))
+        return 0;
+
+    BloomLayer *l = &b->layers[b->nlayers - 1];
+    if (l->count >= l->capacity)
+    {
+        if (b->nlayers == BLOOM_MAX_LAYERS)
+            return -1;
+        BloomLayer *layers = realloc(b->layers, (b->nlayers + 1) * sizeof(BloomLayer));
+        if (!layers)
+            return -1;
+        b->layers = layers;
+        if (!layer_init(&layers[b->nlayers], layers[b->nlayers - 1].capacity * 2, b->error_rate / 2))
+            return -1;
+        b->error_rate /= 2;
+        l = &layers[b->nlayers++];
+    }
+
+    uint64_t mask[BLOOM_BLOCK_WORDS];
+    uint64_t *block = layer_mask(l, hash, mask);
+    for (int i = 0; i < BLOOM_BLOCK_WORDS; i++)
+        block[i] |= mask[i];
+    l->count++;
+    return 1;
+}
+
+size_t Bloom_dump(const Bloom *b, unsigned char *out)
+{
+    size_t off = Serial_put(out, 0, &b->nlayers, sizeof(b->nlayers));
+    off = Serial_put(out, off, &b->error_rate, sizeof(b->error_rate));
+    for (int i = 0; i < b->nlayers; i++)
+    {
+        const BloomLayer *l = &b->layers[i];
+        off = Serial_put(out, off, &l->nblocks, sizeof(l->nblocks));
+        off = Serial_put(out, off, &l->k, sizeof(l->k));
+        off = Serial_put(out, off, &l->capacity, sizeof(l->capacity));
+        off = Serial_put(out, off, &l->count, sizeof(l->count));
+        off = Serial_put(out, off, l->blocks, l->nblocks * BLOOM_BLOCK_WORDS * sizeof(uint64_t));
+    }
+    return off;
+}
+
+Bloom *Bloom_load(const unsigned char *in, size_t len)
+{
+    SerialReader r = {in, in + len};
+    int nlayers;
+    Bloom *b = calloc(1, sizeof(Bloom));
+    if (!b || !Serial_get(&r, &nlayers, sizeof(nlayers)) || nlayers < 1 || nlayers > BLOOM_MAX_LAYERS ||
+        !Serial_get(&r, &b->error_rate, sizeof(b->error_rate)))
+        goto err;
+    b->layers = calloc(nlayers, sizeof(BloomLayer));
+    if (!b->layers)
+        goto err;
+    for (int i = 0; i < nlayers; i++)
+    {
+        BloomLayer *l = &b->layers[i];
+        if (!Serial_get(&r, &l->nblocks, sizeof(l->nblocks)) || !Serial_get(&r, &l->k, sizeof(l->k)) ||
+            !Serial_get(&r, &l->capacity, sizeof(l->capacity)) || !Serial_get(&r, &l->count, sizeof(l->count)))
+            goto err;
+        size_t size = l->nblocks * BLOOM_BLOCK_WORDS * sizeof(uint64_t);
+        if (l->nblocks == 0 || l->k < 1 || l->k > BLOOM_MAX_K || l->nblocks > (size_t)(r.end - r.p) / 64)
+            goto err;
+        l->blocks = aligned_alloc(64, size);
+        if (!l->blocks)
+            goto err;
+        b->nlayers = i + 1;
+        Serial_get(&r, l->blocks, size);
+    }
+    if (r.p != r.end)
+        goto err;
+    return b;
+
+err:
+    Bloom_free(b);
+    return NULL;
+}
+
+size_t Bloom_bytes(const Bloom *b)
+{
+    size_t bytes = sizeof(Bloom) + b->nlayers * sizeof(BloomLayer);
+    for (int i = 0; i < b->nlayers; i++)
+        bytes += b->layers[i].nblocks * BLOOM_BLOCK_WORDS * sizeof(uint64_t);
+    return bytes;
+}
@@ -0,0 +1,39 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+// Scalable blocked Bloom filter. Every item sets its k bits inside a single
+// 512-bit block (one cache line), so an add or a lookup touches one line per
+// layer. The k bit positions come from one 64-bit hash by double hashing.
+// When the newest layer reaches its capacity, a layer twice as large with half
+// the error rate is stacked on top, keeping the overall error rate bounded.
+
+#define BLOOM_BLOCK_WORDS 8 // 512 bits
+
+typedef struct BloomLayer
+{
+    uint64_t *blocks; // nblocks * BLOOM_BLOCK_WORDS words, cache line aligned
+    uint64_t nblocks;
+    uint32_t k;
+    uint64_t capacity;
+    uint64_t count;
+} BloomLayer;
+
+typedef struct Bloom
+{
+    BloomLayer *layers;
+    int nlayers;
+    double error_rate; // Error rate of the newest layer
+} Bloom;
+
+Bloom *Bloom_create(uint64_t capacity, double error_rate);
+void Bloom_free(Bloom *b);
+
+int Bloom_add(Bloom *b, uint64_t hash);
+int Bloom_exists(const Bloom *b, uint64_t hash);
+size_t Bloom_bytes(const Bloom *b);
+
+// Snapshot encoding: Bloom_dump writes the filter to out (if not NULL) and
+// returns its size, Bloom_load returns NULL on malformed data.
+size_t Bloom_dump(const Bloom *b, unsigned char *out);
+Bloom *Bloom_load(const unsigned char *in, size_t len);
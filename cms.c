@@ -0,0 +1,113 @@
+#include <stdlib.h>
+#include <math.h>
+#include "cms.h"
+#include "serial.h"
+
+#define CMS_MAX_DEPTH 64
+
+CountMin *CountMin_create(uint32_t width, uint32_t depth)
+{
+    if (width == 0 || depth == 0 || depth > CMS_MAX_DEPTH || (uint64_t)width * depth > (1ULL << 32))
+        return NULL;
+    CountMin *cms = malloc(sizeof(CountMin));
+    if (!cms)
+        return NULL;
+    cms->counters = calloc((size_t)width * depth, sizeof(uint32_t));
+    if (!cms->counters)
+    {
+        free(cms);
+        return NULL;
+    }
+    cms->width = width;
+    cms->depth = depth;
+    cms->total = 0;
+    return cms;
+}
+
+// Sizes the sketch so that an estimate exceeds the true count by more than
+// error * total with at most the given probability.
+CountMin *CountMin_create_by_prob(double error, double probability)
+{
+    if (!(error > 0 && error < 1) || !(probability > 0 && probability < 1))
+        return NULL;
+    return CountMin_create((uint32_t)ceil(M_E / error), (uint32_t)ceil(log(1 / probability)));
+}
+
+void CountMin_free(CountMin *cms)
+{
+    if (!cms)
+        return;
+    free(cms->counters);
+    free(cms);
+}
+
+// Fills idx[row] with the absolute counter index of the item in each row.
+static void row_indexes(const CountMin *cms, uint64_t hash, uint64_t *idx)
+{
+    uint32_t h1 = (uint32_t)hash;
+    uint32_t h2 = (uint32_t)(hash >> 32) | 1;
+    for (uint32_t i = 0; i < cms->depth; i++)
+        idx[i] = (uint64_t)i * cms->width + (((uint64_t)(h1 + i * h2) * cms->width) >> 32);
+}
+
+// Adds incr to the item's counters (saturating) and returns its new estimate.
+uint32_t CountMin_incrby(CountMin *cms, uint64_t hash, uint32_t incr)
+{
+    uint64_t idx[CMS_MAX_DEPTH];
+    uint32_t min = UINT32_MAX;
+    row_indexes(cms, hash, idx);
+    for (uint32_t i = 0; i < cms->depth; i++)
+    {
+        uint32_t *counter = &cms->counters[idx[i]];
+        uint32_t v = *counter + incr;
+        if (v < incr)
+            v = UINT32_MAX;
+        *counter = v;
+        min = v < min ? v : min;
+    }
+    cms->total += incr;
+    return min;
+}
+
+uint32_t CountMin_query(const CountMin *cms, uint64_t hash)
+{
+    uint64_t idx[CMS_MAX_DEPTH];
+    uint32_t min = UINT32_MAX;
+    row_indexes(cms, hash, idx);
+    for (uint32_t i = 0; i < cms->depth; i++)
+    {
+        uint32_t v = cms->counters[idx[i]];
+        min = v < min ? v : min;
+    }
+    return min;
+}
+
+size_t CountMin_dump(const CountMin *cms, unsigned char *out)
+{
+    size_t off = Serial_put(out, 0, &cms->width, sizeof(cms->width));
+    off = Serial_put(out, off, &cms->depth, sizeof(cms->depth));
+    off = Serial_put(out, off, &cms->total, sizeof(cms->total));
+    return Serial_put(out, off, cms->counters, (size_t)cms->width * cms->depth * sizeof(uint32_t));
+}
+
+CountMin *CountMin_load(const unsigned char *in, size_t len)
+{
+    SerialReader r = {in, in + len};
+    uint32_t width, depth;
+    uint64_t total;
+    if (!Serial_get(&r, &width, sizeof(width)) || !Serial_get(&r, &depth, sizeof(depth)) ||
+        !Serial_get(&r, &total, sizeof(total)) ||
+        (size_t)(r.end - r.p) != (uint64_t)width * depth * sizeof(uint32_t))
+        return NULL;
+    CountMin *cms = CountMin_create(width, depth);
+    if (!cms)
+        return NULL;
+    cms->total = total;
+    Serial_get(&r, cms->counters, (size_t)width * depth * sizeof(uint32_t));
+    return cms;
+}
+
+size_t CountMin_bytes(const CountMin *cms)
+{
+    return sizeof(CountMin) + (size_t)cms->width * cms->depth * sizeof(uint32_t);
+}
@@ -0,0 +1,28 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+// Count-Min sketch: depth rows of width 32-bit counters in one flat
+// row-major array. The column of each row comes from one 64-bit hash by
+// double hashing, computed for all rows up front so the index and the update
+// loops are plain array loops the compiler can vectorize.
+
+typedef struct CountMin
+{
+    uint32_t width;
+    uint32_t depth;
+    uint64_t total;     // Sum of all increments
+    uint32_t *counters; // depth * width, row-major
+} CountMin;
+
+CountMin *CountMin_create(uint32_t width, uint32_t depth);
+CountMin *CountMin_create_by_prob(double error, double probability);
+void CountMin_free(CountMin *cms);
+
+uint32_t CountMin_incrby(CountMin *cms, uint64_t hash, uint32_t incr);
+uint32_t CountMin_query(const CountMin *cms, uint64_t hash);
+size_t CountMin_bytes(const CountMin *cms);
+
+// Snapshot encoding, see Bloom_dump() in bloom.h.
+size_t CountMin_dump(const CountMin *cms, unsigned char *out);
+CountMin *CountMin_load(const unsigned char *in, size_t len);
@@ -0,0 +1,284 @@
+#include <stdlib.h>
+#include <string.h>
+#include "cuckoo.h"
+#include "serial.h"
+
+#define CUCKOO_MAX_KICKS 500
+#define CUCKOO_MAX_LAYERS 32
+#define CUCKOO_LOAD_FACTOR 0.95
+
+#define LANES_LO 0x0001000100010001ULL
+#define LANES_HI 0x8000800080008000ULL
+
+// Non-zero if any of the four 16-bit lanes of x is zero.
+static inline uint64_t has_zero_lane(uint64_t x)
+{
+    return (x - LANES_LO) & ~x & LANES_HI;
+}
+
+static inline uint16_t fingerprint(uint64_t hash)
+{
+    uint16_t fp = hash >> 48;
+    return fp ? fp : 1;
+}
+
+static inline uint64_t alt_index(const CuckooLayer *l, uint64_t i, uint16_t fp)
+{
+    return (i ^ (fp * 0x5bd1e995ULL)) & l->mask;
+}
+
+static inline int bucket_has(const CuckooLayer *l, uint64_t i, uint16_t fp)
+{
+    return has_zero_lane(l->buckets[i] ^ (fp * LANES_LO)) != 0;
+}
+
+static int bucket_put(CuckooLayer *l, uint64_t i, uint16_t fp)
+{
+    uint64_t w = l->buckets[i];
+    if (!has_zero_lane(w))
+        return 0;
+    for (int s = 0; s < CUCKOO_BUCKET_SLOTS; s++)
+    {
+        if (((w >> (16 * s)) & 0xffff) == 0)
+        {
+            l->buckets[i] = w | ((uint64_t)fp << (16 * s));
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int bucket_remove(CuckooLayer *l, uint64_t i, uint16_t fp)
+{
+    uint64_t w = l->buckets[i];
+    for (int s = 0; s < CUCKOO_BUCKET_SLOTS; s++)
+    {
+        if (((w >> (16 * s)) & 0xffff) == fp)
+        {
+            l->buckets[i] = w & ~(0xffffULL << (16 * s));
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int layer_init(CuckooLayer *l, uint64_t nbuckets)
+{
+    memset(l, 0, sizeof(*l));
+    l->buckets = calloc(nbuckets, sizeof(uint64_t));
+    if (!l->buckets)
+        return 0;
+    l->mask = nbuckets - 1;
+    return 1;
+}
+
+static uint64_t kick_rand(void)
+{
+    static uint64_t state = 0x9e3779b97f4a7c15ULL;
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+    return state;
+}
+
+// Inserts a fingerprint, relocating resident ones when both buckets are
+// full. The last fingerprint left without a slot goes to the victim slot,
+// which marks the layer as full.
+static void layer_insert(CuckooLayer *l, uint64_t i, uint16_t fp)
+{
+    l->count++;
+    if (bucket_put(l, i, fp))
+        return;
+    i = alt_index(l, i, fp);
+    if (bucket_put(l, i, fp))
+        return;
+
+    for (int n = 0; n < CUCKOO_MAX_KICKS; n++)
+    {
+        int s = kick_rand() & (CUCKOO_BUCKET_SLOTS - 1);
+        uint64_t w = l->buckets[i];
+        uint16_t evicted = (w >> (16 * s)) & 0xffff;
+        l->buckets[i] = (w & ~(0xffffULL << (16 * s))) | ((uint64_t)fp << (16 * s));
+        fp = evicted;
+        i = alt_index(l, i, fp);
+        if (bucket_put(l, i, fp))
+            return;
+    }
+    l->victim_fp = fp;
+    l->victim_index = i;
+}
+
+static int layer_exists(const CuckooLayer *l, uint64_t hash)
+{
+    uint16_t fp = fingerprint(hash);
+    uint64_t i1 = hash & l->mask;
+    uint64_t i2 = alt_index(l, i1, fp);
+    if (bucket_has(l, i1, fp) || bucket_has(l, i2, fp))
+        return 1;
+    return l->victim_fp == fp && (l->victim_index == i1 || l->victim_index == i2);
+}
+
+static int layer_delete(CuckooLayer *l, uint64_t hash)
+{
+    uint16_t fp = fingerprint(hash);
+    uint64_t i1 = hash & l->mask;
+    uint64_t i2 = alt_index(l, i1, fp);
+
+    if (l->victim_fp == fp && (l->victim_index == i1 || l->victim_index == i2))
+    {
+        l->victim_fp = 0;
+        l->count--;
+        return 1;
+    }
+    if (!bucket_remove(l, i1, fp) && !bucket_remove(l, i2, fp))
+        return 0;
+    l->count--;
+
+    // A slot was freed, give the victim another chance
+    if (l->victim_fp)
+    {
+        uint16_t vfp = l->victim_fp;
+        uint64_t vi = l->victim_index;
+        if (bucket_put(l, vi, vfp) || bucket_put(l, alt_index(l, vi, vfp), vfp))
+            l->victim_fp = 0;
+    }
+    return 1;
+}
+
+Cuckoo *Cuckoo_create(uint64_t capacity)
+{
+    if (capacity == 0 || capacity > (1ULL << 40))
+        return NULL;
+    uint64_t nbuckets = 1;
+    while (nbuckets * CUCKOO_BUCKET_SLOTS * CUCKOO_LOAD_FACTOR < capacity)
+        nbuckets <<= 1;
+
+    Cuckoo *cf = calloc(1, sizeof(Cuckoo));
+    if (!cf)
+        return NULL;
+    cf->layers = malloc(sizeof(CuckooLayer));
+    if (!cf->layers || !layer_init(&cf->layers[0], nbuckets))
+    {
+        free(cf->layers);
+        free(cf);
+        return NULL;
+    }
+    cf->nlayers = 1;
+    return cf;
+}
+
+void Cuckoo_free(Cuckoo *cf)
+{
+    if (!cf)
+        return;
+    for (int i = 0; i < cf->nlayers; i++)
+        free(cf->layers[i].buckets);
+    free(cf->layers);
+    free(cf);
+}
+
+// Adds one occurrence of the item (duplicates are counted, as deletes remove
+// one occurrence). Returns 1, or -1 if a new layer could not be allocated.
+int Cuckoo_add(Cuckoo *cf, uint64_t hash)
+{
+    CuckooLayer *l = &cf->layers[cf->nlayers - 1];
+    if (l->victim_fp)
+    {
+        if (cf->nlayers == CUCKOO_MAX_LAYERS)
+            return -1;
+        CuckooLayer *layers = realloc(cf->layers, (cf->nlayers + 1) * sizeof(CuckooLayer));
+        if (!layers)
+            return -1;
+        cf->layers = layers;
+        if (!layer_init(&layers[cf->nlayers], (layers[cf->nlayers - 1].mask + 1) * 2))
+            return -1;
+        l = &layers[cf->nlayers++];
+    }
+    layer_insert(l, hash & l->mask, fingerprint(hash));
+    return 1;
+}
+
+int Cuckoo_exists(const Cuckoo *cf, uint64_t hash)
+{
+    for (int i = cf->nlayers - 1; i >= 0; i--)
+        if (layer_exists(&cf->layers[i], hash))
+            return 1;
+    return 0;
+}
+
+// Removes one occurrence of the item, newest layer first. Deleting an item
+// that was never added may remove another item with the same fingerprint.
+int Cuckoo_delete(Cuckoo *cf, uint64_t hash)
+{
+    for (int i = cf->nlayers - 1; i >= 0; i--)
+        if (layer_delete(&cf->layers[i], hash))
+            return 1;
+    return 0;
+}
+
+uint64_t Cuckoo_count(const Cuckoo *cf)
+{
+    uint64_t count = 0;
+    for (int i = 0; i < cf->nlayers; i++)
+        count += cf->layers[i].count;
+    return count;
+}
+
+size_t Cuckoo_dump(const Cuckoo *cf, unsigned char *out)
+{
+    size_t off = Serial_put(out, 0, &cf->nlayers, sizeof(cf->nlayers));
+    for (int i = 0; i < cf->nlayers; i++)
+    {
+        const CuckooLayer *l = &cf->layers[i];
+        off = Serial_put(out, off, &l->mask, sizeof(l->mask));
+        off = Serial_put(out, off, &l->count, sizeof(l->count));
+        off = Serial_put(out, off, &l->victim_fp, sizeof(l->victim_fp));
+        off = Serial_put(out, off, &l->victim_index, sizeof(l->victim_index));
+        off = Serial_put(out, off, l->buckets, (l->mask + 1) * sizeof(uint64_t));
+    }
+    return off;
+}
+
+Cuckoo *Cuckoo_load(const unsigned char *in, size_t len)
+{
+    SerialReader r = {in, in + len};
+    int nlayers;
+    Cuckoo *cf = calloc(1, sizeof(Cuckoo));
+    if (!cf || !Serial_get(&r, &nlayers, sizeof(nlayers)) || nlayers < 1 || nlayers > CUCKOO_MAX_LAYERS)
+        goto err;
+    cf->layers = calloc(nlayers, sizeof(CuckooLayer));
+    if (!cf->layers)
+        goto err;
+    for (int i = 0; i < nlayers; i++)
+    {
+        CuckooLayer *l = &cf->layers[i];
+        if (!Serial_get(&r, &l->mask, sizeof(l->mask)) || !Serial_get(&r, &l->count, sizeof(l->count)) ||
+            !Serial_get(&r, &l->victim_fp, sizeof(l->victim_fp)) ||
+            !Serial_get(&r, &l->victim_index, sizeof(l->victim_index)))
+            goto err;
+        // The bucket count must be a power of two that fits in the record
+        if ((l->mask & (l->mask + 1)) || l->mask >= (size_t)(r.end - r.p) / sizeof(uint64_t) ||
+            l->victim_index > l->mask)
+            goto err;
+        l->buckets = malloc((l->mask + 1) * sizeof(uint64_t));
+        if (!l->buckets)
+            goto err;
+        cf->nlayers = i + 1;
+        Serial_get(&r, l->buckets, (l->mask + 1) * sizeof(uint64_t));
+    }
+    if (r.p != r.end)
+        goto err;
+    return cf;
+
+err:
+    Cuckoo_free(cf);
+    return NULL;
+}
+
+size_t Cuckoo_bytes(const Cuckoo *cf)
+{
+    size_t bytes = sizeof(Cuckoo) + cf->nlayers * sizeof(CuckooLayer);
+    for (int i = 0; i < cf->nlayers; i++)
+        bytes += (cf->layers[i].mask + 1) * sizeof(uint64_t);
+    return bytes;
+}
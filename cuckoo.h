@@ -0,0 +1,40 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+// Bucketized cuckoo filter: 16-bit fingerprints in buckets of 4 slots (one
+// 64-bit word per bucket, searched with a SWAR compare). An item lives in
+// one of two buckets, i1 = hash & mask and i2 = i1 ^ mix(fingerprint), so
+// both candidates and the fingerprint come from a single 64-bit hash and
+// items can be deleted. When a layer is full (an insertion left a homeless
+// fingerprint in the victim slot) a layer twice as large is stacked on top.
+
+#define CUCKOO_BUCKET_SLOTS 4
+
+typedef struct CuckooLayer
+{
+    uint64_t *buckets; // CUCKOO_BUCKET_SLOTS uint16_t fingerprints per word, 0 is an empty slot
+    uint64_t mask;     // Number of buckets - 1, a power of two
+    uint64_t count;
+    uint16_t victim_fp; // Fingerprint that found no slot, 0 if none
+    uint64_t victim_index;
+} CuckooLayer;
+
+typedef struct Cuckoo
+{
+    CuckooLayer *layers;
+    int nlayers;
+} Cuckoo;
+
+Cuckoo *Cuckoo_create(uint64_t capacity);
+void Cuckoo_free(Cuckoo *cf);
+
+int Cuckoo_add(Cuckoo *cf, uint64_t hash);
+int Cuckoo_exists(const Cuckoo *cf, uint64_t hash);
+int Cuckoo_delete(Cuckoo *cf, uint64_t hash);
+uint64_t Cuckoo_count(const Cuckoo *cf);
+size_t Cuckoo_bytes(const Cuckoo *cf);
+
+// Snapshot encoding, see Bloom_dump() in bloom.h.
+size_t Cuckoo_dump(const Cuckoo *cf, unsigned char *out);
+Cuckoo *Cuckoo_load(const unsigned char *in, size_t len);
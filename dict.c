@@ -0,0 +1,317 @@
+#include <stdlib.h>
+#include <string.h>
+#include "dict.h"
+
+#define DICT_INITIAL_SIZE 4
+
+Dict *Dict_create(const DictType *type)
+{
+    Dict *d = calloc(1, sizeof(Dict));
+    if (!d)
+        return NULL;
+    d->type = type;
+    d->rehashidx = -1;
+    return d;
+}
+
+static void table_free(Dict *d, int t)
+{
+    for (size_t i = 0; i < d->size[t]; i++)
+    {
+        DictEntry *e = d->table[t][i];
+        while (e)
+        {
+            DictEntry *next = e->next;
+            if (d->type->key_free)
+                d->type->key_free(e->key);
+            if (d->type->val_free)
+                d->type->val_free(e->val);
+            free(e);
+            e = next;
+        }
+    }
+    free(d->table[t]);
+    d->table[t] = NULL;
+    d->size[t] = d->used[t] = 0;
+}
+
+void Dict_free(Dict *d)
+{
+    if (!d)
+        return;
+    table_free(d, 0);
+    table_free(d, 1);
+    free(d);
+}
+
+size_t Dict_size(const Dict *d)
+{
+    return d->used[0] + d->used[1];
+}
+
+static int is_rehashing(const Dict *d)
+{
+    return d->rehashidx != -1;
+}
+
+int Dict_is_rehashing(const Dict *d)
+{
+    return is_rehashing(d);
+}
+
+// Starts moving the entries into a new table of the given size.
+static int start_resize(Dict *d, size_t size)
+{
+    DictEntry **table = calloc(size, sizeof(DictEntry *));
+    if (!table)
+        return 0;
+    if (!d->table[0])
+    {
+        d->table[0] = table;
+        d->size[0] = size;
+        return 1;
+    }
+    d->table[1] = table;
+    d->size[1] = size;
+    d->used[1] = 0;
+    d->rehashidx = 0;
+    return 1;
+}
+
+// Moves up to `steps` non-empty buckets from the old to the new table,
+// visiting at most 10 * steps empty ones. Returns 1 if there is work left.
+int Dict_rehash(Dict *d, int steps)
+{
+    int empty_visits = steps * 10;
+    if (!is_rehashing(d) || d->iterators)
+        return is_rehashing(d);
+
+    while (steps-- && d->used[0] != 0)
+    {
+        while (d->table[0][d->rehashidx] == NULL)
+        {
+            d->rehashidx++;
+            if (--empty_visits == 0)
+                return 1;
+        }
+        DictEntry *e = d->table[0][d->rehashidx];
+        while (e)
+        {
+            DictEntry *next = e->next;
+            size_t idx = d->type->hash(e->key) & (d->size[1] - 1);
+            e->next = d->table[1][idx];
+            d->table[1][idx] = e;
+            d->used[0]--;
+            d->used[1]++;
+            e = next;
+        }
+        d->table[0][d->rehashidx] = NULL;
+        d->rehashidx++;
+    }
+
+    if (d->used[0] == 0)
+    {
+        free(d->table[0]);
+        d->table[0] = d->table[1];
+        d->size[0] = d->size[1];
+        d->used[0] = d->used[1];
+        d->table[1] = NULL;
+        d->size[1] = d->used[1] = 0;
+        d->rehashidx = -1;
+        return 0;
+    }
+    return 1;
+}
+
+static void rehash_step(Dict *d)
+{
+    if (is_rehashing(d))
+        Dict_rehash(d, 1);
+}
+
+DictEntry *Dict_find(Dict *d, const void *key)
+{
+    if (Dict_size(d) == 0)
+        return NULL;
+    rehash_step(d);
+
+    uint64_t h = d->type->hash(key);
+    for (int t = 0; t <= 1; t++)
+    {
+        if (!d->table[t])
+            break;
+        for (DictEntry *e = d->table[t][h & (d->size[t] - 1)]; e; e = e->next)
+            if (d->type->key_equal(e->key, key))
+                return e;
+        if (!is_rehashing(d))
+            break;
+    }
+    return NULL;
+}
+
+// Takes ownership of key and val. Returns 0 (and takes nothing) if the key
+// is already present.
+int Dict_add(Dict *d, void *key, void *val)
+{
+    if (!d->table[0] && !start_resize(d, DICT_INITIAL_SIZE))
+        return 0;
+    if (!is_rehashing(d) && d->used[0] >= d->size[0])
+        start_resize(d, d->size[0] * 2);
+    rehash_step(d);
+
+    if (Dict_find(d, key))
+        return 0;
+
+    DictEntry *e = malloc(sizeof(DictEntry));
+    if (!e)
+        return 0;
+    int t = is_rehashing(d) ? 1 : 0;
+    size_t idx = d->type->hash(key) & (d->size[t] - 1);
+    e->key = key;
+    e->val = val;
+    e->next = d->table[t][idx];
+    d->table[t][idx] = e;
+    d->used[t]++;
+    return 1;
+}
+
+// Returns 1 if the key was found and removed.
+int Dict_delete(Dict *d, const void *key)
+{
+    if (Dict_size(d) == 0)
+        return 0;
+    rehash_step(d);
+
+    uint64_t h = d->type->hash(key);
+    for (int t = 0; t <= 1; t++)
+    {
+        if (!d->table[t])
+            break;
+        DictEntry **link = &d->table[t][h & (d->size[t] - 1)];
+        for (DictEntry *e = *link; e; link = &e->next, e = e->next)
+        {
+            if (!d->type->key_equal(e->key, key))
+                continue;
+            *link = e->next;
+            if (d->type->key_free)
+                d->type->key_free(e->key);
+            if (d->type->val_free)
+                d->type->val_free(e->val);
+            free(e);
+            d->used[t]--;
+
+            // shrink once the table is mostly empty
+            if (!is_rehashing(d) && d->size[0] > DICT_INITIAL_SIZE && d->used[0] * 8 < d->size[0])
+            {
+                size_t size = DICT_INITIAL_SIZE;
+                while (size < d->used[0] * 2)
+                    size *= 2;
+                start_resize(d, size);
+            }
+            return 1;
+        }
+        if (!is_rehashing(d))
+            break;
+    }
+    return 0;
+}
+
+void Dict_iter_init(DictIterator *it, Dict *d)
+{
+    it->d = d;
+    it->table = 0;
+    it->index = 0;
+    it->next = NULL;
+    d->iterators++;
+}
+
+DictEntry *Dict_next(DictIterator *it)
+{
+    Dict *d = it->d;
+    while (!it->next)
+    {
+        if (it->index >= d->size[it->table])
+        {
+            if (it->table == 1 || !is_rehashing(d))
+                return NULL;
+            it->table = 1;
+            it->index = 0;
+            continue;
+        }
+        it->next = d->table[it->table][it->index++];
+    }
+    DictEntry *e = it->next;
+    it->next = e->next;
+    return e;
+}
+
+void Dict_iter_release(DictIterator *it)
+{
+    it->d->iterators--;
+}
+
+static uint64_t rev(uint64_t v)
+{
+    v = ((v >> 1) & 0x5555555555555555ULL) | ((v & 0x5555555555555555ULL) << 1);
+    v = ((v >> 2) & 0x3333333333333333ULL) | ((v & 0x3333333333333333ULL) << 2);
+    v = ((v >> 4) & 0x0f0f0f0f0f0f0f0fULL) | ((v & 0x0f0f0f0f0f0f0f0fULL) << 4);
+    return __builtin_bswap64(v);
+}
+
+static void scan_bucket(DictEntry *e, DictScanFunction fn, void *privdata)
+{
+    while (e)
+    {
+        DictEntry *next = e->next;
+        fn(privdata, e);
+        e = next;
+    }
+}
+
+// Calls fn on the entries of the bucket at cursor and returns the next
+// cursor. The cursor is incremented from its high bit down, so the buckets
+// already visited stay visited when the table doubles or halves between two
+// calls: every entry present for the whole scan is seen at least once, some
+// may be seen twice. While rehashing, a bucket of the smaller table is visited
+// together with the buckets it expands to in the larger one. fn may replace
+// the key (with an equal one) and the value of the entry, but must not add or
+// delete entries.
+uint64_t Dict_scan(Dict *d, uint64_t cursor, DictScanFunction fn, void *privdata)
+{
+    if (Dict_size(d) == 0)
+        return 0;
+
+    if (!is_rehashing(d))
+    {
+        uint64_t m0 = d->size[0] - 1;
+        scan_bucket(d->table[0][cursor & m0], fn, privdata);
+        cursor |= ~m0;
+        return rev(rev(cursor) + 1);
+    }
+
+    int small = d->size[0] <= d->size[1] ? 0 : 1;
+    int large = !small;
+    uint64_t m0 = d->size[small] - 1;
+    uint64_t m1 = d->size[large] - 1;
+    scan_bucket(d->table[small][cursor & m0], fn, privdata);
+    do
+    {
+        scan_bucket(d->table[large][cursor & m1], fn, privdata);
+        cursor |= ~m1;
+        cursor = rev(rev(cursor) + 1);
+    } while (cursor & (m0 ^ m1));
+    return cursor;
+}
+
+// FNV-1a, good enough for short keys.
+uint64_t Dict_gen_hash(const void *data, size_t len)
+{
+    const unsigned char *p = data;
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < len; i++)
+    {
+        h ^= p[i];
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
@@ -0,0 +1,64 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+// Chained hash table with incremental rehashing: when the table grows, the
+// buckets of the old table are moved a few at a time by the following
+// operations (or explicitly by Dict_rehash), so no single call pays for the
+// whole resize.
+
+typedef struct DictEntry
+{
+    struct DictEntry *next;
+    void *key;
+    void *val;
+} DictEntry;
+
+typedef struct DictType
+{
+    uint64_t (*hash)(const void *key);
+    int (*key_equal)(const void *a, const void *b);
+    void (*key_free)(void *key); // May be NULL
+    void (*val_free)(void *val); // May be NULL
+} DictType;
+
+typedef struct Dict
+{
+    const DictType *type;
+    DictEntry **table[2]; // table[1] is only used while rehashing
+    size_t size[2];       // Number of buckets, always a power of two
+    size_t used[2];
+    long rehashidx;       // Next bucket of table[0] to move, -1 when not rehashing
+    int iterators;        // Live iterators, rehashing is paused while > 0
+} Dict;
+
+typedef struct DictIterator
+{
+    Dict *d;
+    int table;
+    size_t index;
+    DictEntry *next;
+} DictIterator;
+
+Dict *Dict_create(const DictType *type);
+void Dict_free(Dict *d);
+
+DictEntry *Dict_find(Dict *d, const void *key);
+int Dict_add(Dict *d, void *key, void *val);
+int Dict_delete(Dict *d, const void *key);
+size_t Dict_size(const Dict *d);
+
+int Dict_rehash(Dict *d, int steps);
+int Dict_is_rehashing(const Dict *d);
+
+// Entries may be looked up while iterating, but not added or deleted.
+void Dict_iter_init(DictIterator *it, Dict *d);
+DictEntry *Dict_next(DictIterator *it);
+void Dict_iter_release(DictIterator *it);
+
+// Stateless scan, for walks spread over time while the dict keeps changing.
+// Start with cursor 0 and pass back the returned cursor until it is 0 again.
+typedef void (*DictScanFunction)(void *privdata, DictEntry *e);
+uint64_t Dict_scan(Dict *d, uint64_t cursor, DictScanFunction fn, void *privdata);
+
+uint64_t Dict_gen_hash(const void *data, size_t len);
@@ -0,0 +1,411 @@
+#include <stdlib.h>
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include "hash.h"
+#include "serial.h"
+
+#define HASH_PACKED_MAX_LEN UINT16_MAX
+
+static uint64_t field_hash(const void *key)
+{
+    return Dict_gen_hash(key, strlen(key));
+}
+
+static int field_equal(const void *a, const void *b)
+{
+    return strcmp(a, b) == 0;
+}
+
+static const DictType hash_dict_type = {field_hash, field_equal, free, free};
+
+static uint8_t field_tag(const char *field, size_t len)
+{
+    return Dict_gen_hash(field, len) >> 56;
+}
+
+static uint16_t get_len(const unsigned char *p)
+{
+    uint16_t len;
+    memcpy(&len, p, sizeof(len));
+    return len;
+}
+
+static void put_len(unsigned char *p, uint16_t len)
+{
+    memcpy(p, &len, sizeof(len));
+}
+
+// Bytes of the entry of field i, the field and its value.
+static size_t packed_entry_size(const HashPacked *p, uint32_t i)
+{
+    const unsigned char *e = p->data + p->offs[i];
+    size_t flen = get_len(e);
+    return 2 * sizeof(uint16_t) + flen + get_len(e + sizeof(uint16_t) + flen);
+}
+
+static int packed_field_equal(const HashPacked *p, uint32_t i, const char *field, size_t len)
+{
+    const unsigned char *e = p->data + p->offs[i];
+    return get_len(e) == len && memcmp(e + sizeof(uint16_t), field, len) == 0;
+}
+
+// Index of field, or -1. The tags of 16 fields are compared at once, and
+// only the fields whose tag matches are compared byte by byte.
+static int packed_find(const HashPacked *p, const char *field, size_t len, uint8_t tag)
+{
+#ifdef __SSE2__
+    const __m128i needle = _mm_set1_epi8((char)tag);
+    for (uint32_t i = 0; i < p->count; i += 16)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i *)(p->tags + i));
+        unsigned mask = _mm_movemask_epi8(_mm_cmpeq_epi8(v, needle));
+        if (p->count - i < 16)
+            mask &= (1u << (p->count - i)) - 1; // Padding past the last field
+        while (mask)
+        {
+            uint32_t j = i + __builtin_ctz(mask);
+            if (packed_field_equal(p, j, field, len))
+                return j;
+            mask &= mask - 1;
+        }
+    }
+#else
+    for (uint32_t i = 0; i < p->count; i++)
+        if (p->tags[i] == tag && packed_field_equal(p, i, field, len))
+            return i;
+#endif
+    return -1;
+}
+
+static int packed_reserve(HashPacked *p, uint32_t count, size_t bytes)
+{
+    if (count > p->cap)
+    {
+        uint32_t cap = p->cap ? p->cap * 2 : 16;
+        while (cap < count)
+            cap *= 2;
+        uint8_t *tags = realloc(p->tags, (cap + 15) & ~15u);
+        if (!tags)
+            return 0;
+        p->tags = tags;
+        uint32_t *offs = realloc(p->offs, cap * sizeof(uint32_t));
+        if (!offs)
+            return 0;
+        p->offs = offs;
+        p->cap = cap;
+    }
+    if (bytes > p->size)
+    {
+        size_t size = p->size ? p->size : 256;
+        while (size < bytes)
+            size *= 2;
+        unsigned char *data = realloc(p->data, size);
+        if (!data)
+            return 0;
+        p->data = data;
+        p->size = size;
+    }
+    return 1;
+}
+
+// Removes the entry of field i from data, keeping its tag and offset slot.
+static void packed_cut(HashPacked *p, uint32_t i)
+{
+    size_t off = p->offs[i], n = packed_entry_size(p, i);
+    memmove(p->data + off, p->data + off + n, p->used - off - n);
+    p->used -= n;
+    for (uint32_t j = 0; j < p->count; j++)
+        if (p->offs[j] > off)
+            p->offs[j] -= n;
+}
+
+static void packed_remove(HashPacked *p, uint32_t i)
+{
+    packed_cut(p, i);
+    p->count--;
+    memmove(p->tags + i, p->tags + i + 1, p->count - i);
+    memmove(p->offs + i, p->offs + i + 1, (p->count - i) * sizeof(uint32_t));
+}
+
+// Appends field and value as field i (a new one when i == count).
+static int packed_append(HashPacked *p, uint32_t i, uint8_t tag, const char *field, size_t flen, const char *value,
+                         size_t vlen)
+{
+    size_t n = 2 * sizeof(uint16_t) + flen + vlen;
+    if (!packed_reserve(p, i + 1, p->used + n))
+        return 0;
+    unsigned char *e = p->data + p->used;
+    put_len(e, flen);
+    memcpy(e + sizeof(uint16_t), field, flen);
+    put_len(e + sizeof(uint16_t) + flen, vlen);
+    memcpy(e + 2 * sizeof(uint16_t) + flen, value, vlen);
+    p->tags[i] = tag;
+    p->offs[i] = p->used;
+    p->used += n;
+    if (i == p->count)
+        p->count++;
+    return 1;
+}
+
+static void packed_free(HashPacked *p)
+{
+    free(p->tags);
+    free(p->offs);
+    free(p->data);
+}
+
+static char *strndup_checked(const char *s, size_t len)
+{
+    char *copy = malloc(len + 1);
+    if (copy)
+    {
+        memcpy(copy, s, len);
+        copy[len] = '\0';
+    }
+    return copy;
+}
+
+static int dict_set(Dict *d, const char *field, size_t flen, const char *value, size_t vlen)
+{
+    char *v = strndup_checked(value, vlen);
+    if (!v)
+        return -1;
+    DictEntry *de = Dict_find(d, field);
+    if (de)
+    {
+        free(de->val);
+        de->val = v;
+        return 0;
+    }
+    char *f = strndup_checked(field, flen);
+    if (!f || !Dict_add(d, f, v))
+    {
+        free(f);
+        free(v);
+        return -1;
+    }
+    return 1;
+}
+
+// Moves the fields to a Dict.
+static int convert_to_dict(Hash *h)
+{
+    Dict *d = Dict_create(&hash_dict_type);
+    if (!d)
+        return 0;
+    HashPacked *p = &h->packed;
+    for (uint32_t i = 0; i < p->count; i++)
+    {
+        const unsigned char *e = p->data + p->offs[i];
+        size_t flen = get_len(e);
+        const unsigned char *v = e + sizeof(uint16_t) + flen;
+        char field[HASH_PACKED_MAX_LEN + 1];
+        memcpy(field, e + sizeof(uint16_t), flen);
+        field[flen] = '\0';
+        if (dict_set(d, field, flen, (const char *)v + sizeof(uint16_t), get_len(v)) < 0)
+        {
+            Dict_free(d);
+            return 0;
+        }
+    }
+    packed_free(p);
+    h->encoding = HASH_DICT;
+    h->dict = d;
+    return 1;
+}
+
+Hash *Hash_create(void)
+{
+    return calloc(1, sizeof(Hash));
+}
+
+void Hash_free(Hash *h)
+{
+    if (!h)
+        return;
+    if (h->encoding == HASH_DICT)
+        Dict_free(h->dict);
+    else
+        packed_free(&h->packed);
+    free(h);
+}
+
+const char *Hash_get(const Hash *h, const char *field, size_t *len)
+{
+    if (h->encoding == HASH_DICT)
+    {
+        DictEntry *de = Dict_find(h->dict, field);
+        if (!de)
+            return NULL;
+        *len = strlen(de->val);
+        return de->val;
+    }
+    size_t flen = strlen(field);
+    int i = packed_find(&h->packed, field, flen, field_tag(field, flen));
+    if (i < 0)
+        return NULL;
+    const unsigned char *v = h->packed.data + h->packed.offs[i] + sizeof(uint16_t) + flen;
+    *len = get_len(v);
+    return (const char *)v + sizeof(uint16_t);
+}
+
+int Hash_set(Hash *h, const char *field, const char *value, size_t max_entries, size_t max_value)
+{
+    size_t flen = strlen(field), vlen = strlen(value);
+    if (h->encoding == HASH_DICT)
+        return dict_set(h->dict, field, flen, value, vlen);
+
+    HashPacked *p = &h->packed;
+    uint8_t tag = field_tag(field, flen);
+    int i = packed_find(p, field, flen, tag);
+    if (flen > max_value || vlen > max_value || flen > HASH_PACKED_MAX_LEN || vlen > HASH_PACKED_MAX_LEN ||
+        (i < 0 && p->count >= max_entries))
+    {
+        if (!convert_to_dict(h))
+            return -1;
+        return dict_set(h->dict, field, flen, value, vlen);
+    }
+    if (i < 0)
+        return packed_append(p, p->count, tag, field, flen, value, vlen) ? 1 : -1;
+
+    // Rewrite the entry at the end, as the value size may differ
+    const unsigned char *e = p->data + p->offs[i];
+    if (get_len(e + sizeof(uint16_t) + flen) == vlen)
+    {
+        memcpy((unsigned char *)e + 2 * sizeof(uint16_t) + flen, value, vlen);
+        return 0;
+    }
+    if (!packed_reserve(p, p->count, p->used + 2 * sizeof(uint16_t) + flen + vlen))
+        return -1;
+    packed_cut(p, i);
+    packed_append(p, i, tag, field, flen, value, vlen);
+    return 0;
+}
+
+int Hash_delete(Hash *h, const char *field)
+{
+    if (h->encoding == HASH_DICT)
+        return Dict_delete(h->dict, field);
+    size_t flen = strlen(field);
+    int i = packed_find(&h->packed, field, flen, field_tag(field, flen));
+    if (i < 0)
+        return 0;
+    packed_remove(&h->packed, i);
+    return 1;
+}
+
+uint64_t Hash_size(const Hash *h)
+{
+    return h->encoding == HASH_DICT ? Dict_size(h->dict) : h->packed.count;
+}
+
+size_t Hash_bytes(const Hash *h)
+{
+    if (h->encoding == HASH_PACKED)
+        return sizeof(Hash) + h->packed.cap * (1 + sizeof(uint32_t)) + h->packed.size;
+    // Entries and buckets, plus the strings roughly sized at 16 bytes each
+    return sizeof(Hash) + sizeof(Dict) + Dict_size(h->dict) * (sizeof(DictEntry) + 2 * 16) +
+           (h->dict->size[0] + h->dict->size[1]) * sizeof(DictEntry *);
+}
+
+void Hash_iter_init(HashIter *it, const Hash *h)
+{
+    it->h = h;
+    it->index = 0;
+    if (h->encoding == HASH_DICT)
+        Dict_iter_init(&it->di, h->dict);
+}
+
+int Hash_next(HashIter *it, const char **field, size_t *flen, const char **value, size_t *vlen)
+{
+    if (it->h->encoding == HASH_DICT)
+    {
+        DictEntry *de = Dict_next(&it->di);
+        if (!de)
+            return 0;
+        *field = de->key;
+        *flen = strlen(de->key);
+        *value = de->val;
+        *vlen = strlen(de->val);
+        return 1;
+    }
+    const HashPacked *p = &it->h->packed;
+    if (it->index == p->count)
+        return 0;
+    const unsigned char *e = p->data + p->offs[it->index++];
+    *flen = get_len(e);
+    *field = (const char *)e + sizeof(uint16_t);
+    *vlen = get_len(e + sizeof(uint16_t) + *flen);
+    *value = (const char *)e + 2 * sizeof(uint16_t) + *flen;
+    return 1;
+}
+
+void Hash_iter_release(HashIter *it)
+{
+    if (it->h->encoding == HASH_DICT)
+        Dict_iter_release(&it->di);
+}
+
+size_t Hash_dump(const Hash *h, unsigned char *out)
+{
+    uint8_t encoding = h->encoding;
+    uint64_t count = Hash_size(h);
+    size_t off = Serial_put(out, 0, &encoding, sizeof(encoding));
+    off = Serial_put(out, off, &count, sizeof(count));
+    HashIter it;
+    const char *field, *value;
+    size_t flen, vlen;
+    Hash_iter_init(&it, h);
+    while (Hash_next(&it, &field, &flen, &value, &vlen))
+    {
+        uint32_t len = flen;
+        off = Serial_put(out, off, &len, sizeof(len));
+        off = Serial_put(out, off, field, flen);
+        len = vlen;
+        off = Serial_put(out, off, &len, sizeof(len));
+        off = Serial_put(out, off, value, vlen);
+    }
+    Hash_iter_release(&it);
+    return off;
+}
+
+// Reads a length-prefixed string into a NUL-terminated copy.
+static char *get_string(SerialReader *r)
+{
+    uint32_t len;
+    if (!Serial_get(r, &len, sizeof(len)) || len > (size_t)(r->end - r->p) || memchr(r->p, '\0', len))
+        return NULL;
+    char *str = strndup_checked((const char *)r->p, len);
+    r->p += len;
+    return str;
+}
+
+Hash *Hash_load(const unsigned char *in, size_t len)
+{
+    SerialReader r = {in, in + len};
+    uint8_t encoding;
+    uint64_t count;
+    Hash *h = Hash_create();
+    if (!h || !Serial_get(&r, &encoding, sizeof(encoding)) || !Serial_get(&r, &count, sizeof(count)) ||
+        encoding > HASH_DICT || (encoding == HASH_DICT && !convert_to_dict(h)))
+        goto err;
+    for (uint64_t i = 0; i < count; i++)
+    {
+        char *field = get_string(&r), *value = field ? get_string(&r) : NULL;
+        // Limits that keep the encoding the hash had
+        int rv = value ? Hash_set(h, field, value, SIZE_MAX, SIZE_MAX) : 0;
+        free(field);
+        free(value);
+        if (rv != 1)
+            goto err;
+    }
+    if (r.p != r.end)
+        goto err;
+    return h;
+
+err:
+    Hash_free(h);
+    return NULL;
+}
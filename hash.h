@@ -0,0 +1,63 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include "dict.h"
+
+// Field-value map. Small hashes are packed: the fields and values back to
+// back in one buffer, plus one tag byte per field (8 bits of its hash) that
+// a lookup scans 16 at a time with a SIMD byte compare before comparing any
+// field. A hash that gets more than max_entries fields, or a field or value
+// longer than max_value bytes, moves to a Dict for good.
+
+enum
+{
+    HASH_PACKED,
+    HASH_DICT,
+};
+
+typedef struct HashPacked
+{
+    uint32_t count, cap;   // Fields, and room in tags and offs
+    uint32_t used, size;   // Bytes of data
+    uint8_t *tags;         // cap rounded up to 16, so whole vectors can be loaded
+    uint32_t *offs;        // Offset in data of each field
+    unsigned char *data;   // uint16_t length and bytes of each field, then of its value
+} HashPacked;
+
+typedef struct Hash
+{
+    int encoding;
+    union
+    {
+        HashPacked packed;
+        Dict *dict; // char * field -> char * value
+    };
+} Hash;
+
+typedef struct HashIter
+{
+    const Hash *h;
+    uint32_t index;
+    DictIterator di;
+} HashIter;
+
+Hash *Hash_create(void);
+void Hash_free(Hash *h);
+
+// Returns the value of field and its length in *len, or NULL if missing.
+const char *Hash_get(const Hash *h, const char *field, size_t *len);
+// Returns 1 if the field is new, 0 if its value was replaced, -1 if out of
+// memory.
+int Hash_set(Hash *h, const char *field, const char *value, size_t max_entries, size_t max_value);
+int Hash_delete(Hash *h, const char *field);
+uint64_t Hash_size(const Hash *h);
+size_t Hash_bytes(const Hash *h);
+
+// The hash must not change while iterating.
+void Hash_iter_init(HashIter *it, const Hash *h);
+int Hash_next(HashIter *it, const char **field, size_t *flen, const char **value, size_t *vlen);
+void Hash_iter_release(HashIter *it);
+
+// Snapshot encoding, see Bloom_dump() in bloom.h.
+size_t Hash_dump(const Hash *h, unsigned char *out);
+Hash *Hash_load(const unsigned char *in, size_t len);
@@ -3,111 +3,714 @@
 #include <string.h>
 #include <stdint.h>
 #include <math.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "murmurhash.h"
 
 
 #define HLL_HASH_SIZE 64
-#define HLL_P 16      // Number of bits used for the index (should be 4 <= p <= 16)
-#define HLL_R (HLL_HASH_SIZE - HLL_P)
-#define HLL_M (1 << HLL_P)
-#define HLL_INDEX_MASK ( HLL_M - 1)
+#define HLL_P_MIN 4   // Bounds of the number of bits used for the index, chosen per sketch.
+#define HLL_P_MAX 18
+#define HLL_P_DEFAULT 16
+#define HLL_R(p) (HLL_HASH_SIZE - (p))
+#define HLL_M(p) (1U << (p))
 
-#define HLL_ALPHA (0.7213 / (1 + 1.079 / HLL_M))
+#define HLL_ALPHA_INF 0.721347520444481703680 // 1 / (2 ln 2), the bias constant as m goes to infinity.
 
-#define HLL_E_FILTER_1 (2.5f * HLL_M)
-#define HLL_E_FILTER_2 ((1ULL << 32) / 30.0f)
+#define HLL_SPARSE 0
+#define HLL_DENSE 1
+#define HLL_SPARSE_MAX_BYTES 3072   // A sparse sketch is converted to dense past this size.
+#define HLL_RANK_BITS 6             // Ranks are at most HLL_R(HLL_P_MIN) + 1 = 61, so they fit in 6 bits.
+#define HLL_RANK_MASK ((1 << HLL_RANK_BITS) - 1)
+#define HLL_BATCH 8                 // Items hashed, then prefetched, together by the batch aggregates.
+#define HLL_DENSE_BYTES(p) (HLL_M(p) * HLL_RANK_BITS / 8 + 1) // One spare byte, so that a register access can always read two bytes.
 
 
+// A sketch starts sparse: only its nonzero registers are stored, in index order, each as the varint
+// ((index - previous index) << HLL_RANK_BITS | rank). Most sketches see few items and stay a few bytes
+// long; once the list passes HLL_SPARSE_MAX_BYTES (or the size of the dense array, for a small p) it is
+// expanded into the dense array of 2^p registers.
+// Dense registers are packed HLL_RANK_BITS each, register i at bit i * 6 counting from the low bit of the
+// first byte, so 4 registers take 3 bytes.
 typedef struct {
-    uint8_t registers[HLL_M];   // The registers have to count the leading zeroes, since the hash is 64 bits long, the registers are 8 bits long.
+    uint8_t encoding;           // HLL_SPARSE or HLL_DENSE.
+    uint8_t p;                  // Number of bits used for the index, there are 2^p registers.
+    uint8_t* registers;         // Dense: the registers have to count the leading zeroes, at most HLL_R(p) + 1, so 6 bits each.
+    uint8_t* sparse;            // Sparse: the list of nonzero registers.
+    uint32_t sparse_len, sparse_cap;
+    uint32_t sparse_max;        // The sparse list is promoted past this size.
     uint32_t zero_registers;    // The number of registers equal to 0.
+    uint8_t dirty;              // Set when a register grows, cached is only valid while clear.
+    double cached;              // The last estimate of hllCount.
 } HyperLogLog;
 
-uint64_t MurmurHash64A ( const void * key, int len, uint64_t seed )
-{
-  const uint64_t m = 0xc6a4a7935bd1e995;
-  const int r = 47;
-
-  uint64_t h = seed ^ (len * m);
-
-  const uint64_t * data = (const uint64_t *)key;
-  const uint64_t * end = data + (len/8);
-
-  while(data != end)
-  {
-    uint64_t k = *data++;
-
-    k *= m; 
-    k ^= k >> r; 
-    k *= m; 
-    
-    h ^= k;
-    h *= m; 
-  }
-
-  const unsigned char * data2 = (const unsigned char*)data;
-
-  switch(len & 7)
-  {
-  case 7: h ^= ((uint64_t) data2[6]) << 48; /* fall through */
-  case 6: h ^= ((uint64_t) data2[5]) << 40; /* fall through */
-  case 5: h ^= ((uint64_t) data2[4]) << 32; /* fall through */
-  case 4: h ^= ((uint64_t) data2[3]) << 24; /* fall through */
-  case 3: h ^= ((uint64_t) data2[2]) << 16; /* fall through */
-  case 2: h ^= ((uint64_t) data2[1]) << 8;  /* fall through */
-  case 1: h ^= ((uint64_t) data2[0]);       /* fall through */
-          h *= m;
-  };
- 
-  h ^= h >> r;
-  h *= m;
-  h ^= h >> r;
-
-  return h;
-} 
-
-
-void hllInit(HyperLogLog* hll) {
-    memset(hll->registers, 0, sizeof(hll->registers));
-    hll->zero_registers = HLL_M;
-}
-
-void hllAggregate(HyperLogLog* hll, void* data, size_t size) {
-    uint64_t hash, index;
-    uint8_t count;
-    
-    hash = MurmurHash64A(data, size, 0);
-    index = hash & HLL_INDEX_MASK;
+// Returns -1 if p is out of [HLL_P_MIN, HLL_P_MAX].
+int hllInit(HyperLogLog* hll, int p) {
+    if (p < HLL_P_MIN || p > HLL_P_MAX)
+        return -1;
+    uint32_t m = HLL_M(p);
+
+    memset(hll, 0, sizeof(*hll));
+    hll->encoding = HLL_SPARSE;
+    hll->p = p;
+    hll->zero_registers = m;
+    hll->sparse_max = HLL_DENSE_BYTES(p) < HLL_SPARSE_MAX_BYTES ? HLL_DENSE_BYTES(p) : HLL_SPARSE_MAX_BYTES;
+    return 0;
+}
+
+void hllFree(HyperLogLog* hll) {
+    free(hll->registers);
+    free(hll->sparse);
+}
+
+static size_t hllVarintPut(uint8_t* p, uint32_t v) {
+    size_t n = 0;
+    while (v >= 0x80) {
+        p[n++] = (v & 0x7f) | 0x80;
+        v >>= 7;
+    }
+    p[n++] = v;
+    return n;
+}
 
-    hash = hash >> HLL_P; // Discarding the first p bits used for the index
-    count = __builtin_clzll(hash) + 1; // Count leading zeros
+static uint32_t hllVarintGet(const uint8_t** p) {
+    uint32_t v = 0;
+    for (int shift = 0;; shift += 7) {
+        uint8_t b = *(*p)++;
+        v |= (uint32_t)(b & 0x7f) << shift;
+        if (!(b & 0x80))
+            return v;
+    }
+}
+
+// A register straddles at most two bytes. For a register starting on a byte boundary the shifts by
+// 8 - shift bits select nothing from the second byte, so no branch is needed.
+static inline uint8_t hllDenseGet(const uint8_t* registers, uint32_t index) {
+    uint32_t byte = index * HLL_RANK_BITS / 8, shift = index * HLL_RANK_BITS & 7;
+    return ((registers[byte] >> shift) | (registers[byte + 1] << (8 - shift))) & HLL_RANK_MASK;
+}
+
+static inline void hllDenseSet(uint8_t* registers, uint32_t index, uint8_t value) {
+    uint32_t byte = index * HLL_RANK_BITS / 8, shift = index * HLL_RANK_BITS & 7;
+    registers[byte] = (registers[byte] & ~(HLL_RANK_MASK << shift)) | value << shift;
+    registers[byte + 1] = (registers[byte + 1] & ~(HLL_RANK_MASK >> (8 - shift))) | value >> (8 - shift);
+}
+
+// Unpacks n registers from first (both multiples of 4) into one byte each.
+static void hllDenseUnpack(const uint8_t* registers, uint32_t first, uint32_t n, uint8_t* out) {
+    const uint8_t* p = registers + first / 4 * 3;
+    for (uint32_t i = 0; i < n; i += 4, p += 3) {
+        uint32_t w = p[0] | p[1] << 8 | p[2] << 16;
+        out[i] = w & HLL_RANK_MASK;
+        out[i + 1] = w >> 6 & HLL_RANK_MASK;
+        out[i + 2] = w >> 12 & HLL_RANK_MASK;
+        out[i + 3] = w >> 18;
+    }
+}
 
-    if (count > hll->registers[index]) {
-        if (hll->registers[index] == 0)
+// Packs n registers of one byte each into the registers from first (both multiples of 4).
+static void hllDensePack(uint8_t* registers, uint32_t first, uint32_t n, const uint8_t* in) {
+    uint8_t* p = registers + first / 4 * 3;
+    for (uint32_t i = 0; i < n; i += 4, p += 3) {
+        uint32_t w = in[i] | in[i + 1] << 6 | in[i + 2] << 12 | in[i + 3] << 18;
+        p[0] = w;
+        p[1] = w >> 8;
+        p[2] = w >> 16;
+    }
+}
+
+// Expands the sparse list into the dense registers.
+static int hllPromote(HyperLogLog* hll) {
+    uint8_t* registers = calloc(HLL_DENSE_BYTES(hll->p), 1);
+    if (!registers)
+        return -1;
+
+    const uint8_t* p = hll->sparse;
+    const uint8_t* end = p + hll->sparse_len;
+    uint32_t index = 0;
+    while (p < end) {
+        uint32_t v = hllVarintGet(&p);
+        index += v >> HLL_RANK_BITS;
+        hllDenseSet(registers, index, v & HLL_RANK_MASK);
+    }
+
+    free(hll->sparse);
+    hll->sparse = NULL;
+    hll->sparse_len = hll->sparse_cap = 0;
+    hll->registers = registers;
+    hll->encoding = HLL_DENSE;
+    return 0;
+}
+
+// Replaces the len bytes at off in the sparse list with the n bytes of buf.
+static int hllSparseSplice(HyperLogLog* hll, uint32_t off, uint32_t len, const uint8_t* buf, uint32_t n) {
+    uint32_t need = hll->sparse_len - len + n;
+    if (need > hll->sparse_cap) {
+        uint32_t cap = hll->sparse_cap ? hll->sparse_cap * 2 : 16;
+        while (cap < need)
+            cap *= 2;
+        uint8_t* sparse = realloc(hll->sparse, cap);
+        if (!sparse)
+            return -1;
+        hll->sparse = sparse;
+        hll->sparse_cap = cap;
+    }
+    memmove(hll->sparse + off + n, hll->sparse + off + len, hll->sparse_len - off - len);
+    memcpy(hll->sparse + off, buf, n);
+    hll->sparse_len = need;
+    return 0;
+}
+
+// Raises register index to count in the sparse list.
+static int hllSparseSet(HyperLogLog* hll, uint32_t index, uint8_t count) {
+    const uint8_t* p = hll->sparse;
+    const uint8_t* end = p + hll->sparse_len;
+    uint32_t prev = 0;
+    uint8_t buf[10];
+    int inserted = 0;
+
+    while (p < end && !inserted) {
+        uint8_t* entry = (uint8_t*)p;
+        uint32_t v = hllVarintGet(&p);
+        uint32_t cur = prev + (v >> HLL_RANK_BITS);
+        if (cur == index) {
+            // Same delta, so the new varint has the same length.
+            if (count > (v & HLL_RANK_MASK)) {
+                hllVarintPut(entry, (v & ~HLL_RANK_MASK) | count);
+                hll->dirty = 1;
+            }
+            return 0;
+        }
+        if (cur > index) {
+            // Insert before this entry, whose delta becomes relative to the new one.
+            size_t n = hllVarintPut(buf, (index - prev) << HLL_RANK_BITS | count);
+            n += hllVarintPut(buf + n, (cur - index) << HLL_RANK_BITS | (v & HLL_RANK_MASK));
+            if (hllSparseSplice(hll, entry - hll->sparse, p - entry, buf, n) < 0)
+                return -1;
+            inserted = 1;
+        }
+        prev = cur;
+    }
+    if (!inserted) {
+        size_t n = hllVarintPut(buf, (index - prev) << HLL_RANK_BITS | count);
+        if (hllSparseSplice(hll, hll->sparse_len, 0, buf, n) < 0)
+            return -1;
+    }
+
+    hll->zero_registers--;
+    hll->dirty = 1;
+    if (hll->sparse_len > hll->sparse_max)
+        return hllPromote(hll);
+    return 0;
+}
+
+// Raises register index to count. Returns -1 if out of memory.
+static int hllSet(HyperLogLog* hll, uint32_t index, uint8_t count) {
+    if (hll->encoding == HLL_SPARSE)
+        return hllSparseSet(hll, index, count);
+
+    uint8_t old = hllDenseGet(hll->registers, index);
+    if (count > old) {
+        if (old == 0)
             hll->zero_registers--;
-        hll->registers[index] = count;
+        hllDenseSet(hll->registers, index, count);
+        hll->dirty = 1;
+    }
+    return 0;
+}
+
+// Splits a hash into the register it goes to, its low p bits, and its rank: the leading zeros of the
+// remaining HLL_R(p) bits plus one, with a stop bit at the end so that an all-zero remainder gives
+// HLL_R(p) + 1.
+static inline void hllHashRegister(uint8_t p, uint64_t hash, uint32_t* index, uint8_t* count) {
+    *index = hash & (HLL_M(p) - 1);
+    *count = __builtin_clzll((hash >> p << p) | (1ULL << (p - 1))) + 1;
+}
+
+// Returns -1 if out of memory.
+int hllAggregate(HyperLogLog* hll, void* data, size_t size) {
+    uint32_t index;
+    uint8_t count;
+
+    hllHashRegister(hll->p, MurmurHash64A(data, size, 0), &index, &count);
+    return hllSet(hll, index, count);
+}
+
+// The bijective finalizer of splitmix64: every input bit affects every output bit, which is all the
+// register index and rank need from a hash, at a fraction of the cost of hashing 8 bytes with Murmur.
+static inline uint64_t hllMix64(uint64_t x) {
+    x += 0x9e3779b97f4a7c15ULL;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+// Adds an integer ID. Integers hash differently from their bytes passed to hllAggregate, so an ID must
+// always be added the same way; hllAggregateU32(x) and hllAggregateU64(x) agree. Returns -1 if out of
+// memory.
+int hllAggregateU64(HyperLogLog* hll, uint64_t value) {
+    uint32_t index;
+    uint8_t count;
+
+    hllHashRegister(hll->p, hllMix64(value), &index, &count);
+    return hllSet(hll, index, count);
+}
+
+int hllAggregateU32(HyperLogLog* hll, uint32_t value) {
+    return hllAggregateU64(hll, value);
+}
+
+// The items of a batch aggregate, one of the kinds below.
+enum {
+    HLL_INPUT_BYTES,
+    HLL_INPUT_U64,
+    HLL_INPUT_U32,
+};
+
+typedef struct {
+    int kind;
+    void** items;               // HLL_INPUT_BYTES: the items and their sizes.
+    const size_t* sizes;
+    const void* values;         // HLL_INPUT_U64 or HLL_INPUT_U32: the integers.
+} HllInput;
+
+// One loop per kind, so that the loop over a batch has no branch but its own.
+static inline void hllHashInput(const HllInput* in, size_t start, size_t len, uint64_t* hashes) {
+    switch (in->kind) {
+    case HLL_INPUT_BYTES:
+        for (size_t i = 0; i < len; i++)
+            hashes[i] = MurmurHash64A(in->items[start + i], in->sizes[start + i], 0);
+        break;
+    case HLL_INPUT_U64: {
+        const uint64_t* values = (const uint64_t*)in->values + start;
+        for (size_t i = 0; i < len; i++)
+            hashes[i] = hllMix64(values[i]);
+        break;
+    }
+    case HLL_INPUT_U32: {
+        const uint32_t* values = (const uint32_t*)in->values + start;
+        for (size_t i = 0; i < len; i++)
+            hashes[i] = hllMix64(values[i]);
+        break;
+    }
+    }
+}
+
+// Adds n items over batches of HLL_BATCH items: the register lines of one batch are prefetched, the
+// next batch is hashed while they load, and only then is the first batch applied, so the register
+// updates find their lines in cache. Returns -1 if out of memory.
+static int hllAggregateInput(HyperLogLog* hll, const HllInput* in, size_t n) {
+    uint64_t hashes[HLL_BATCH];
+    uint32_t index[HLL_BATCH];
+    uint8_t count[HLL_BATCH];
+    size_t pending = 0;
+
+    for (size_t start = 0;; start += HLL_BATCH) {
+        size_t len = start < n ? (n - start < HLL_BATCH ? n - start : HLL_BATCH) : 0;
+        hllHashInput(in, start, len, hashes);
+
+        if (hll->encoding == HLL_DENSE) {
+            for (size_t i = 0; i < pending; i++) {
+                uint8_t old = hllDenseGet(hll->registers, index[i]);
+                if (count[i] > old) {
+                    hll->zero_registers -= old == 0;
+                    hllDenseSet(hll->registers, index[i], count[i]);
+                    hll->dirty = 1;
+                }
+            }
+        } else {
+            for (size_t i = 0; i < pending; i++)
+                if (hllSet(hll, index[i], count[i]) < 0)
+                    return -1;
+        }
+        if (len == 0)
+            return 0;
+
+        for (size_t i = 0; i < len; i++) {
+            hllHashRegister(hll->p, hashes[i], &index[i], &count[i]);
+            if (hll->encoding == HLL_DENSE)
+                __builtin_prefetch(hll->registers + index[i] * HLL_RANK_BITS / 8, 1);
+        }
+        pending = len;
+    }
+}
+
+// Adds n items, the same as n calls of hllAggregate. Returns -1 if out of memory.
+int hllAggregateMany(HyperLogLog* hll, void** items, const size_t* sizes, size_t n) {
+    HllInput in = {HLL_INPUT_BYTES, items, sizes, NULL};
+    return hllAggregateInput(hll, &in, n);
+}
+
+// Adds n IDs, the same as n calls of hllAggregateU64 or hllAggregateU32. Returns -1 if out of memory.
+int hllAggregateU64Array(HyperLogLog* hll, const uint64_t* values, size_t n) {
+    HllInput in = {HLL_INPUT_U64, NULL, NULL, values};
+    return hllAggregateInput(hll, &in, n);
+}
+
+int hllAggregateU32Array(HyperLogLog* hll, const uint32_t* values, size_t n) {
+    HllInput in = {HLL_INPUT_U32, NULL, NULL, values};
+    return hllAggregateInput(hll, &in, n);
+}
+
+// Folds the registers of src into dst, which has the same or a lower precision, so that dst ends up as
+// if it had seen the items of src too. Register j of src maps to register j mod 2^dst.p; the index bits
+// dst no longer uses become the top of its rank window, which only matters to a src register whose own
+// window was all zeros. Returns -1 if dst has a higher precision or is out of memory.
+int hllDownsample(HyperLogLog* dst, const HyperLogLog* src) {
+    if (dst->p > src->p)
+        return -1;
+    uint32_t shift = src->p - dst->p, mask = HLL_M(dst->p) - 1;
+    const uint8_t* p = src->sparse;
+    const uint8_t* end = p + src->sparse_len;
+    uint32_t j = 0;
+
+    for (uint32_t i = 0; i < HLL_M(src->p); i++) {
+        uint8_t count;
+        if (src->encoding == HLL_SPARSE) {
+            if (p == end)
+                break;
+            uint32_t v = hllVarintGet(&p);
+            j += v >> HLL_RANK_BITS;
+            count = v & HLL_RANK_MASK;
+        } else {
+            j = i;
+            count = hllDenseGet(src->registers, j);
+            if (count == 0)
+                continue;
+        }
+        if (count > HLL_R(src->p)) {
+            // Leading zeros of the shift bits j >> dst->p, read from their top.
+            uint32_t high = j >> dst->p;
+            count = HLL_R(src->p) + (high ? shift - (32 - __builtin_clz(high)) : shift) + 1;
+        }
+        if (hllSet(dst, j & mask, count) < 0)
+            return -1;
     }
+    return 0;
 }
 
-double hllCount(HyperLogLog* hll) {    
-    double sum, E = 0;
-    uint8_t* registers = hll->registers;
+// Byte-wise max of n unpacked registers (a multiple of 16) into dst.
+static void hllMaxRegisters(uint8_t* dst, const uint8_t* src, uint32_t n) {
+#ifdef __SSE2__
+    for (uint32_t i = 0; i < n; i += 16) {
+        __m128i a = _mm_loadu_si128((const __m128i*)(dst + i));
+        __m128i b = _mm_loadu_si128((const __m128i*)(src + i));
+        _mm_storeu_si128((__m128i*)(dst + i), _mm_max_epu8(a, b));
+    }
+#else
+    for (uint32_t i = 0; i < n; i++)
+        dst[i] = src[i] > dst[i] ? src[i] : dst[i];
+#endif
+}
 
-    for (int i = 0; i < HLL_M; i++)
-        sum += pow(2.0, -registers[i]);
-    sum = 1 / sum;
+// Counts the zeros among n unpacked registers (a multiple of 16).
+static uint32_t hllCountZeros(const uint8_t* registers, uint32_t n) {
+    uint32_t zeros = 0;
+#ifdef __SSE2__
+    const __m128i zero = _mm_setzero_si128();
+    for (uint32_t i = 0; i < n; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(registers + i));
+        zeros += __builtin_popcount(_mm_movemask_epi8(_mm_cmpeq_epi8(v, zero)));
+    }
+#else
+    for (uint32_t i = 0; i < n; i++)
+        zeros += registers[i] == 0;
+#endif
+    return zeros;
+}
+
+// A position in the sparse list of a sketch being merged.
+typedef struct {
+    const uint8_t* p;
+    const uint8_t* end;
+    uint32_t index;
+    uint8_t count;      // 0 once the list is exhausted.
+} HllSparseCursor;
 
-    E = HLL_ALPHA * (HLL_M << 1) * sum;
+static void hllCursorNext(HllSparseCursor* c) {
+    if (c->p == c->end) {
+        c->count = 0;
+        return;
+    }
+    uint32_t v = hllVarintGet(&c->p);
+    c->index += v >> HLL_RANK_BITS;
+    c->count = v & HLL_RANK_MASK;
+}
 
-    if (E <= HLL_E_FILTER_1) {
-        uint32_t V = hll->zero_registers;
-        if (V != 0)
-            return HLL_M * log(HLL_M / (double)V);
-        else
-            return E;
-    } else if (E <= HLL_E_FILTER_2)
+// Merges sketches of the precision of the dense dst in one pass over its registers, a chunk at a time:
+// each chunk is unpacked once, raised to the byte-wise max of every source, counted for zeros and
+// packed back.
+static int hllDenseMerge(HyperLogLog* dst, HyperLogLog** srcs, size_t n) {
+    HllSparseCursor* cursors = calloc(n ? n : 1, sizeof(HllSparseCursor));
+    if (!cursors)
+        return -1;
+    for (size_t i = 0; i < n; i++) {
+        if (srcs[i]->encoding != HLL_SPARSE)
+            continue;
+        cursors[i].p = srcs[i]->sparse;
+        cursors[i].end = srcs[i]->sparse + srcs[i]->sparse_len;
+        hllCursorNext(&cursors[i]);
+    }
+
+    uint32_t m = HLL_M(dst->p), zeros = 0;
+    uint8_t merged[1024], before[1024], registers[1024];
+    for (uint32_t first = 0; first < m; first += sizeof(merged)) {
+        uint32_t len = m - first < sizeof(merged) ? m - first : sizeof(merged);
+        hllDenseUnpack(dst->registers, first, len, merged);
+        memcpy(before, merged, len);
+        for (size_t i = 0; i < n; i++) {
+            if (srcs[i]->p != dst->p)
+                continue;
+            if (srcs[i]->encoding == HLL_DENSE) {
+                hllDenseUnpack(srcs[i]->registers, first, len, registers);
+                hllMaxRegisters(merged, registers, len);
+                continue;
+            }
+            HllSparseCursor* c = &cursors[i];
+            for (; c->count && c->index < first + len; hllCursorNext(c))
+                if (c->count > merged[c->index - first])
+                    merged[c->index - first] = c->count;
+        }
+        if (memcmp(merged, before, len)) {
+            hllDensePack(dst->registers, first, len, merged);
+            dst->dirty = 1;
+        }
+        zeros += hllCountZeros(merged, len);
+    }
+    dst->zero_registers = zeros;
+    free(cursors);
+    return 0;
+}
+
+// Merges n sketches into dst, which then counts the union of their items. The sources may have a higher
+// precision than dst, and are folded in with hllDownsample. While dst and the sources of its precision
+// are all sparse, the union stays sparse; otherwise dst becomes dense and they are merged in one pass.
+// Returns -1 if a source has a lower precision than dst or out of memory.
+int hllMerge(HyperLogLog* dst, HyperLogLog** srcs, size_t n) {
+    int dense = dst->encoding == HLL_DENSE;
+    for (size_t i = 0; i < n; i++) {
+        if (srcs[i]->p < dst->p)
+            return -1;
+        if (srcs[i]->p == dst->p && srcs[i]->encoding == HLL_DENSE)
+            dense = 1;
+    }
+    for (size_t i = 0; i < n; i++)
+        if ((srcs[i]->p > dst->p || !dense) && hllDownsample(dst, srcs[i]) < 0)
+            return -1;
+    if (!dense)
+        return 0;
+    if (dst->encoding == HLL_SPARSE && hllPromote(dst) < 0)
+        return -1;
+    return hllDenseMerge(dst, srcs, n);
+}
+
+// Counts the registers holding each rank.
+static void hllHistogram(const HyperLogLog* hll, uint32_t hist[HLL_RANK_MASK + 1]) {
+    memset(hist, 0, (HLL_RANK_MASK + 1) * sizeof(uint32_t));
+
+    if (hll->encoding == HLL_SPARSE) {
+        const uint8_t* p = hll->sparse;
+        const uint8_t* end = p + hll->sparse_len;
+        while (p < end)
+            hist[hllVarintGet(&p) & HLL_RANK_MASK]++;
+        hist[0] = hll->zero_registers;
+        return;
+    }
+
+    // Four partial histograms, so that runs of equal registers do not serialize on one counter. The
+    // registers are read straight from the packed words, 4 from every 3 bytes.
+    uint32_t partial[4][HLL_RANK_MASK + 1] = {{0}};
+    const uint8_t* p = hll->registers;
+    for (uint32_t i = 0; i < HLL_M(hll->p); i += 4, p += 3) {
+        uint32_t w = p[0] | p[1] << 8 | p[2] << 16;
+        partial[0][w & HLL_RANK_MASK]++;
+        partial[1][w >> 6 & HLL_RANK_MASK]++;
+        partial[2][w >> 12 & HLL_RANK_MASK]++;
+        partial[3][w >> 18]++;
+    }
+    for (int k = 0; k <= HLL_RANK_MASK; k++)
+        hist[k] = partial[0][k] + partial[1][k] + partial[2][k] + partial[3][k];
+}
+
+// sigma(x) = x + sum_{k >= 1} x^(2^k) 2^(k - 1), the correction for the registers still at 0.
+static double hllSigma(double x) {
+    if (x == 1.0)
+        return INFINITY;
+    double y = 1, z = x, zp;
+    do {
+        x *= x;
+        zp = z;
+        z += x * y;
+        y += y;
+    } while (zp != z);
+    return z;
+}
+
+// tau(x) = (1 - x - sum_{k >= 1} (1 - x^(2^-k))^2 2^-k) / 3, the correction for the registers that
+// reached the largest possible rank.
+static double hllTau(double x) {
+    if (x == 0.0 || x == 1.0)
+        return 0.0;
+    double y = 1, z = 1 - x, zp;
+    do {
+        x = sqrt(x);
+        zp = z;
+        y *= 0.5;
+        z -= (1 - x) * (1 - x) * y;
+    } while (zp != z);
+    return z / 3;
+}
+
+// The improved estimator of Ertl, "New cardinality estimation algorithms for HyperLogLog sketches"
+// (2017). It corrects the harmonic mean with the number of registers at both ends of the rank range,
+// so unlike the original one it needs neither a linear-counting switch (and the bias bump around it)
+// nor a large-range correction, and it holds for every p without empirical tables. Registers of equal
+// rank add the same 2^-rank, so the harmonic sum needs one step per rank of the histogram instead of one
+// per register.
+static double hllEstimateHistogram(uint8_t p, const uint32_t hist[HLL_RANK_MASK + 1]) {
+    double m = HLL_M(p);
+    int q = HLL_R(p);
+
+    double z = m * hllTau((m - hist[q + 1]) / m);
+    for (int k = q; k >= 1; k--) {
+        z += hist[k];
+        z *= 0.5;
+    }
+    z += m * hllSigma(hist[0] / m);
+    return HLL_ALPHA_INF * m * m / z;
+}
+
+static double hllEstimate(const HyperLogLog* hll) {
+    uint32_t hist[HLL_RANK_MASK + 1];
+
+    hllHistogram(hll, hist);
+    return hllEstimateHistogram(hll->p, hist);
+}
+
+// Returns the cached estimate while no register has changed since the last call.
+double hllCount(HyperLogLog* hll) {
+    if (hll->dirty) {
+        hll->cached = hllEstimate(hll);
+        hll->dirty = 0;
+    }
+    return hll->cached;
+}
+
+// A dense sketch that many threads update at once without a lock. Registers take a byte each, so that
+// every one can be raised on its own with a compare-and-swap; once a sketch has warmed up most updates
+// find their register already high enough and only read it, so the threads rarely fight over a cache
+// line. The zero registers are not tracked: the histogram of hllConcurrentCount recounts them.
+typedef struct {
+    uint8_t p;
+    uint8_t* registers;         // 2^p bytes, read and written with atomics only.
+    uint8_t dirty;              // Set (release) when a register grows, cleared (acquire) by hllConcurrentCount.
+    uint8_t counting;           // Held by the hllConcurrentCount call recomputing the estimate.
+    double cached;              // The last estimate of hllConcurrentCount, guarded by counting.
+} HyperLogLogConcurrent;
+
+// Returns -1 if p is out of [HLL_P_MIN, HLL_P_MAX] or out of memory.
+int hllConcurrentInit(HyperLogLogConcurrent* hll, int p) {
+    if (p < HLL_P_MIN || p > HLL_P_MAX)
+        return -1;
+    memset(hll, 0, sizeof(*hll));
+    hll->p = p;
+    hll->registers = calloc(HLL_M(p), 1);
+    return hll->registers ? 0 : -1;
+}
+
+void hllConcurrentFree(HyperLogLogConcurrent* hll) {
+    free(hll->registers);
+}
+
+// Raises register index to count, retrying while other threads change it.
+static void hllConcurrentSet(HyperLogLogConcurrent* hll, uint32_t index, uint8_t count) {
+    uint8_t* reg = &hll->registers[index];
+    uint8_t old = __atomic_load_n(reg, __ATOMIC_RELAXED);
+    while (count > old) {
+        if (__atomic_compare_exchange_n(reg, &old, count, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+            // Unconditional, so that a count that clears dirty after this always sees the register
+            __atomic_store_n(&hll->dirty, 1, __ATOMIC_RELEASE);
+            return;
+        }
+    }
+}
+
+// Safe to call from any number of threads, and concurrently with hllConcurrentCount.
+void hllConcurrentAggregate(HyperLogLogConcurrent* hll, void* data, size_t size) {
+    uint32_t index;
+    uint8_t count;
+
+    hllHashRegister(hll->p, MurmurHash64A(data, size, 0), &index, &count);
+    hllConcurrentSet(hll, index, count);
+}
+
+void hllConcurrentAggregateU64(HyperLogLogConcurrent* hll, uint64_t value) {
+    uint32_t index;
+    uint8_t count;
+
+    hllHashRegister(hll->p, hllMix64(value), &index, &count);
+    hllConcurrentSet(hll, index, count);
+}
+
+// The estimate counts every update that finished before the call, and possibly some running meanwhile.
+// Calls recompute one at a time: otherwise one that cleared dirty first could finish last and store
+// its older estimate over a newer one. Updates never wait on this.
+double hllConcurrentCount(HyperLogLogConcurrent* hll) {
+    double E;
+
+    while (__atomic_test_and_set(&hll->counting, __ATOMIC_ACQUIRE))
+        while (__atomic_load_n(&hll->counting, __ATOMIC_RELAXED))
+            ;
+    if (!__atomic_exchange_n(&hll->dirty, 0, __ATOMIC_ACQUIRE)) {
+        E = hll->cached;
+        __atomic_clear(&hll->counting, __ATOMIC_RELEASE);
         return E;
-    else
-        return - (1ULL << 32) * log(1 - (E / (1ULL << 32)));
+    }
+
+    uint32_t hist[HLL_RANK_MASK + 1], partial[4][HLL_RANK_MASK + 1] = {{0}};
+    for (uint32_t i = 0; i < HLL_M(hll->p); i += 4) {
+        partial[0][__atomic_load_n(&hll->registers[i], __ATOMIC_RELAXED)]++;
+        partial[1][__atomic_load_n(&hll->registers[i + 1], __ATOMIC_RELAXED)]++;
+        partial[2][__atomic_load_n(&hll->registers[i + 2], __ATOMIC_RELAXED)]++;
+        partial[3][__atomic_load_n(&hll->registers[i + 3], __ATOMIC_RELAXED)]++;
+    }
+    for (int k = 0; k <= HLL_RANK_MASK; k++)
+        hist[k] = partial[0][k] + partial[1][k] + partial[2][k] + partial[3][k];
+
+    E = hllEstimateHistogram(hll->p, hist);
+    hll->cached = E;
+    __atomic_clear(&hll->counting, __ATOMIC_RELEASE);
+    return E;
+}
+
+// Merges the registers of a concurrent sketch into dst, which has the same or a lower precision, through
+// a dense copy taken register by register, as concurrent updates may still be running. This is how a
+// concurrent sketch joins hllMerge roll-ups. Returns -1 if dst has a higher precision or out of memory.
+int hllMergeConcurrent(HyperLogLog* dst, const HyperLogLogConcurrent* src) {
+    HyperLogLog copy;
+    HyperLogLog* srcs[1] = {&copy};
+
+    if (dst->p > src->p)
+        return -1;
+    hllInit(&copy, src->p);
+    if (hllPromote(&copy) < 0)
+        return -1;
+
+    uint8_t registers[1024];
+    uint32_t m = HLL_M(src->p);
+    copy.zero_registers = 0;
+    for (uint32_t first = 0; first < m; first += sizeof(registers)) {
+        uint32_t n = m - first < sizeof(registers) ? m - first : sizeof(registers);
+        for (uint32_t i = 0; i < n; i++)
+            registers[i] = __atomic_load_n(&src->registers[first + i], __ATOMIC_RELAXED);
+        hllDensePack(copy.registers, first, n, registers);
+        copy.zero_registers += hllCountZeros(registers, n);
+    }
+    int rv = hllMerge(dst, srcs, 1);
+    hllFree(&copy);
+    return rv;
 }
 
 void stampa_binario64(uint64_t n) {
@@ -118,19 +721,23 @@ void stampa_binario64(uint64_t n) {
 }
 
 
+#ifndef HLL_NO_MAIN
 int main() {
 
     HyperLogLog hll;
-    hllInit(&hll);
+    hllInit(&hll, HLL_P_DEFAULT);
 
     char* data[] = {"hello", "world", "hello", "hyperloglog", "world"};
     size_t data_size = sizeof(data) / sizeof(data[0]);
-    
+
     for (size_t i = 0; i < data_size; i++)
         hllAggregate(&hll, data[i], strlen(data[i]));
 
     double count = hllCount(&hll);
-    printf("Estimated unique count: %d\n", (int) count);
+    printf("Estimated unique count: %d (%s, %u bytes)\n", (int) count,
+           hll.encoding == HLL_SPARSE ? "sparse" : "dense", hll.sparse_len);
+    hllFree(&hll);
 
     return 0;
-}
\ No newline at end of file
+}
+#endif
@@ -0,0 +1,299 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <assert.h>
+#include <pthread.h>
+
+// The tests reach into the encodings, so they build hyperloglog.c itself, without its demo main().
+#define HLL_NO_MAIN
+#include "hyperloglog.c"
+
+// ========== Helper functions ==========
+
+// Unpacks the registers of a sketch of either encoding into one byte each.
+static void testRegisters(const HyperLogLog* hll, uint8_t* out) {
+    memset(out, 0, HLL_M(hll->p));
+    if (hll->encoding == HLL_DENSE) {
+        hllDenseUnpack(hll->registers, 0, HLL_M(hll->p), out);
+        return;
+    }
+    const uint8_t* p = hll->sparse;
+    const uint8_t* end = p + hll->sparse_len;
+    uint32_t index = 0;
+    while (p < end) {
+        uint32_t v = hllVarintGet(&p);
+        index += v >> HLL_RANK_BITS;
+        out[index] = v & HLL_RANK_MASK;
+    }
+}
+
+// Asserts that two sketches of the same precision hold the same registers and estimate, whatever
+// their encodings.
+static void testSameSketch(HyperLogLog* a, HyperLogLog* b) {
+    assert(a->p == b->p);
+    uint32_t m = HLL_M(a->p);
+    uint8_t* ra = malloc(m);
+    uint8_t* rb = malloc(m);
+    assert(ra && rb);
+    testRegisters(a, ra);
+    testRegisters(b, rb);
+    assert(memcmp(ra, rb, m) == 0);
+    assert(a->zero_registers == b->zero_registers);
+    assert(hllCount(a) == hllCount(b));
+    free(ra);
+    free(rb);
+}
+
+// A sketch that is dense from the start.
+static void testInitDense(HyperLogLog* hll, int p) {
+    assert(hllInit(hll, p) == 0);
+    assert(hllPromote(hll) == 0);
+}
+
+// ========== Test Cases ==========
+
+void test_sparse_dense() {
+    printf("\n=== Testing sparse and dense encodings ===\n");
+    for (int p = HLL_P_MIN; p <= HLL_P_MAX; p++) {
+        HyperLogLog sparse, dense;
+        assert(hllInit(&sparse, p) == 0);
+        testInitDense(&dense, p);
+
+        // Compare along the way while the sparse list grows, and once more right after its promotion.
+        for (uint64_t i = 0; sparse.encoding == HLL_SPARSE; i++) {
+            assert(hllAggregate(&sparse, &i, sizeof(i)) == 0);
+            assert(hllAggregate(&dense, &i, sizeof(i)) == 0);
+            if (i % 16 == 0 || sparse.encoding == HLL_DENSE)
+                testSameSketch(&sparse, &dense);
+        }
+        hllFree(&sparse);
+        hllFree(&dense);
+    }
+    printf("PASS: Same registers and estimate for p in [%d, %d]\n", HLL_P_MIN, HLL_P_MAX);
+}
+
+void test_error() {
+    printf("\n=== Testing the estimate error ===\n");
+    for (int p = HLL_P_MIN; p <= HLL_P_MAX; p += 2) {
+        uint32_t m = HLL_M(p);
+        double bound = 3 / sqrt(m), worst = 0;
+        // From a few items per register to far past m, across the small and large range regimes.
+        uint64_t ns[] = {m / 4 + 1, m, 4 * m, 64 * m};
+        for (size_t k = 0; k < sizeof(ns) / sizeof(ns[0]); k++) {
+            HyperLogLog hll;
+            assert(hllInit(&hll, p) == 0);
+            for (uint64_t i = 0; i < ns[k]; i++)
+                assert(hllAggregateU64(&hll, (uint64_t)p << 40 | i) == 0);
+            double error = fabs(hllCount(&hll) - ns[k]) / ns[k];
+            assert(error <= bound);
+            if (error > worst)
+                worst = error;
+            hllFree(&hll);
+        }
+        printf("PASS: p=%d worst relative error %.4f, bound %.4f\n", p, worst, bound);
+    }
+}
+
+void test_merge_downsample() {
+    printf("\n=== Testing hllMerge and hllDownsample ===\n");
+    for (int p = HLL_P_MIN; p <= HLL_P_MAX; p += 2) {
+        // Overlapping ranges, some kept sparse and some dense, at p and above.
+        HyperLogLog srcs[4], direct, merged, *ptrs[4];
+        uint64_t sizes[4] = {10, HLL_M(p) / 2, HLL_M(p) * 4, 100};
+        assert(hllInit(&direct, p) == 0);
+        assert(hllInit(&merged, p) == 0);
+        for (int s = 0; s < 4; s++) {
+            int sp = p + s < HLL_P_MAX ? p + s : HLL_P_MAX;
+            assert(hllInit(&srcs[s], sp) == 0);
+            for (uint64_t i = 0; i < sizes[s]; i++) {
+                uint64_t v = s * 1000 + i;
+                assert(hllAggregate(&srcs[s], &v, sizeof(v)) == 0);
+                assert(hllAggregate(&direct, &v, sizeof(v)) == 0);
+            }
+            ptrs[s] = &srcs[s];
+        }
+        assert(hllMerge(&merged, ptrs, 4) == 0);
+        testSameSketch(&merged, &direct);
+
+        // Every source folded on its own matches it aggregated at p directly.
+        for (int s = 0; s < 4; s++) {
+            HyperLogLog down, alone;
+            assert(hllInit(&down, p) == 0);
+            assert(hllInit(&alone, p) == 0);
+            for (uint64_t i = 0; i < sizes[s]; i++) {
+                uint64_t v = s * 1000 + i;
+                assert(hllAggregate(&alone, &v, sizeof(v)) == 0);
+            }
+            assert(hllDownsample(&down, &srcs[s]) == 0);
+            testSameSketch(&down, &alone);
+            hllFree(&down);
+            hllFree(&alone);
+        }
+        for (int s = 0; s < 4; s++)
+            hllFree(&srcs[s]);
+        hllFree(&direct);
+        hllFree(&merged);
+    }
+
+    HyperLogLog low, high;
+    assert(hllInit(&low, 10) == 0);
+    assert(hllInit(&high, 12) == 0);
+    assert(hllDownsample(&high, &low) == -1);
+    HyperLogLog* ptrs[1] = {&low};
+    assert(hllMerge(&high, ptrs, 1) == -1);
+    hllFree(&low);
+    hllFree(&high);
+    printf("PASS: Merged and folded sketches match the union aggregated at the target p\n");
+}
+
+void test_batch() {
+    printf("\n=== Testing the batch and integer aggregates ===\n");
+    for (int p = HLL_P_MIN; p <= HLL_P_MAX; p += 2) {
+        // Not a multiple of HLL_BATCH, and far enough for the sketches to turn dense on the way.
+        size_t n = HLL_M(p) * 3 + 5;
+        uint64_t* values = malloc(n * sizeof(uint64_t));
+        uint32_t* values32 = malloc(n * sizeof(uint32_t));
+        void** items = malloc(n * sizeof(void*));
+        size_t* sizes = malloc(n * sizeof(size_t));
+        assert(values && values32 && items && sizes);
+        for (size_t i = 0; i < n; i++) {
+            values[i] = (uint64_t)i * 2654435761U % (n / 2 + 1); // Repeats some.
+            values32[i] = values[i];
+            items[i] = &values[i];
+            sizes[i] = 1 + i % sizeof(uint64_t);
+        }
+
+        HyperLogLog one, many;
+        assert(hllInit(&one, p) == 0);
+        assert(hllInit(&many, p) == 0);
+        for (size_t i = 0; i < n; i++)
+            assert(hllAggregate(&one, items[i], sizes[i]) == 0);
+        assert(hllAggregateMany(&many, items, sizes, n) == 0);
+        testSameSketch(&one, &many);
+        hllFree(&one);
+        hllFree(&many);
+
+        HyperLogLog u64, u32, u64s, u32s;
+        assert(hllInit(&u64, p) == 0);
+        assert(hllInit(&u32, p) == 0);
+        assert(hllInit(&u64s, p) == 0);
+        assert(hllInit(&u32s, p) == 0);
+        for (size_t i = 0; i < n; i++) {
+            assert(hllAggregateU64(&u64, values[i]) == 0);
+            assert(hllAggregateU32(&u32, values32[i]) == 0);
+        }
+        assert(hllAggregateU64Array(&u64s, values, n) == 0);
+        assert(hllAggregateU32Array(&u32s, values32, n) == 0);
+        testSameSketch(&u64, &u32);
+        testSameSketch(&u64, &u64s);
+        testSameSketch(&u64, &u32s);
+        hllFree(&u64);
+        hllFree(&u32);
+        hllFree(&u64s);
+        hllFree(&u32s);
+
+        free(values);
+        free(values32);
+        free(items);
+        free(sizes);
+    }
+    printf("PASS: Batch and integer paths match the scalar ones register for register\n");
+}
+
+#define TEST_THREADS 8
+#define TEST_READERS 2
+#define TEST_PER_THREAD 50000
+
+typedef struct {
+    HyperLogLogConcurrent* hll;
+    long id;
+    int* stop;
+} TestThread;
+
+// Overlapping ranges, half through each aggregate.
+static void* testConcurrentWriter(void* arg) {
+    TestThread* t = arg;
+    for (uint64_t i = 0; i < TEST_PER_THREAD; i++) {
+        uint64_t v = t->id * TEST_PER_THREAD / 2 + i;
+        if (v & 1)
+            hllConcurrentAggregateU64(t->hll, v);
+        else
+            hllConcurrentAggregate(t->hll, &v, sizeof(v));
+    }
+    return NULL;
+}
+
+// Counts while the writers run, so that the recomputes race with the updates and with each other.
+static void* testConcurrentReader(void* arg) {
+    TestThread* t = arg;
+    while (!__atomic_load_n(t->stop, __ATOMIC_ACQUIRE))
+        assert(hllConcurrentCount(t->hll) >= 0);
+    return NULL;
+}
+
+void test_concurrent() {
+    printf("\n=== Testing the concurrent sketch ===\n");
+    for (int p = 10; p <= HLL_P_MAX; p += 4) {
+        HyperLogLogConcurrent hll;
+        TestThread writers[TEST_THREADS], readers[TEST_READERS];
+        pthread_t wt[TEST_THREADS], rt[TEST_READERS];
+        int stop = 0;
+        assert(hllConcurrentInit(&hll, p) == 0);
+        for (long r = 0; r < TEST_READERS; r++) {
+            readers[r] = (TestThread){&hll, r, &stop};
+            assert(pthread_create(&rt[r], NULL, testConcurrentReader, &readers[r]) == 0);
+        }
+        for (long w = 0; w < TEST_THREADS; w++) {
+            writers[w] = (TestThread){&hll, w, &stop};
+            assert(pthread_create(&wt[w], NULL, testConcurrentWriter, &writers[w]) == 0);
+        }
+        for (int w = 0; w < TEST_THREADS; w++)
+            pthread_join(wt[w], NULL);
+        __atomic_store_n(&stop, 1, __ATOMIC_RELEASE);
+        for (int r = 0; r < TEST_READERS; r++)
+            pthread_join(rt[r], NULL);
+
+        // The same items, one after the other.
+        HyperLogLog sequential;
+        assert(hllInit(&sequential, p) == 0);
+        for (long w = 0; w < TEST_THREADS; w++) {
+            for (uint64_t i = 0; i < TEST_PER_THREAD; i++) {
+                uint64_t v = w * TEST_PER_THREAD / 2 + i;
+                if (v & 1)
+                    assert(hllAggregateU64(&sequential, v) == 0);
+                else
+                    assert(hllAggregate(&sequential, &v, sizeof(v)) == 0);
+            }
+        }
+        assert(hllConcurrentCount(&hll) == hllCount(&sequential));
+
+        HyperLogLog copy, low, lowSequential;
+        assert(hllInit(&copy, p) == 0);
+        assert(hllMergeConcurrent(&copy, &hll) == 0);
+        testSameSketch(&copy, &sequential);
+        assert(hllInit(&low, p - 2) == 0);
+        assert(hllInit(&lowSequential, p - 2) == 0);
+        assert(hllMergeConcurrent(&low, &hll) == 0);
+        assert(hllDownsample(&lowSequential, &sequential) == 0);
+        testSameSketch(&low, &lowSequential);
+
+        hllConcurrentFree(&hll);
+        hllFree(&sequential);
+        hllFree(&copy);
+        hllFree(&low);
+        hllFree(&lowSequential);
+    }
+    printf("PASS: Joined threads leave the same sketch as sequential updates\n");
+}
+
+int main() {
+    test_sparse_dense();
+    test_error();
+    test_merge_downsample();
+    test_batch();
+    test_concurrent();
+
+    printf("\nAll HyperLogLog tests passed\n");
+    return 0;
+}
@@ -0,0 +1,6 @@
+#pragma once
+#include <stdint.h>
+
+// 64-bit MurmurHash2 by Austin Appleby, shared by the sketches in this
+// directory and by sm-redis's probabilistic data types.
+uint64_t MurmurHash64A(const void *key, int len, uint64_t seed);
@@ -5,6 +5,7 @@
 #include <assert.h>
 
 #include "int_list.h"
+#include "slab.h"
 
 #define MAX_NUM_ITEMS 64
 
@@ -236,11 +237,13 @@ void performance_test()
             exit(EXIT_FAILURE);
         }
 
-        // Measure push performance
+        // Measure push performance, items come from the slab allocator
         clock_t start = clock();
         for (int i = 0; i < n; i++)
         {
-            items[i] = create_test_item(i);
+            items[i] = Slab_alloc(sizeof(TestItem));
+            assert(items[i]);
+            items[i]->value = i;
             List_push(&list, (ListItem *)items[i]);
         }
         clock_t end = clock();
@@ -287,7 +290,7 @@ void performance_test()
 
         for (int i = 0; i < n; i++)
         {
-            free(items[i]);
+            Slab_free(items[i]);
         }
         free(items);
     }
@@ -0,0 +1,52 @@
+#include <stddef.h>
+#include "mpsc.h"
+
+void Mpsc_init(MpscQueue *q)
+{
+    atomic_store_explicit(&q->stub.next, NULL, memory_order_relaxed);
+    atomic_store_explicit(&q->head, &q->stub, memory_order_relaxed);
+    q->tail = &q->stub;
+}
+
+// Wait-free: one exchange and one store.
+void Mpsc_push(MpscQueue *q, MpscNode *n)
+{
+    atomic_store_explicit(&n->next, NULL, memory_order_relaxed);
+    MpscNode *prev = atomic_exchange_explicit(&q->head, n, memory_order_acq_rel);
+    atomic_store_explicit(&prev->next, n, memory_order_release);
+}
+
+// Returns the oldest node, or NULL if the queue is empty or a producer is
+// between its exchange and its store; in the latter case the node shows up
+// on a later call.
+MpscNode *Mpsc_pop(MpscQueue *q)
+{
+    MpscNode *tail = q->tail;
+    MpscNode *next = atomic_load_explicit(&tail->next, memory_order_acquire);
+
+    if (tail == &q->stub)
+    {
+        if (!next)
+            return NULL;
+        q->tail = next;
+        tail = next;
+        next = atomic_load_explicit(&next->next, memory_order_acquire);
+    }
+    if (next)
+    {
+        q->tail = next;
+        return tail;
+    }
+    if (tail != atomic_load_explicit(&q->head, memory_order_acquire))
+        return NULL;
+
+    // tail is the last node: put the stub behind it so it can be detached
+    Mpsc_push(q, &q->stub);
+    next = atomic_load_explicit(&tail->next, memory_order_acquire);
+    if (next)
+    {
+        q->tail = next;
+        return tail;
+    }
+    return NULL;
+}
@@ -0,0 +1,22 @@
+#pragma once
+#include <stdatomic.h>
+
+// Intrusive lock-free multi-producer single-consumer queue (Vyukov). Any
+// thread may push; only one thread pops. Nodes are embedded in the queued
+// objects and a node must not be pushed again before it is popped.
+
+typedef struct MpscNode
+{
+    _Atomic(struct MpscNode *) next;
+} MpscNode;
+
+typedef struct MpscQueue
+{
+    _Atomic(MpscNode *) head; // Last pushed node, producers swap it
+    MpscNode *tail;           // Next node to pop, owned by the consumer
+    MpscNode stub;
+} MpscQueue;
+
+void Mpsc_init(MpscQueue *q);
+void Mpsc_push(MpscQueue *q, MpscNode *n);
+MpscNode *Mpsc_pop(MpscQueue *q);
@@ -0,0 +1,212 @@
+#include <stdlib.h>
+#include <string.h>
+#include "radix.h"
+
+static RadixNode *node_create(const unsigned char *prefix, size_t len)
+{
+    RadixNode *n = calloc(1, sizeof(RadixNode));
+    if (!n)
+        return NULL;
+    if (len)
+    {
+        n->prefix = malloc(len);
+        if (!n->prefix)
+        {
+            free(n);
+            return NULL;
+        }
+        memcpy(n->prefix, prefix, len);
+        n->prefix_len = len;
+    }
+    return n;
+}
+
+static void node_free(RadixNode *n, void (*value_free)(void *value))
+{
+    for (int i = 0; i < n->nchildren; i++)
+        node_free(n->children[i], value_free);
+    if (n->has_value && value_free)
+        value_free(n->value);
+    free(n->children);
+    free(n->prefix);
+    free(n);
+}
+
+Radix *Radix_create(void)
+{
+    Radix *r = calloc(1, sizeof(Radix));
+    if (!r)
+        return NULL;
+    r->root = node_create(NULL, 0);
+    if (!r->root)
+    {
+        free(r);
+        return NULL;
+    }
+    r->nodes = 1;
+    r->bytes = sizeof(Radix) + sizeof(RadixNode);
+    return r;
+}
+
+void Radix_free(Radix *r, void (*value_free)(void *value))
+{
+    if (!r)
+        return;
+    node_free(r->root, value_free);
+    free(r);
+}
+
+// Index of the child whose label starts with byte, or of the first child
+// after it (n->nchildren if none), in *pos. Returns 1 on an exact match.
+static int child_search(const RadixNode *n, unsigned char byte, int *pos)
+{
+    int lo = 0, hi = n->nchildren;
+    while (lo < hi)
+    {
+        int mid = (lo + hi) / 2;
+        if (n->children[mid]->prefix[0] < byte)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    *pos = lo;
+    return lo < n->nchildren && n->children[lo]->prefix[0] == byte;
+}
+
+static int child_insert(RadixNode *n, int pos, RadixNode *child)
+{
+    RadixNode **children = realloc(n->children, (n->nchildren + 1) * sizeof(RadixNode *));
+    if (!children)
+        return 0;
+    memmove(children + pos + 1, children + pos, (n->nchildren - pos) * sizeof(RadixNode *));
+    children[pos] = child;
+    n->children = children;
+    n->nchildren++;
+    return 1;
+}
+
+// Splits the label of the child at pos after its first common bytes, putting
+// a new node with the common part between it and n.
+static RadixNode *child_split(Radix *r, RadixNode *n, int pos, size_t common)
+{
+    RadixNode *child = n->children[pos];
+    RadixNode *mid = node_create(child->prefix, common);
+    unsigned char *rest = malloc(child->prefix_len - common);
+    if (!mid || !rest || !child_insert(mid, 0, child))
+    {
+        if (mid)
+            node_free(mid, NULL);
+        free(rest);
+        return NULL;
+    }
+    memcpy(rest, child->prefix + common, child->prefix_len - common);
+    free(child->prefix);
+    child->prefix = rest;
+    child->prefix_len -= common;
+    n->children[pos] = mid;
+    r->nodes++;
+    r->bytes += sizeof(RadixNode) + sizeof(RadixNode *);
+    return mid;
+}
+
+int Radix_insert(Radix *r, const unsigned char *key, size_t len, void *value)
+{
+    RadixNode *n = r->root;
+    while (len)
+    {
+        int pos;
+        if (!child_search(n, key[0], &pos))
+        {
+            RadixNode *leaf = node_create(key, len);
+            if (!leaf || !child_insert(n, pos, leaf))
+            {
+                if (leaf)
+                    node_free(leaf, NULL);
+                return -1;
+            }
+            r->nodes++;
+            r->bytes += sizeof(RadixNode) + len + sizeof(RadixNode *);
+            n = leaf;
+            break;
+        }
+        RadixNode *child = n->children[pos];
+        size_t common = 1;
+        while (common < child->prefix_len && common < len && child->prefix[common] == key[common])
+            common++;
+        if (common < child->prefix_len && !(child = child_split(r, n, pos, common)))
+            return -1;
+        n = child;
+        key += common;
+        len -= common;
+    }
+
+    int added = !n->has_value;
+    n->has_value = 1;
+    n->value = value;
+    r->keys += added;
+    return added;
+}
+
+void *Radix_find(const Radix *r, const unsigned char *key, size_t len)
+{
+    const RadixNode *n = r->root;
+    while (len)
+    {
+        int pos;
+        if (!child_search(n, key[0], &pos))
+            return NULL;
+        n = n->children[pos];
+        if (n->prefix_len > len || memcmp(n->prefix, key, n->prefix_len) != 0)
+            return NULL;
+        key += n->prefix_len;
+        len -= n->prefix_len;
+    }
+    return n->has_value ? n->value : NULL;
+}
+
+// The greatest key under n: the last child all the way down, since a node
+// sorts before its children and every leaf has a value.
+static const RadixNode *node_max(const RadixNode *n)
+{
+    while (n->nchildren)
+        n = n->children[n->nchildren - 1];
+    return n;
+}
+
+// Greatest key <= key under n, whose label has already been matched.
+static const RadixNode *node_floor(const RadixNode *n, const unsigned char *key, size_t len)
+{
+    if (len == 0)
+        return n->has_value ? n : NULL; // The keys below are longer, so greater
+
+    int pos;
+    if (child_search(n, key[0], &pos))
+    {
+        const RadixNode *child = n->children[pos];
+        size_t m = child->prefix_len < len ? child->prefix_len : len;
+        int cmp = memcmp(child->prefix, key, m);
+        if (cmp < 0)
+            return node_max(child);
+        if (cmp == 0 && child->prefix_len <= len)
+        {
+            const RadixNode *found = node_floor(child, key + m, len - m);
+            if (found)
+                return found;
+        }
+    }
+    // Every key under the children before pos is smaller
+    if (pos > 0)
+        return node_max(n->children[pos - 1]);
+    return n->has_value ? n : NULL;
+}
+
+void *Radix_floor(const Radix *r, const unsigned char *key, size_t len)
+{
+    const RadixNode *n = node_floor(r->root, key, len);
+    return n ? n->value : NULL;
+}
+
+size_t Radix_bytes(const Radix *r)
+{
+    return r->bytes;
+}
@@ -0,0 +1,40 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+// Compressed radix tree over byte strings. Each node holds the run of bytes
+// leading to it from its parent, so a chain of single-child nodes collapses
+// into one, and keys sharing a long prefix (such as big-endian IDs that grow
+// over time) share their nodes. Children are kept sorted by their first
+// byte, which orders the keys lexicographically.
+
+typedef struct RadixNode
+{
+    unsigned char *prefix; // Edge label from the parent, NULL if empty
+    uint32_t prefix_len;
+    uint16_t nchildren;
+    uint8_t has_value;
+    void *value;
+    struct RadixNode **children; // Sorted by prefix[0]
+} RadixNode;
+
+typedef struct Radix
+{
+    RadixNode *root; // Empty prefix
+    uint64_t keys;
+    uint64_t nodes;
+    size_t bytes; // Nodes, labels and child arrays
+} Radix;
+
+Radix *Radix_create(void);
+// Frees the tree, calling value_free (if not NULL) on every value.
+void Radix_free(Radix *r, void (*value_free)(void *value));
+
+// Sets the value of key. Returns 1 if the key is new, 0 if its value was
+// replaced, -1 if out of memory.
+int Radix_insert(Radix *r, const unsigned char *key, size_t len, void *value);
+// Returns the value of key, or NULL if missing.
+void *Radix_find(const Radix *r, const unsigned char *key, size_t len);
+// Returns the value of the greatest key <= key, or NULL if there is none.
+void *Radix_floor(const Radix *r, const unsigned char *key, size_t len);
+size_t Radix_bytes(const Radix *r);
@@ -0,0 +1,31 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+// Helpers for the snapshot encoders of the data types. Fields are written in
+// host byte order, as snapshots only move between processes on one host. An
+// encoder runs twice: with out == NULL to size the record, then to fill it.
+
+static inline size_t Serial_put(unsigned char *out, size_t off, const void *data, size_t len)
+{
+    if (out)
+        memcpy(out + off, data, len);
+    return off + len;
+}
+
+typedef struct SerialReader
+{
+    const unsigned char *p;
+    const unsigned char *end;
+} SerialReader;
+
+// Copies the next len bytes to dst. Returns 0 if the record is too short.
+static inline int Serial_get(SerialReader *r, void *dst, size_t len)
+{
+    if ((size_t)(r->end - r->p) < len)
+        return 0;
+    memcpy(dst, r->p, len);
+    r->p += len;
+    return 1;
+}
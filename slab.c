@@ -0,0 +1,408 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <malloc.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include "slab.h"
+
+#define SLAB_SHIFT 16
+#define SLAB_SIZE (1UL << SLAB_SHIFT)
+#define SLAB_ARENA_SIZE (64ULL << 30) // Address space reserved for slabs
+#define SLAB_ARENA_GROW (4UL << 20)   // Made accessible at a time
+#define SLAB_MAX_CLASSES 64
+#define SLAB_TCACHE_MAX 32   // Free objects a thread keeps per class
+#define SLAB_TCACHE_BATCH 16 // Moved to or from the central lists at a time
+#define SLAB_PICK_SCAN 32    // Partial slabs looked at when picking the fullest
+
+typedef struct SlabMeta
+{
+    struct SlabMeta *prev, *next; // In the partial list of the class, or in the free slab stack
+    void *free;                   // Free objects, linked through their first word
+    uint32_t carved;              // Objects ever handed out, the rest of the slab is untouched
+    uint32_t used;                // Allocated objects, including those in thread caches
+    int cls;
+} SlabMeta;
+
+typedef struct SlabClass
+{
+    pthread_mutex_t lock;
+    uint32_t size;
+    uint32_t per_slab;
+    SlabMeta *cur;     // Slab new objects come from
+    SlabMeta *partial; // Other slabs with free objects
+    size_t nslabs;
+    size_t nused;
+} SlabClass;
+
+static struct
+{
+    pthread_once_t once;
+    pthread_mutex_t lock; // Protects the fields below, up to classes
+    char *base;
+    size_t mapped;        // Bytes of the arena made accessible
+    size_t carved;        // Slabs ever taken from the arena
+    SlabMeta *meta;       // One per slab of the arena
+    SlabMeta *free_slabs; // Emptied slabs, their memory returned to the kernel
+    size_t slabs;         // Slabs in use
+    SlabClass classes[SLAB_MAX_CLASSES];
+    int nclasses;
+    uint8_t small_class[1024 / 8 + 1];            // Class by (size + 7) / 8, sizes up to 1 KB
+    uint8_t large_class[SLAB_MAX_SIZE / 128 + 1]; // Class by (size + 127) / 128
+    size_t used;                                  // Atomic
+    size_t large;                                 // Atomic, bytes of malloc() allocations
+} arena = {.once = PTHREAD_ONCE_INIT, .lock = PTHREAD_MUTEX_INITIALIZER};
+
+typedef struct TCacheBin
+{
+    void *objs[SLAB_TCACHE_MAX];
+    int n;
+} TCacheBin;
+
+static __thread TCacheBin tcache[SLAB_MAX_CLASSES];
+
+// Classes are 8 bytes apart up to 64, 16 apart up to 128, then four per
+// power of two, which bounds the internal waste to 25%.
+static void arena_init(void)
+{
+    uint32_t size = 8;
+    while (size <= SLAB_MAX_SIZE)
+    {
+        SlabClass *cl = &arena.classes[arena.nclasses++];
+        pthread_mutex_init(&cl->lock, NULL);
+        cl->size = size;
+        cl->per_slab = SLAB_SIZE / size;
+        if (size < 64)
+            size += 8;
+        else if (size < 128)
+            size += 16;
+        else
+            size += 1U << (31 - __builtin_clz(size) - 2);
+    }
+    for (int i = 0, c = 0; i <= 1024 / 8; i++)
+    {
+        while (arena.classes[c].size < (uint32_t)i * 8)
+            c++;
+        arena.small_class[i] = c;
+    }
+    for (int i = 0, c = 0; i <= SLAB_MAX_SIZE / 128; i++)
+    {
+        while (arena.classes[c].size < (uint32_t)i * 128)
+            c++;
+        arena.large_class[i] = c;
+    }
+
+    void *base = mmap(NULL, SLAB_ARENA_SIZE, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    void *meta = mmap(NULL, (SLAB_ARENA_SIZE >> SLAB_SHIFT) * sizeof(SlabMeta), PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (base == MAP_FAILED || meta == MAP_FAILED)
+        return; // Every allocation falls back to malloc()
+    arena.base = base;
+    arena.meta = meta;
+}
+
+static inline int class_of(size_t size)
+{
+    if (size <= 1024)
+        return arena.small_class[(size + 7) >> 3];
+    return arena.large_class[(size + 127) >> 7];
+}
+
+static inline int in_arena(const void *ptr)
+{
+    return arena.base && (const char *)ptr >= arena.base && (const char *)ptr < arena.base + SLAB_ARENA_SIZE;
+}
+
+static inline SlabMeta *meta_of(const void *ptr)
+{
+    return &arena.meta[((const char *)ptr - arena.base) >> SLAB_SHIFT];
+}
+
+static inline char *slab_base(const SlabMeta *s)
+{
+    return arena.base + ((size_t)(s - arena.meta) << SLAB_SHIFT);
+}
+
+static SlabMeta *slab_new(int cls)
+{
+    SlabMeta *s;
+    pthread_mutex_lock(&arena.lock);
+    if (arena.free_slabs)
+    {
+        s = arena.free_slabs;
+        arena.free_slabs = s->next;
+    }
+    else
+    {
+        size_t end = (arena.carved + 1) * SLAB_SIZE;
+        if (end > SLAB_ARENA_SIZE ||
+            (end > arena.mapped && mprotect(arena.base + arena.mapped, SLAB_ARENA_GROW, PROT_READ | PROT_WRITE) != 0))
+        {
+            pthread_mutex_unlock(&arena.lock);
+            return NULL;
+        }
+        if (end > arena.mapped)
+            arena.mapped += SLAB_ARENA_GROW;
+        s = &arena.meta[arena.carved++];
+    }
+    arena.slabs++;
+    pthread_mutex_unlock(&arena.lock);
+
+    memset(s, 0, sizeof(*s));
+    s->cls = cls;
+    return s;
+}
+
+static void slab_release(SlabMeta *s)
+{
+    madvise(slab_base(s), SLAB_SIZE, MADV_DONTNEED);
+    pthread_mutex_lock(&arena.lock);
+    s->next = arena.free_slabs;
+    arena.free_slabs = s;
+    arena.slabs--;
+    pthread_mutex_unlock(&arena.lock);
+}
+
+static void partial_remove(SlabClass *cl, SlabMeta *s)
+{
+    if (s->prev)
+        s->prev->next = s->next;
+    else
+        cl->partial = s->next;
+    if (s->next)
+        s->next->prev = s->prev;
+}
+
+static void partial_push(SlabClass *cl, SlabMeta *s)
+{
+    s->prev = NULL;
+    s->next = cl->partial;
+    if (cl->partial)
+        cl->partial->prev = s;
+    cl->partial = s;
+}
+
+static inline int slab_full(const SlabClass *cl, const SlabMeta *s)
+{
+    return !s->free && s->carved == cl->per_slab;
+}
+
+// Takes one object from the central lists, class lock held. New objects go
+// to the fullest partial slab, so sparse slabs get a chance to empty out.
+static void *class_alloc(SlabClass *cl, int cls)
+{
+    SlabMeta *s = cl->cur;
+    if (!s || slab_full(cl, s))
+    {
+        s = cl->partial;
+        int n = 0;
+        for (SlabMeta *p = cl->partial; p && n < SLAB_PICK_SCAN; p = p->next, n++)
+            if (p->used > s->used)
+                s = p;
+        if (s)
+        {
+            partial_remove(cl, s);
+        }
+        else
+        {
+            s = slab_new(cls);
+            if (!s)
+                return NULL;
+            cl->nslabs++;
+        }
+        // The full slab left behind is in no list, it joins the partial list
+        // when one of its objects is freed
+        cl->cur = s;
+    }
+
+    void *ptr;
+    if (s->free)
+    {
+        ptr = s->free;
+        s->free = *(void **)ptr;
+    }
+    else
+    {
+        ptr = slab_base(s) + (size_t)s->carved++ * cl->size;
+    }
+    s->used++;
+    cl->nused++;
+    return ptr;
+}
+
+// Returns one object to its slab, class lock held.
+static void class_free(SlabClass *cl, void *ptr)
+{
+    SlabMeta *s = meta_of(ptr);
+    int was_full = slab_full(cl, s);
+    *(void **)ptr = s->free;
+    s->free = ptr;
+    s->used--;
+    cl->nused--;
+    if (s == cl->cur)
+        return;
+    if (s->used == 0)
+    {
+        if (!was_full)
+            partial_remove(cl, s);
+        cl->nslabs--;
+        slab_release(s);
+    }
+    else if (was_full)
+    {
+        partial_push(cl, s);
+    }
+}
+
+void *Slab_alloc(size_t size)
+{
+    pthread_once(&arena.once, arena_init);
+    if (size > SLAB_MAX_SIZE || !arena.base)
+    {
+        void *ptr = malloc(size);
+        if (ptr)
+            __atomic_add_fetch(&arena.large, malloc_usable_size(ptr), __ATOMIC_RELAXED);
+        return ptr;
+    }
+
+    int cls = class_of(size);
+    SlabClass *cl = &arena.classes[cls];
+    TCacheBin *bin = &tcache[cls];
+    if (bin->n == 0)
+    {
+        pthread_mutex_lock(&cl->lock);
+        while (bin->n < SLAB_TCACHE_BATCH)
+        {
+            void *ptr = class_alloc(cl, cls);
+            if (!ptr)
+                break;
+            bin->objs[bin->n++] = ptr;
+        }
+        pthread_mutex_unlock(&cl->lock);
+        if (bin->n == 0)
+            return NULL;
+    }
+    __atomic_add_fetch(&arena.used, cl->size, __ATOMIC_RELAXED);
+    return bin->objs[--bin->n];
+}
+
+void *Slab_calloc(size_t size)
+{
+    void *ptr = Slab_alloc(size);
+    if (ptr)
+        memset(ptr, 0, size);
+    return ptr;
+}
+
+void Slab_free(void *ptr)
+{
+    if (!ptr)
+        return;
+    if (!in_arena(ptr))
+    {
+        __atomic_sub_fetch(&arena.large, malloc_usable_size(ptr), __ATOMIC_RELAXED);
+        free(ptr);
+        return;
+    }
+
+    int cls = meta_of(ptr)->cls;
+    SlabClass *cl = &arena.classes[cls];
+    TCacheBin *bin = &tcache[cls];
+    if (bin->n == SLAB_TCACHE_MAX)
+    {
+        // Give back the objects cached the longest
+        pthread_mutex_lock(&cl->lock);
+        for (int i = 0; i < SLAB_TCACHE_BATCH; i++)
+            class_free(cl, bin->objs[i]);
+        pthread_mutex_unlock(&cl->lock);
+        bin->n -= SLAB_TCACHE_BATCH;
+        memmove(bin->objs, bin->objs + SLAB_TCACHE_BATCH, bin->n * sizeof(void *));
+    }
+    bin->objs[bin->n++] = ptr;
+    __atomic_sub_fetch(&arena.used, cl->size, __ATOMIC_RELAXED);
+}
+
+size_t Slab_usable_size(const void *ptr)
+{
+    if (!in_arena(ptr))
+        return malloc_usable_size((void *)ptr);
+    return arena.classes[meta_of(ptr)->cls].size;
+}
+
+void *Slab_realloc(void *ptr, size_t size)
+{
+    if (!ptr)
+        return Slab_alloc(size);
+    if (!in_arena(ptr) && size > SLAB_MAX_SIZE)
+    {
+        size_t old = malloc_usable_size(ptr);
+        void *copy = realloc(ptr, size);
+        if (copy)
+        {
+            __atomic_sub_fetch(&arena.large, old, __ATOMIC_RELAXED);
+            __atomic_add_fetch(&arena.large, malloc_usable_size(copy), __ATOMIC_RELAXED);
+        }
+        return copy;
+    }
+    size_t old = Slab_usable_size(ptr);
+    if (in_arena(ptr) && size <= old && class_of(size) == meta_of(ptr)->cls)
+        return ptr;
+
+    void *copy = Slab_alloc(size);
+    if (!copy)
+        return NULL;
+    memcpy(copy, ptr, old < size ? old : size);
+    Slab_free(ptr);
+    return copy;
+}
+
+char *Slab_strdup(const char *s)
+{
+    size_t len = strlen(s) + 1;
+    char *copy = Slab_alloc(len);
+    if (copy)
+        memcpy(copy, s, len);
+    return copy;
+}
+
+// Moves the object if its slab is less used than the average slab of its
+// class, and returns its new address; returns NULL if it was left in place.
+// The caller updates every reference to the object.
+void *Slab_defrag(void *ptr)
+{
+    if (!in_arena(ptr))
+        return NULL;
+    SlabMeta *s = meta_of(ptr);
+    SlabClass *cl = &arena.classes[s->cls];
+
+    void *copy = NULL;
+    pthread_mutex_lock(&cl->lock);
+    if (s != cl->cur && s->used * cl->nslabs < cl->nused)
+    {
+        copy = class_alloc(cl, s->cls);
+        if (copy && meta_of(copy) == s)
+        {
+            // Nothing fuller to move to
+            class_free(cl, copy);
+            copy = NULL;
+        }
+        if (copy)
+        {
+            memcpy(copy, ptr, cl->size);
+            class_free(cl, ptr);
+        }
+    }
+    pthread_mutex_unlock(&cl->lock);
+    return copy;
+}
+
+void Slab_get_stats(SlabStats *st)
+{
+    pthread_mutex_lock(&arena.lock);
+    st->slabs = arena.slabs;
+    pthread_mutex_unlock(&arena.lock);
+    size_t large = __atomic_load_n(&arena.large, __ATOMIC_RELAXED);
+    st->used = __atomic_load_n(&arena.used, __ATOMIC_RELAXED) + large;
+    st->active = st->slabs * SLAB_SIZE + large;
+}
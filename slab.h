@@ -0,0 +1,32 @@
+#pragma once
+#include <stddef.h>
+
+// Size class slab allocator. Objects up to SLAB_MAX_SIZE are carved out of
+// 64 KB slabs holding objects of a single size class; larger ones go to
+// malloc(). Every thread keeps a small cache of free objects per class, so
+// most allocations and frees take no lock. Slabs come from one reserved
+// address range, which tells slab pointers apart from malloc() ones and
+// finds the slab of a pointer by shifting it. Empty slabs are given back to
+// the kernel with madvise().
+//
+// Objects of sparse slabs can be moved by Slab_defrag(), which copies them
+// into the fullest slabs of their class so the sparse ones empty out.
+
+#define SLAB_MAX_SIZE (16 * 1024)
+
+typedef struct SlabStats
+{
+    size_t used;   // Bytes of live allocations, rounded up to their size class
+    size_t active; // Bytes of the slabs in use plus the large allocations
+    size_t slabs;  // Slabs in use
+} SlabStats;
+
+void *Slab_alloc(size_t size);
+void *Slab_calloc(size_t size);
+void *Slab_realloc(void *ptr, size_t size);
+char *Slab_strdup(const char *s);
+void Slab_free(void *ptr);
+size_t Slab_usable_size(const void *ptr);
+
+void *Slab_defrag(void *ptr);
+void Slab_get_stats(SlabStats *st);
@@ -1,105 +1,4854 @@
+#define _GNU_SOURCE
 #include <stdint.h>
+#include <stdarg.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <ctype.h>
 #include <stdio.h>
+#include <limits.h>
 #include <errno.h>
+#include <time.h>
 #include <unistd.h>
 #include <arpa/inet.h>
 #include <sys/socket.h>
 #include <netinet/ip.h>
+#include <sys/un.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stddef.h>
+#include <sys/uio.h>
+#include <linux/errqueue.h>
+#include <sys/eventfd.h>
+#include <pthread.h>
+#include <sys/mman.h>
 
-#define PING_MSG "PING\n"
+#include "dict.h"
+#include "linked_list.h"
+#include "bloom.h"
+#include "cuckoo.h"
+#include "cms.h"
+#include "topk.h"
+#include "bitops.h"
+#include "mpsc.h"
+#include "slab.h"
+#include "serial.h"
+#include "stream.h"
+#include "hash.h"
+#include "hyperloglog/murmurhash.h"
+
+#define MAX_ARGS 64
+#define READ_CHUNK 4096
+#define PROTO_MAX_HEADER 32                       // Longest "*N" or "$len" line, CRLF included
+#define PROTO_MAX_MULTIBULK_LEN (1024 * 1024)     // Arguments of a RESP command
+#define PROTO_MAX_BULK_LEN (512LL * 1024 * 1024)  // Bytes of a RESP argument
+#define MAX_LISTENERS 16
+
+// Latency histograms use log2 buckets over nanoseconds: bucket i holds the
+// samples in [2^(i-1), 2^i) ns, so 64 buckets cover any uint64_t duration.
+#define LAT_BUCKETS 64
+#define LAT_MAX_EVENTS 16
+
+// SLOWLOG entries keep at most this many arguments, each truncated to this
+// many bytes, so a huge command cannot pin a huge log entry.
+#define SLOWLOG_ENTRY_MAX_ARGC 32
+#define SLOWLOG_ENTRY_MAX_STRING 128
 
 static void msg(const char *msg)
 {
-    fprintf(stderr, "%s\n", msg);
+    fprintf(stderr, "%s\n", msg);
+}
+
+static void die(const char *msg)
+{
+    int err = errno;
+    fprintf(stderr, "[%d] %s\n", err, msg);
+    abort();
+}
+
+// ========== Latency instrumentation ==========
+
+typedef struct LatencyHist
+{
+    uint64_t calls;
+    uint64_t total_ns;
+    uint64_t max_ns;
+    uint64_t buckets[LAT_BUCKETS];
+} LatencyHist;
+
+// A named background or loop event (event-loop, fork, fsync, ...).
+typedef struct LatencyEvent
+{
+    const char *name;
+    time_t last_time;  // Wall clock time of the latest sample
+    uint64_t last_ns;  // Duration of the latest sample
+    LatencyHist hist;
+} LatencyEvent;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Unix time in milliseconds.
+static long long mstime(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void hist_add(LatencyHist *h, uint64_t ns)
+{
+    int bucket = ns ? 64 - __builtin_clzll(ns) : 0;
+    if (bucket >= LAT_BUCKETS)
+        bucket = LAT_BUCKETS - 1;
+    h->buckets[bucket]++;
+    h->calls++;
+    h->total_ns += ns;
+    if (ns > h->max_ns)
+        h->max_ns = ns;
+}
+
+// Returns the upper bound (in ns) of the bucket holding the p-th percentile,
+// capped at the largest sample seen.
+static uint64_t hist_percentile(const LatencyHist *h, double p)
+{
+    if (h->calls == 0)
+        return 0;
+    uint64_t rank = (uint64_t)(p / 100.0 * h->calls);
+    if (rank >= h->calls)
+        rank = h->calls - 1;
+    uint64_t seen = 0;
+    for (int i = 0; i < LAT_BUCKETS; i++)
+    {
+        seen += h->buckets[i];
+        if (seen > rank)
+        {
+            uint64_t upper = i ? (i < 64 ? 1ULL << i : UINT64_MAX) : 0;
+            return upper < h->max_ns ? upper : h->max_ns;
+        }
+    }
+    return h->max_ns;
+}
+
+static LatencyEvent latency_events[LAT_MAX_EVENTS];
+static int latency_events_num = 0;
+
+// Records one sample for a named event, creating it on first use. Event names
+// must be string literals (or otherwise outlive the server).
+static void latency_add_sample(const char *name, uint64_t ns)
+{
+    LatencyEvent *ev = NULL;
+    for (int i = 0; i < latency_events_num; i++)
+    {
+        if (strcmp(latency_events[i].name, name) == 0)
+        {
+            ev = &latency_events[i];
+            break;
+        }
+    }
+    if (!ev)
+    {
+        if (latency_events_num == LAT_MAX_EVENTS)
+            return;
+        ev = &latency_events[latency_events_num++];
+        ev->name = name;
+    }
+    ev->last_time = time(NULL);
+    ev->last_ns = ns;
+    hist_add(&ev->hist, ns);
+}
+
+// ========== Server state ==========
+
+enum
+{
+    CONN_CLASS_NORMAL,
+    CONN_CLASS_MONITOR,
+    CONN_CLASS_NUM,
+};
+
+static const char *conn_class_names[CONN_CLASS_NUM] = {"normal", "monitor"};
+
+// Output buffer limits of a connection class, in bytes (0 means no limit).
+// A connection over the hard limit, or over the soft limit for soft_seconds,
+// is disconnected.
+typedef struct OutputLimit
+{
+    long long hard;
+    long long soft;
+    long long soft_seconds;
+} OutputLimit;
+
+typedef struct SlowlogEntry
+{
+    uint64_t id;
+    time_t time;
+    uint64_t duration_us;
+    char addr[144];
+    int argc;      // Arguments kept in argv
+    int orig_argc; // Arguments of the original command
+    char **argv;
+} SlowlogEntry;
+
+static struct
+{
+    time_t start_time;
+    uint64_t stat_numcommands;
+    uint64_t stat_numconnections;
+
+    long long slowlog_log_slower_than; // Microseconds, negative disables the log
+    long long slowlog_max_len;
+    uint64_t slowlog_threshold_ns;     // slowlog_log_slower_than in ns, UINT64_MAX when disabled
+    SlowlogEntry *slowlog;             // Ring buffer of slowlog_max_len entries
+    uint64_t slowlog_cap;              // Entries allocated, slowlog_max_len as of the last slowlog_init()
+    uint64_t slowlog_next_id;          // Entries ever logged, the newest is at (next_id - 1) % max_len
+    uint64_t slowlog_len;
+
+    Dict *keys;                        // The keyspace: char * -> Object *
+    long long zerocopy_min_size;       // Send pinned values of at least this size with MSG_ZEROCOPY, 0 disables it
+
+    time_t unixtime;                   // Cached at every event loop iteration
+    OutputLimit output_limits[CONN_CLASS_NUM];
+    long long client_query_buffer_limit; // Input a connection may have pending, closed beyond it; 0 is unlimited
+    int close_asap_num;                // Connections waiting to be closed at the end of the iteration
+    uint64_t stat_output_limit_disconnections;
+    LinkedList monitors;               // ConnListItem of the MONITOR connections
+    LinkedList zerocopy_lingering;     // ConnListItem of closed connections with MSG_ZEROCOPY sends in flight
+    int io_threads_num;                // I/O workers, including the main thread
+
+    uint64_t next_client_id;
+    Dict *tracking_table;              // Keys read by tracking connections: char * -> TrackingSet *
+    long long tracking_table_max_keys; // Older keys are invalidated beyond this, 0 is unlimited
+    struct Conn **tracking_pending;    // Connections with invalidations to send this iteration
+    int tracking_pending_num, tracking_pending_cap;
+    int tracking_clients;
+    uint64_t stat_tracking_invalidations;
+
+    long long active_defrag;              // Enables the defrag passes
+    long long active_defrag_ignore_bytes; // No pass below this much fragmented memory
+    long long active_defrag_threshold;    // Start a pass above this allocator fragmentation, in percent
+    int defrag_running;
+    uint64_t defrag_cursor;               // Dict_scan() cursor over the keyspace
+    uint64_t stat_defrag_hits, stat_defrag_misses;
+
+    int upgrade_fd;                       // Listening --upgrade-socket, -1 if none
+
+    Dict *expires;                        // Keys with a time to live: char * -> unix time in ms
+    uint64_t expire_cursor;               // Dict_scan() cursor of the expire job over expires
+    long long expire_next_ms;             // When the expire job starts its next sweep
+    int expire_backlog;                   // Many keys found expired, sweep again right away
+    uint64_t stat_expired_keys;
+
+    struct Object **lazyfree;             // Large values waiting to be freed by the lazyfree job
+    size_t lazyfree_head, lazyfree_num, lazyfree_cap;
+    size_t lazyfree_bytes;
+    uint64_t stat_lazyfreed;
+
+    long long hz;                         // Idle event loop wake ups per second
+    long long latency_slo_us;             // Bound on an event loop iteration, jobs included
+    long long sched_budget_us;            // Base time given to the jobs per iteration
+    long long sched_min_budget_us;        // Granted to the jobs even when over the SLO
+    uint64_t sched_tick_ns;               // Current budget, adapted to the job backlog
+    int sched_next;                       // Job served first at the next tick
+    int sched_state;                      // 0: no job has work, 1: some have, 2: backlog
+
+    Dict *blocking_keys;                  // Key -> connections blocked on it
+    char **ready_keys;                    // Keys written since the last serve
+    int ready_num, ready_cap;
+    int blocked_clients;
+
+    long long hash_max_packed_entries;    // Hashes beyond these limits move from the packed encoding to a Dict
+    long long hash_max_packed_value;
+} server = {
+    .upgrade_fd = -1,
+    .hz = 10,
+    .latency_slo_us = 5000,
+    .sched_budget_us = 1000,
+    .sched_min_budget_us = 100,
+    .hash_max_packed_entries = 64,
+    .hash_max_packed_value = 64,
+    .io_threads_num = 1,
+    .tracking_table_max_keys = 1000000,
+    .active_defrag_ignore_bytes = 100 * 1024 * 1024,
+    .active_defrag_threshold = 10,
+    .slowlog_log_slower_than = 10000,
+    .slowlog_max_len = 128,
+    .client_query_buffer_limit = 1024 * 1024 * 1024,
+    .output_limits = {
+        [CONN_CLASS_NORMAL] = {0, 0, 0},
+        [CONN_CLASS_MONITOR] = {32 * 1024 * 1024, 8 * 1024 * 1024, 60},
+    },
+};
+
+// ========== Values ==========
+
+// Refcounted byte buffer holding a string value. A reply can pin the buffer
+// instead of copying it, so the value stays valid until it is written even if
+// the key is overwritten or deleted in the meantime. A pinned buffer is
+// immutable: only its sole owner, with a refcount of 1, may change it in
+// place (SETBIT, through string_make_writable()); anyone else copies it
+// first, or a reply still sending it would see the change.
+typedef struct RBuf
+{
+    uint32_t refcount;
+    size_t len;
+    size_t cap; // Allocated bytes of data, not counting the terminating NUL
+    char data[];
+} RBuf;
+
+enum
+{
+    OBJ_STRING,
+    OBJ_BLOOM,
+    OBJ_CUCKOO,
+    OBJ_CMS,
+    OBJ_TOPK,
+    OBJ_STREAM,
+    OBJ_HASH,
+};
+
+typedef struct Object
+{
+    int type;
+    void *ptr;
+} Object;
+
+// Allocates a buffer of len bytes (plus a terminating NUL) left uninitialized.
+static RBuf *rbuf_alloc(size_t len)
+{
+    RBuf *b = Slab_alloc(sizeof(RBuf) + len + 1);
+    if (!b)
+        die("Slab_alloc()");
+    b->refcount = 1;
+    b->len = b->cap = len;
+    b->data[len] = '\0';
+    return b;
+}
+
+static RBuf *rbuf_create(const char *data, size_t len)
+{
+    RBuf *b = rbuf_alloc(len);
+    memcpy(b->data, data, len);
+    return b;
+}
+
+// Refcounts are atomic because I/O threads release the reply buffers they
+// finish writing, and a value can be pinned by replies on several threads.
+static RBuf *rbuf_retain(RBuf *b)
+{
+    __atomic_add_fetch(&b->refcount, 1, __ATOMIC_RELAXED);
+    return b;
+}
+
+static void rbuf_release(RBuf *b)
+{
+    if (__atomic_sub_fetch(&b->refcount, 1, __ATOMIC_ACQ_REL) == 0)
+        Slab_free(b);
+}
+
+static Object *object_create(int type, void *ptr)
+{
+    Object *o = Slab_alloc(sizeof(Object));
+    if (!o)
+        die("Slab_alloc()");
+    o->type = type;
+    o->ptr = ptr;
+    return o;
+}
+
+static void object_free(void *ptr)
+{
+    Object *o = ptr;
+    switch (o->type)
+    {
+    case OBJ_STRING:
+        rbuf_release(o->ptr);
+        break;
+    case OBJ_BLOOM:
+        Bloom_free(o->ptr);
+        break;
+    case OBJ_CUCKOO:
+        Cuckoo_free(o->ptr);
+        break;
+    case OBJ_CMS:
+        CountMin_free(o->ptr);
+        break;
+    case OBJ_TOPK:
+        TopK_free(o->ptr);
+        break;
+    case OBJ_STREAM:
+        Stream_free(o->ptr);
+        break;
+    case OBJ_HASH:
+        Hash_free(o->ptr);
+        break;
+    }
+    Slab_free(o);
+}
+
+static size_t object_bytes(const Object *o)
+{
+    switch (o->type)
+    {
+    case OBJ_STRING:
+        return sizeof(RBuf) + ((RBuf *)o->ptr)->cap;
+    case OBJ_BLOOM:
+        return Bloom_bytes(o->ptr);
+    case OBJ_CUCKOO:
+        return Cuckoo_bytes(o->ptr);
+    case OBJ_CMS:
+        return CountMin_bytes(o->ptr);
+    case OBJ_TOPK:
+        return TopK_bytes(o->ptr);
+    case OBJ_STREAM:
+        return Stream_bytes(o->ptr);
+    case OBJ_HASH:
+        return Hash_bytes(o->ptr);
+    }
+    return 0;
+}
+
+// Values at least this large are not freed by the command that drops them:
+// they are queued and freed by the lazyfree background job.
+#define LAZYFREE_MIN_BYTES (64 * 1024)
+
+static void object_release(void *ptr)
+{
+    Object *o = ptr;
+    size_t bytes = object_bytes(o);
+    if (bytes < LAZYFREE_MIN_BYTES)
+    {
+        object_free(o);
+        return;
+    }
+    if (server.lazyfree_num == server.lazyfree_cap)
+    {
+        // Reuse the slots already freed before growing
+        server.lazyfree_num -= server.lazyfree_head;
+        memmove(server.lazyfree, server.lazyfree + server.lazyfree_head, server.lazyfree_num * sizeof(Object *));
+        server.lazyfree_head = 0;
+        if (server.lazyfree_num == server.lazyfree_cap)
+        {
+            server.lazyfree_cap = server.lazyfree_cap ? server.lazyfree_cap * 2 : 64;
+            server.lazyfree = realloc(server.lazyfree, server.lazyfree_cap * sizeof(Object *));
+            if (!server.lazyfree)
+                die("realloc()");
+        }
+    }
+    server.lazyfree[server.lazyfree_num++] = o;
+    server.lazyfree_bytes += bytes;
+}
+
+static uint64_t key_hash(const void *key)
+{
+    return Dict_gen_hash(key, strlen(key));
+}
+
+static int key_equal(const void *a, const void *b)
+{
+    return strcmp(a, b) == 0;
+}
+
+static const DictType keyspace_dict_type = {key_hash, key_equal, Slab_free, object_release};
+static const DictType expires_dict_type = {key_hash, key_equal, Slab_free, NULL};
+
+// ========== Connections and replies ==========
+
+// Copied reply bytes live in fixed-size blocks, so a large or slowly drained
+// output buffer never needs one huge realloc. Values at least as large as a
+// block are pinned into the reply instead of copied.
+#define REPLY_BLOCK_SIZE (16 * 1024)
+#define REPLY_PIN_MIN_SIZE REPLY_BLOCK_SIZE
+#define REPLY_MAX_IOV 64
+#define ZEROCOPY_LINGER_MS 10000 // Wait for the completions of a closed connection before resetting it
+
+// A piece of pending output: a range of a reply block or of a pinned value.
+// Each part holds a reference to its buffer, so blocks are freed as soon as
+// the bytes they hold are sent.
+typedef struct ReplyPart
+{
+    RBuf *ref;
+    size_t off;
+    size_t len;
+} ReplyPart;
+
+// A pinned buffer handed to the kernel with MSG_ZEROCOPY, released once the
+// completion for its send call arrives on the socket error queue.
+typedef struct ZerocopyPending
+{
+    uint32_t seq;
+    RBuf *ref;
+} ZerocopyPending;
+
+typedef struct Conn
+{
+    MpscNode io_node; // Link in the I/O thread queues
+    int fd;
+    char addr[144]; // Peer address as "ip:port", or the socket path for AF_UNIX
+    int closing;   // Peer closed its side, close once the output is flushed
+    int close_asap; // Over its output buffer limits, closed at the end of the loop iteration
+    int conn_class;
+    ListItem *monitor_item; // Entry in server.monitors for MONITOR connections
+    uint64_t id;       // Unique for the lifetime of the server
+    int tracking;      // CLIENT TRACKING is on
+    char **inval_keys; // Invalidated keys not sent yet
+    int inval_num, inval_cap;
+    void (*block_proc)(struct Conn *c, int argc, char **argv); // Blocked command, NULL if none
+    char **block_argv;        // Copy of its arguments, followed by their lengths
+    int block_argc;
+    int block_firstkey, block_nkeys; // Keys it waits on, in block_argv
+    int block_retry;          // The blocked command is running again
+    long long block_deadline; // Unix time in ms at which it times out, 0 for never
+    char *rbuf;
+    size_t rlen, rcap;
+    size_t parsed;   // Bytes of rbuf split into the pending commands below
+    char **pargv;    // Arguments of the parsed commands, back to back, each followed by a NUL
+    size_t *pargl;   // Their lengths, arguments sent as RESP bulk strings may hold NULs
+    int *pargc;      // Argument count of each parsed command, 0 for one over MAX_ARGS
+    size_t pargv_num, pargv_cap, pcmd_num, pcmd_cap;
+    int proto_error;       // The input after the parsed commands is not valid RESP
+    const size_t *argl;    // Lengths of the arguments of the command running
+    int io_op;       // Work handed to an I/O thread
+    int io_error;    // Set when the socket failed during the I/O work
+    RBuf *tail;       // Reply block being filled, owned by the last part using it
+    size_t tail_used;
+    size_t reply_bytes;      // Pending output, copied and pinned
+    time_t soft_limit_since; // When reply_bytes went over the soft limit, 0 if under
+    ReplyPart *parts;
+    int parts_head, parts_num, parts_cap; // parts[parts_head..parts_num) are pending
+    int zerocopy;  // SO_ZEROCOPY is enabled on the socket
+    uint32_t zc_next_seq;
+    ZerocopyPending *zc_pending;
+    int zc_pending_num, zc_pending_cap;
+    long long zc_linger_deadline; // Closed with sends in flight, reset at this Unix time in ms
+} Conn;
+
+typedef struct ConnListItem
+{
+    ListItem list;
+    Conn *conn;
+} ConnListItem;
+
+static ReplyPart *reply_push_part(Conn *c)
+{
+    if (c->parts_num == c->parts_cap && c->parts_head > c->parts_cap / 2)
+    {
+        memmove(c->parts, c->parts + c->parts_head, (c->parts_num - c->parts_head) * sizeof(ReplyPart));
+        c->parts_num -= c->parts_head;
+        c->parts_head = 0;
+    }
+    if (c->parts_num == c->parts_cap)
+    {
+        c->parts_cap = c->parts_cap ? c->parts_cap * 2 : 16;
+        c->parts = realloc(c->parts, c->parts_cap * sizeof(ReplyPart));
+        if (!c->parts)
+            die("realloc()");
+    }
+    return &c->parts[c->parts_num++];
+}
+
+static int conn_has_output(const Conn *c)
+{
+    return c->parts_head < c->parts_num;
+}
+
+static void conn_check_output_limits(Conn *c);
+
+static void reply_append(Conn *c, const char *data, size_t len)
+{
+    if (c->close_asap)
+        return;
+    c->reply_bytes += len;
+
+    while (len)
+    {
+        if (!c->tail || c->tail_used == c->tail->len)
+        {
+            if (c->tail)
+                rbuf_release(c->tail);
+            c->tail = rbuf_alloc(REPLY_BLOCK_SIZE - sizeof(RBuf) - 1); // Fills a size class
+            c->tail_used = 0;
+        }
+        size_t n = c->tail->len - c->tail_used;
+        if (n > len)
+            n = len;
+        memcpy(c->tail->data + c->tail_used, data, n);
+
+        ReplyPart *last = conn_has_output(c) ? &c->parts[c->parts_num - 1] : NULL;
+        if (last && last->ref == c->tail && last->off + last->len == c->tail_used)
+        {
+            last->len += n;
+        }
+        else
+        {
+            ReplyPart *p = reply_push_part(c);
+            p->ref = rbuf_retain(c->tail);
+            p->off = c->tail_used;
+            p->len = n;
+        }
+        c->tail_used += n;
+        data += n;
+        len -= n;
+    }
+    conn_check_output_limits(c);
+}
+
+// Appends a value to the reply, pinning large buffers instead of copying them.
+static void reply_rbuf(Conn *c, RBuf *b)
+{
+    if (b->len < REPLY_PIN_MIN_SIZE)
+    {
+        reply_append(c, b->data, b->len);
+        return;
+    }
+    if (c->close_asap)
+        return;
+    ReplyPart *p = reply_push_part(c);
+    p->ref = rbuf_retain(b);
+    p->off = 0;
+    p->len = b->len;
+    c->reply_bytes += b->len;
+    conn_check_output_limits(c);
+}
+
+static void reply_status(Conn *c, const char *status)
+{
+    reply_append(c, "+", 1);
+    reply_append(c, status, strlen(status));
+    reply_append(c, "\r\n", 2);
+}
+
+static void reply_error(Conn *c, const char *err)
+{
+    reply_append(c, "-", 1);
+    reply_append(c, err, strlen(err));
+    reply_append(c, "\r\n", 2);
+}
+
+static void reply_integer(Conn *c, long long v)
+{
+    char buf[32];
+    int n = snprintf(buf, sizeof(buf), ":%lld\r\n", v);
+    reply_append(c, buf, n);
+}
+
+static void reply_bulk(Conn *c, const char *data, size_t len)
+{
+    char hdr[32];
+    int n = snprintf(hdr, sizeof(hdr), "$%zu\r\n", len);
+    reply_append(c, hdr, n);
+    reply_append(c, data, len);
+    reply_append(c, "\r\n", 2);
+}
+
+static void reply_bulk_rbuf(Conn *c, RBuf *b)
+{
+    char hdr[32];
+    int n = snprintf(hdr, sizeof(hdr), "$%zu\r\n", b->len);
+    reply_append(c, hdr, n);
+    reply_rbuf(c, b);
+    reply_append(c, "\r\n", 2);
+}
+
+static void reply_null(Conn *c)
+{
+    reply_append(c, "$-1\r\n", 5);
+}
+
+static void reply_array_len(Conn *c, long long len)
+{
+    char buf[32];
+    int n = snprintf(buf, sizeof(buf), "*%lld\r\n", len);
+    reply_append(c, buf, n);
+}
+
+// Drops the first n pending bytes, releasing the pinned buffers fully sent.
+static void reply_consume(Conn *c, size_t n)
+{
+    c->reply_bytes -= n;
+    while (n && conn_has_output(c))
+    {
+        ReplyPart *p = &c->parts[c->parts_head];
+        if (n < p->len)
+        {
+            p->off += n;
+            p->len -= n;
+            return;
+        }
+        n -= p->len;
+        rbuf_release(p->ref);
+        c->parts_head++;
+    }
+    if (!conn_has_output(c))
+    {
+        c->parts_head = c->parts_num = 0;
+        c->reply_bytes = 0;
+    }
+    if (c->soft_limit_since &&
+        c->reply_bytes < (size_t)server.output_limits[c->conn_class].soft)
+        c->soft_limit_since = 0;
+}
+
+// Marks the connection to be closed at the end of the event loop iteration:
+// it may be in the middle of a command, or be a monitor fed by another one.
+static void conn_close_async(Conn *c)
+{
+    if (c->close_asap)
+        return;
+    c->close_asap = 1;
+    server.close_asap_num++;
+}
+
+static void conn_check_output_limits(Conn *c)
+{
+    const OutputLimit *l = &server.output_limits[c->conn_class];
+    int hard = l->hard && c->reply_bytes >= (size_t)l->hard;
+    int soft = l->soft && c->reply_bytes >= (size_t)l->soft;
+
+    if (!soft)
+    {
+        c->soft_limit_since = 0;
+    }
+    else if (!hard)
+    {
+        if (!c->soft_limit_since)
+            c->soft_limit_since = server.unixtime;
+        else if (server.unixtime - c->soft_limit_since >= l->soft_seconds)
+            hard = 1;
+    }
+
+    if (hard)
+    {
+        fprintf(stderr, "closing %s client %s: %zu bytes of pending output over the limits\n",
+                conn_class_names[c->conn_class], c->addr, c->reply_bytes);
+        server.stat_output_limit_disconnections++;
+        conn_close_async(c);
+    }
+}
+
+static void zerocopy_track(Conn *c, RBuf *b)
+{
+    if (c->zc_pending_num == c->zc_pending_cap)
+    {
+        c->zc_pending_cap = c->zc_pending_cap ? c->zc_pending_cap * 2 : 8;
+        c->zc_pending = realloc(c->zc_pending, c->zc_pending_cap * sizeof(ZerocopyPending));
+        if (!c->zc_pending)
+            die("realloc()");
+    }
+    c->zc_pending[c->zc_pending_num++] = (ZerocopyPending){c->zc_next_seq++, rbuf_retain(b)};
+}
+
+// Drains the socket error queue and releases the buffers whose send calls
+// the kernel reports done with. The queue is read even with nothing pending:
+// a socket taken over from the old process may carry completions for its
+// sends, and left unread they keep POLLERR set. Returns the number of
+// notifications read.
+static int zerocopy_reap(Conn *c)
+{
+    int reaped = 0;
+    for (;; reaped++)
+    {
+        char control[128];
+        struct msghdr m = {.msg_control = control, .msg_controllen = sizeof(control)};
+        if (recvmsg(c->fd, &m, MSG_ERRQUEUE) < 0)
+            return reaped;
+        for (struct cmsghdr *cm = CMSG_FIRSTHDR(&m); cm; cm = CMSG_NXTHDR(&m, cm))
+        {
+            if (cm->cmsg_level != SOL_IP || cm->cmsg_type != IP_RECVERR)
+                continue;
+            struct sock_extended_err *serr = (struct sock_extended_err *)CMSG_DATA(cm);
+            if (serr->ee_errno != 0 || serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+                continue;
+            // [ee_info, ee_data] is the range of completed send calls
+            int kept = 0;
+            for (int i = 0; i < c->zc_pending_num; i++)
+            {
+                ZerocopyPending *zp = &c->zc_pending[i];
+                if ((uint32_t)(zp->seq - serr->ee_info) <= serr->ee_data - serr->ee_info)
+                    rbuf_release(zp->ref);
+                else
+                    c->zc_pending[kept++] = *zp;
+            }
+            c->zc_pending_num = kept;
+        }
+    }
+}
+
+// Finishes closing the connections conn_close() left open for their pending
+// MSG_ZEROCOPY completions. Their buffers are released once the kernel is done
+// with them, or after the connection is reset if the peer stalls.
+static void zerocopy_linger_check(void)
+{
+    long long now = server.zerocopy_lingering.size ? mstime() : 0;
+    ListItem *next;
+    for (ListItem *li = server.zerocopy_lingering.first; li; li = next)
+    {
+        next = li->next;
+        Conn *c = ((ConnListItem *)li)->conn;
+        zerocopy_reap(c);
+        if (c->zc_pending_num && now < c->zc_linger_deadline)
+            continue;
+        if (c->zc_pending_num)
+        {
+            // An abortive close drops the send queue and the pages with it
+            struct linger lg = {.l_onoff = 1, .l_linger = 0};
+            setsockopt(c->fd, SOL_SOCKET, SO_LINGER, &lg, sizeof(lg));
+        }
+        close(c->fd);
+        for (int i = 0; i < c->zc_pending_num; i++)
+            rbuf_release(c->zc_pending[i].ref);
+        free(c->zc_pending);
+        Slab_free(c);
+        free(List_remove(&server.zerocopy_lingering, li));
+    }
+}
+
+// Writes as much pending output as the socket accepts, with one writev() for
+// up to REPLY_MAX_IOV parts. Large pinned values go out with MSG_ZEROCOPY when
+// enabled. Returns -1 on error, otherwise 0; whatever is left is written once
+// poll() reports POLLOUT.
+static int flush_output(Conn *c)
+{
+    while (conn_has_output(c))
+    {
+        ReplyPart *head = &c->parts[c->parts_head];
+        ssize_t n;
+
+        if (c->zerocopy && head->ref && server.zerocopy_min_size > 0 &&
+            (long long)head->len >= server.zerocopy_min_size)
+        {
+            n = send(c->fd, head->ref->data + head->off, head->len, MSG_ZEROCOPY);
+            if (n < 0 && errno == ENOBUFS)
+            {
+                c->zerocopy = 0; // over the optmem limit, fall back to copying
+                continue;
+            }
+            if (n >= 0)
+                zerocopy_track(c, head->ref);
+        }
+        else
+        {
+            struct iovec iov[REPLY_MAX_IOV];
+            int iovcnt = 0;
+            for (int i = c->parts_head; i < c->parts_num && iovcnt < REPLY_MAX_IOV; i++)
+            {
+                ReplyPart *p = &c->parts[i];
+                iov[iovcnt].iov_base = p->ref->data + p->off;
+                iov[iovcnt].iov_len = p->len;
+                iovcnt++;
+            }
+            n = writev(c->fd, iov, iovcnt);
+        }
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+            msg("write() error");
+            return -1;
+        }
+        reply_consume(c, n);
+    }
+    return 0;
+}
+
+typedef struct Listener
+{
+    int fd;
+    int family;
+    char name[128]; // As given on the command line
+} Listener;
+
+static Listener listeners[MAX_LISTENERS];
+static int listeners_num = 0;
+
+static Conn **conns = NULL; // Indexed by fd
+static int conns_cap = 0;
+
+// Small growable text buffer used to build INFO and LATENCY replies.
+typedef struct TextBuf
+{
+    char *data;
+    size_t len, cap;
+} TextBuf;
+
+__attribute__((format(printf, 2, 3)))
+static void text_printf(TextBuf *t, const char *fmt, ...)
+{
+    va_list ap;
+    for (;;)
+    {
+        size_t avail = t->cap - t->len;
+        va_start(ap, fmt);
+        int n = vsnprintf(t->data ? t->data + t->len : NULL, avail, fmt, ap);
+        va_end(ap);
+        if (n < 0)
+            return;
+        if ((size_t)n < avail)
+        {
+            t->len += n;
+            return;
+        }
+        t->cap = t->cap ? t->cap * 2 : 1024;
+        while (t->cap - t->len <= (size_t)n)
+            t->cap *= 2;
+        t->data = realloc(t->data, t->cap);
+        if (!t->data)
+            die("realloc()");
+    }
+}
+
+static void reply_text(Conn *c, TextBuf *t)
+{
+    reply_bulk(c, t->data ? t->data : "", t->len);
+    free(t->data);
+}
+
+// ========== Commands ==========
+
+typedef void (*command_proc)(Conn *c, int argc, char **argv);
+
+#define CMD_READONLY (1 << 0) // Reads the keys, tracked for client side caching
+#define CMD_WRITE (1 << 1)    // May modify the keys, invalidates them
+
+typedef struct Command
+{
+    const char *name;
+    command_proc proc;
+    int arity; // Exact argc when > 0, minimum argc when < 0
+    int flags; // CMD_* flags
+    // Positions of the key arguments, 0 if none; a negative lastkey counts
+    // from the end of the arguments
+    int firstkey, lastkey, keystep;
+    LatencyHist stats; // Call count, total time and latency histogram
+} Command;
+
+static void ping_command(Conn *c, int argc, char **argv);
+static void info_command(Conn *c, int argc, char **argv);
+static void latency_command(Conn *c, int argc, char **argv);
+static void slowlog_command(Conn *c, int argc, char **argv);
+static void config_command(Conn *c, int argc, char **argv);
+static void set_command(Conn *c, int argc, char **argv);
+static void get_command(Conn *c, int argc, char **argv);
+static void del_command(Conn *c, int argc, char **argv);
+static void setbit_command(Conn *c, int argc, char **argv);
+static void getbit_command(Conn *c, int argc, char **argv);
+static void bitcount_command(Conn *c, int argc, char **argv);
+static void bitpos_command(Conn *c, int argc, char **argv);
+static void bitop_command(Conn *c, int argc, char **argv);
+static void monitor_command(Conn *c, int argc, char **argv);
+static void bf_reserve_command(Conn *c, int argc, char **argv);
+static void bf_add_command(Conn *c, int argc, char **argv);
+static void bf_exists_command(Conn *c, int argc, char **argv);
+static void cf_reserve_command(Conn *c, int argc, char **argv);
+static void cf_add_command(Conn *c, int argc, char **argv);
+static void cf_del_command(Conn *c, int argc, char **argv);
+static void cf_exists_command(Conn *c, int argc, char **argv);
+static void cms_initbydim_command(Conn *c, int argc, char **argv);
+static void cms_initbyprob_command(Conn *c, int argc, char **argv);
+static void cms_incrby_command(Conn *c, int argc, char **argv);
+static void cms_query_command(Conn *c, int argc, char **argv);
+static void topk_reserve_command(Conn *c, int argc, char **argv);
+static void topk_add_command(Conn *c, int argc, char **argv);
+static void topk_query_command(Conn *c, int argc, char **argv);
+static void topk_list_command(Conn *c, int argc, char **argv);
+static void client_command(Conn *c, int argc, char **argv);
+static void expire_command(Conn *c, int argc, char **argv);
+static void pexpire_command(Conn *c, int argc, char **argv);
+static void ttl_command(Conn *c, int argc, char **argv);
+static void pttl_command(Conn *c, int argc, char **argv);
+static void persist_command(Conn *c, int argc, char **argv);
+static void xadd_command(Conn *c, int argc, char **argv);
+static void xlen_command(Conn *c, int argc, char **argv);
+static void xrange_command(Conn *c, int argc, char **argv);
+static void xread_command(Conn *c, int argc, char **argv);
+static void xgroup_command(Conn *c, int argc, char **argv);
+static void xreadgroup_command(Conn *c, int argc, char **argv);
+static void xack_command(Conn *c, int argc, char **argv);
+static void xpending_command(Conn *c, int argc, char **argv);
+static void hset_command(Conn *c, int argc, char **argv);
+static void hget_command(Conn *c, int argc, char **argv);
+static void hdel_command(Conn *c, int argc, char **argv);
+static void hgetall_command(Conn *c, int argc, char **argv);
+static void hincrby_command(Conn *c, int argc, char **argv);
+
+static Command command_table[] = {
+    {"ping", ping_command, -1, 0, 0, 0, 0, {0}},
+    {"info", info_command, -1, 0, 0, 0, 0, {0}},
+    {"latency", latency_command, -2, 0, 0, 0, 0, {0}},
+    {"slowlog", slowlog_command, -2, 0, 0, 0, 0, {0}},
+    {"config", config_command, -3, 0, 0, 0, 0, {0}},
+    {"set", set_command, 3, CMD_WRITE, 1, 1, 1, {0}},
+    {"get", get_command, 2, CMD_READONLY, 1, 1, 1, {0}},
+    {"del", del_command, -2, CMD_WRITE, 1, -1, 1, {0}},
+    {"setbit", setbit_command, 4, CMD_WRITE, 1, 1, 1, {0}},
+    {"getbit", getbit_command, 3, CMD_READONLY, 1, 1, 1, {0}},
+    {"bitcount", bitcount_command, -2, CMD_READONLY, 1, 1, 1, {0}},
+    {"bitpos", bitpos_command, -3, CMD_READONLY, 1, 1, 1, {0}},
+    {"bitop", bitop_command, -4, CMD_WRITE, 2, 2, 1, {0}},
+    {"monitor", monitor_command, 1, 0, 0, 0, 0, {0}},
+    {"bf.reserve", bf_reserve_command, 4, CMD_WRITE, 1, 1, 1, {0}},
+    {"bf.add", bf_add_command, 3, CMD_WRITE, 1, 1, 1, {0}},
+    {"bf.exists", bf_exists_command, 3, CMD_READONLY, 1, 1, 1, {0}},
+    {"cf.reserve", cf_reserve_command, 3, CMD_WRITE, 1, 1, 1, {0}},
+    {"cf.add", cf_add_command, 3, CMD_WRITE, 1, 1, 1, {0}},
+    {"cf.del", cf_del_command, 3, CMD_WRITE, 1, 1, 1, {0}},
+    {"cf.exists", cf_exists_command, 3, CMD_READONLY, 1, 1, 1, {0}},
+    {"cms.initbydim", cms_initbydim_command, 4, CMD_WRITE, 1, 1, 1, {0}},
+    {"cms.initbyprob", cms_initbyprob_command, 4, CMD_WRITE, 1, 1, 1, {0}},
+    {"cms.incrby", cms_incrby_command, -4, CMD_WRITE, 1, 1, 1, {0}},
+    {"cms.query", cms_query_command, -3, CMD_READONLY, 1, 1, 1, {0}},
+    {"topk.reserve", topk_reserve_command, -3, CMD_WRITE, 1, 1, 1, {0}},
+    {"topk.add", topk_add_command, -3, CMD_WRITE, 1, 1, 1, {0}},
+    {"topk.query", topk_query_command, -3, CMD_READONLY, 1, 1, 1, {0}},
+    {"topk.list", topk_list_command, -2, CMD_READONLY, 1, 1, 1, {0}},
+    {"client", client_command, -2, 0, 0, 0, 0, {0}},
+    {"expire", expire_command, 3, CMD_WRITE, 1, 1, 1, {0}},
+    {"pexpire", pexpire_command, 3, CMD_WRITE, 1, 1, 1, {0}},
+    {"ttl", ttl_command, 2, CMD_READONLY, 1, 1, 1, {0}},
+    {"pttl", pttl_command, 2, CMD_READONLY, 1, 1, 1, {0}},
+    {"persist", persist_command, 2, CMD_WRITE, 1, 1, 1, {0}},
+    {"xadd", xadd_command, -5, CMD_WRITE, 1, 1, 1, {0}},
+    {"xlen", xlen_command, 2, CMD_READONLY, 1, 1, 1, {0}},
+    {"xrange", xrange_command, -4, CMD_READONLY, 1, 1, 1, {0}},
+    {"xread", xread_command, -4, 0, 0, 0, 0, {0}},
+    {"xgroup", xgroup_command, -4, CMD_WRITE, 2, 2, 1, {0}},
+    {"xreadgroup", xreadgroup_command, -7, 0, 0, 0, 0, {0}},
+    {"xack", xack_command, -4, CMD_WRITE, 1, 1, 1, {0}},
+    {"xpending", xpending_command, 3, CMD_READONLY, 1, 1, 1, {0}},
+    {"hset", hset_command, -4, CMD_WRITE, 1, 1, 1, {0}},
+    {"hget", hget_command, 3, CMD_READONLY, 1, 1, 1, {0}},
+    {"hdel", hdel_command, -3, CMD_WRITE, 1, 1, 1, {0}},
+    {"hgetall", hgetall_command, 2, CMD_READONLY, 1, 1, 1, {0}},
+    {"hincrby", hincrby_command, 4, CMD_WRITE, 1, 1, 1, {0}},
+};
+
+#define COMMAND_NUM (int)(sizeof(command_table) / sizeof(command_table[0]))
+
+static Command *lookup_command(const char *name)
+{
+    for (int i = 0; i < COMMAND_NUM; i++)
+        if (strcasecmp(command_table[i].name, name) == 0)
+            return &command_table[i];
+    return NULL;
+}
+
+static void ping_command(Conn *c, int argc, char **argv)
+{
+    if (argc > 1)
+        reply_bulk(c, argv[1], c->argl[1]);
+    else
+        reply_status(c, "PONG");
+}
+
+// ========== Keyspace helpers ==========
+
+// Stores the object at key, replacing (and freeing) any previous value.
+static void db_set(const char *key, Object *o)
+{
+    DictEntry *de = Dict_find(server.keys, key);
+    if (de)
+    {
+        // A new value starts without a time to live
+        object_release(de->val);
+        de->val = o;
+        Dict_delete(server.expires, key);
+        return;
+    }
+    char *k = Slab_strdup(key);
+    if (!k)
+        die("Slab_strdup()");
+    Dict_add(server.keys, k, o);
+}
+
+// Removes the key and its time to live. Returns 1 if the key existed.
+static int db_delete(const char *key)
+{
+    Dict_delete(server.expires, key);
+    return Dict_delete(server.keys, key);
+}
+
+// Returns the object at key, or NULL if the key is missing or holds another
+// type; in the latter case a WRONGTYPE error is sent and *wrongtype is set.
+static Object *db_lookup_typed(Conn *c, const char *key, int type, int *wrongtype)
+{
+    *wrongtype = 0;
+    DictEntry *de = Dict_find(server.keys, key);
+    if (!de)
+        return NULL;
+    Object *o = de->val;
+    if (o->type != type)
+    {
+        reply_error(c, "WRONGTYPE Operation against a key holding the wrong kind of value");
+        *wrongtype = 1;
+        return NULL;
+    }
+    return o;
+}
+
+// ========== Blocking operations ==========
+
+// A command that has to wait for data (XREAD BLOCK) parks its connection
+// with conn_block(): its arguments are copied, the connection is listed
+// under each of its keys in server.blocking_keys, and it is not read from
+// until it is served, so the commands pipelined after it keep their order.
+// A write to one of the keys marks it ready. After the commands of the event
+// loop iteration, the blocked commands waiting on the ready keys run again
+// and either reply or block again; at their deadline they get a null reply.
+
+typedef struct BlockedSet
+{
+    Conn **conns; // In blocking order
+    int num, cap;
+    int ready; // Listed in server.ready_keys
+} BlockedSet;
+
+static void blocked_set_free(void *ptr)
+{
+    BlockedSet *bs = ptr;
+    free(bs->conns);
+    free(bs);
+}
+
+static const DictType blocking_dict_type = {key_hash, key_equal, Slab_free, blocked_set_free};
+
+// Blocks c on the nkeys keys at argv[firstkey...] for up to timeout_ms
+// (0 waits forever). proc runs again with a copy of argv when a key is
+// written; a command that blocks again keeps its first deadline.
+static void conn_block(Conn *c, command_proc proc, int argc, char **argv, int firstkey, int nkeys,
+                       long long timeout_ms)
+{
+    if (!c->block_retry)
+        c->block_deadline = timeout_ms ? mstime() + timeout_ms : 0;
+
+    // The arguments of a blocking command are keys and IDs, never binary
+    size_t bytes = argc * (sizeof(char *) + sizeof(size_t));
+    for (int i = 0; i < argc; i++)
+        bytes += strlen(argv[i]) + 1;
+    c->block_argv = malloc(bytes);
+    if (!c->block_argv)
+        die("malloc()");
+    size_t *lens = (size_t *)(c->block_argv + argc);
+    char *p = (char *)(lens + argc);
+    for (int i = 0; i < argc; i++)
+    {
+        lens[i] = strlen(argv[i]);
+        memcpy(p, argv[i], lens[i] + 1);
+        c->block_argv[i] = p;
+        p += lens[i] + 1;
+    }
+    c->block_argc = argc;
+    c->block_proc = proc;
+    c->block_firstkey = firstkey;
+    c->block_nkeys = nkeys;
+    server.blocked_clients++;
+
+    for (int i = firstkey; i < firstkey + nkeys; i++)
+    {
+        DictEntry *de = Dict_find(server.blocking_keys, argv[i]);
+        if (!de)
+        {
+            char *k = Slab_strdup(argv[i]);
+            BlockedSet *bs = calloc(1, sizeof(BlockedSet));
+            if (!k || !bs)
+                die("calloc()");
+            Dict_add(server.blocking_keys, k, bs);
+            de = Dict_find(server.blocking_keys, k);
+        }
+        BlockedSet *bs = de->val;
+        if (bs->num && bs->conns[bs->num - 1] == c)
+            continue; // Same key listed twice
+        if (bs->num == bs->cap)
+        {
+            bs->cap = bs->cap ? bs->cap * 2 : 4;
+            bs->conns = realloc(bs->conns, bs->cap * sizeof(Conn *));
+            if (!bs->conns)
+                die("realloc()");
+        }
+        bs->conns[bs->num++] = c;
+    }
+}
+
+// Takes c off its keys. Returns the copy of the blocked command's arguments,
+// for the caller to free.
+static char **conn_unblock(Conn *c)
+{
+    char **argv = c->block_argv;
+    for (int i = c->block_firstkey; i < c->block_firstkey + c->block_nkeys; i++)
+    {
+        DictEntry *de = Dict_find(server.blocking_keys, argv[i]);
+        if (!de)
+            continue;
+        BlockedSet *bs = de->val;
+        for (int j = 0; j < bs->num; j++)
+        {
+            if (bs->conns[j] == c)
+            {
+                memmove(bs->conns + j, bs->conns + j + 1, (bs->num - j - 1) * sizeof(Conn *));
+                bs->num--;
+                break;
+            }
+        }
+        if (!bs->num)
+            Dict_delete(server.blocking_keys, argv[i]);
+    }
+    c->block_proc = NULL;
+    c->block_argv = NULL;
+    server.blocked_clients--;
+    return argv;
+}
+
+// Called on every write to key: marks it ready if connections wait on it.
+static void signal_key_as_ready(const char *key)
+{
+    if (!server.blocked_clients)
+        return;
+    DictEntry *de = Dict_find(server.blocking_keys, key);
+    if (!de || ((BlockedSet *)de->val)->ready)
+        return;
+    ((BlockedSet *)de->val)->ready = 1;
+    if (server.ready_num == server.ready_cap)
+    {
+        server.ready_cap = server.ready_cap ? server.ready_cap * 2 : 16;
+        server.ready_keys = realloc(server.ready_keys, server.ready_cap * sizeof(char *));
+        if (!server.ready_keys)
+            die("realloc()");
+    }
+    server.ready_keys[server.ready_num] = strdup(key);
+    if (!server.ready_keys[server.ready_num])
+        die("strdup()");
+    server.ready_num++;
+}
+
+// ========== Client tracking ==========
+
+// Keys read by connections in tracking mode, each with the connections that
+// may have cached its value. A write to a tracked key queues an invalidation
+// for those connections and forgets the key until it is read again. Queued
+// invalidations are sent once per event loop iteration, as one RESP3 style
+// push message per connection: >2 "invalidate" [key ...].
+
+typedef struct TrackingRef
+{
+    int fd;      // Slot in conns[]
+    uint64_t id; // Tells a connection apart from a later one reusing the fd
+} TrackingRef;
+
+typedef struct TrackingSet
+{
+    TrackingRef *refs;
+    int num, cap;
+} TrackingSet;
+
+static void tracking_set_free(void *ptr)
+{
+    TrackingSet *ts = ptr;
+    free(ts->refs);
+    free(ts);
+}
+
+static const DictType tracking_dict_type = {key_hash, key_equal, free, tracking_set_free};
+
+static void tracking_remember(Conn *c, const char *key)
+{
+    TrackingSet *ts;
+    DictEntry *de = Dict_find(server.tracking_table, key);
+    if (de)
+    {
+        ts = de->val;
+        for (int i = 0; i < ts->num; i++)
+            if (ts->refs[i].id == c->id)
+                return;
+    }
+    else
+    {
+        ts = calloc(1, sizeof(TrackingSet));
+        char *k = strdup(key);
+        if (!ts || !k)
+            die("calloc()");
+        Dict_add(server.tracking_table, k, ts);
+    }
+    if (ts->num == ts->cap)
+    {
+        ts->cap = ts->cap ? ts->cap * 2 : 4;
+        ts->refs = realloc(ts->refs, ts->cap * sizeof(TrackingRef));
+        if (!ts->refs)
+            die("realloc()");
+    }
+    ts->refs[ts->num++] = (TrackingRef){c->fd, c->id};
+}
+
+static void tracking_queue(Conn *c, const char *key)
+{
+    if (c->inval_num == 0)
+    {
+        if (server.tracking_pending_num == server.tracking_pending_cap)
+        {
+            server.tracking_pending_cap = server.tracking_pending_cap ? server.tracking_pending_cap * 2 : 16;
+            server.tracking_pending = realloc(server.tracking_pending, server.tracking_pending_cap * sizeof(Conn *));
+            if (!server.tracking_pending)
+                die("realloc()");
+        }
+        server.tracking_pending[server.tracking_pending_num++] = c;
+    }
+    if (c->inval_num == c->inval_cap)
+    {
+        c->inval_cap = c->inval_cap ? c->inval_cap * 2 : 8;
+        c->inval_keys = realloc(c->inval_keys, c->inval_cap * sizeof(char *));
+        if (!c->inval_keys)
+            die("realloc()");
+    }
+    c->inval_keys[c->inval_num] = strdup(key);
+    if (!c->inval_keys[c->inval_num])
+        die("strdup()");
+    c->inval_num++;
+}
+
+// Drops the queued invalidations of a connection being closed.
+static void tracking_discard(Conn *c)
+{
+    for (int i = 0; i < c->inval_num; i++)
+        free(c->inval_keys[i]);
+    c->inval_num = 0;
+    for (int i = 0; i < server.tracking_pending_num; i++)
+    {
+        if (server.tracking_pending[i] == c)
+        {
+            server.tracking_pending[i] = server.tracking_pending[--server.tracking_pending_num];
+            break;
+        }
+    }
+}
+
+// Called with every key a command may have modified.
+static void signal_modified_key(const char *key)
+{
+    signal_key_as_ready(key);
+    DictEntry *de = Dict_find(server.tracking_table, key);
+    if (!de)
+        return;
+    TrackingSet *ts = de->val;
+    for (int i = 0; i < ts->num; i++)
+    {
+        TrackingRef *ref = &ts->refs[i];
+        Conn *c = ref->fd < conns_cap ? conns[ref->fd] : NULL;
+        if (c && c->id == ref->id && c->tracking)
+            tracking_queue(c, key);
+    }
+    Dict_delete(server.tracking_table, key);
+}
+
+// Tracks the keys read by a command for its connection, or invalidates the
+// keys it may have written.
+static void tracking_command_keys(Conn *c, const Command *cmd, int argc, char **argv)
+{
+    int last = cmd->lastkey < 0 ? argc + cmd->lastkey : cmd->lastkey;
+    for (int i = cmd->firstkey; i && i <= last && i < argc; i += cmd->keystep)
+    {
+        if (cmd->flags & CMD_WRITE)
+            signal_modified_key(argv[i]);
+        else if (c->tracking)
+            tracking_remember(c, argv[i]);
+    }
+}
+
+// Invalidates keys until the table fits tracking-table-max-keys again, so
+// the connections caching them stop relying on the table.
+static void tracking_enforce_limit(void)
+{
+    size_t size = Dict_size(server.tracking_table);
+    if (server.tracking_table_max_keys == 0 || size <= (size_t)server.tracking_table_max_keys)
+        return;
+    size_t excess = size - server.tracking_table_max_keys;
+    char **victims = malloc(excess * sizeof(char *));
+    if (!victims)
+        die("malloc()");
+
+    DictIterator it;
+    Dict_iter_init(&it, server.tracking_table);
+    for (size_t i = 0; i < excess; i++)
+    {
+        victims[i] = strdup(Dict_next(&it)->key);
+        if (!victims[i])
+            die("strdup()");
+    }
+    Dict_iter_release(&it);
+
+    for (size_t i = 0; i < excess; i++)
+    {
+        signal_modified_key(victims[i]);
+        free(victims[i]);
+    }
+    free(victims);
+}
+
+// Sends the invalidations queued during this event loop iteration.
+static void tracking_flush(void)
+{
+    tracking_enforce_limit();
+    for (int i = 0; i < server.tracking_pending_num; i++)
+    {
+        Conn *c = server.tracking_pending[i];
+        static const char push[] = ">2\r\n$10\r\ninvalidate\r\n";
+        reply_append(c, push, sizeof(push) - 1);
+        reply_array_len(c, c->inval_num);
+        for (int j = 0; j < c->inval_num; j++)
+        {
+            reply_bulk(c, c->inval_keys[j], strlen(c->inval_keys[j]));
+            free(c->inval_keys[j]);
+        }
+        server.stat_tracking_invalidations += c->inval_num;
+        c->inval_num = 0;
+    }
+    server.tracking_pending_num = 0;
+}
+
+// CLIENT ID | TRACKING ON|OFF
+static void client_command(Conn *c, int argc, char **argv)
+{
+    if (strcasecmp(argv[1], "id") == 0 && argc == 2)
+    {
+        reply_integer(c, c->id);
+    }
+    else if (strcasecmp(argv[1], "tracking") == 0 && argc == 3)
+    {
+        int on;
+        if (strcasecmp(argv[2], "on") == 0)
+            on = 1;
+        else if (strcasecmp(argv[2], "off") == 0)
+            on = 0;
+        else
+        {
+            reply_error(c, "ERR syntax error");
+            return;
+        }
+        // Keys tracked before turning it off are dropped lazily: the
+        // connection is skipped when they are invalidated.
+        server.tracking_clients += on - c->tracking;
+        c->tracking = on;
+        reply_status(c, "OK");
+    }
+    else
+    {
+        reply_error(c, "ERR unknown CLIENT subcommand");
+    }
+}
+
+// ========== String commands ==========
+
+#define STRING_MAX_LEN (512ULL * 1024 * 1024)
+
+// Makes the string in o safe to modify in place and at least minlen bytes
+// long, zero filling any new bytes. A buffer still pinned by a pending reply
+// is copied first, so the reply keeps sending the old contents.
+static RBuf *string_make_writable(Object *o, size_t minlen)
+{
+    RBuf *b = o->ptr;
+    size_t len = b->len > minlen ? b->len : minlen;
+
+    if (__atomic_load_n(&b->refcount, __ATOMIC_ACQUIRE) > 1)
+    {
+        RBuf *copy = rbuf_alloc(len);
+        memcpy(copy->data, b->data, b->len);
+        memset(copy->data + b->len, 0, len - b->len);
+        rbuf_release(b);
+        o->ptr = b = copy;
+    }
+    else if (len > b->cap)
+    {
+        // Grow greedily so that a run of SETBITs at increasing offsets does
+        // not reallocate every time
+        size_t cap = len < 1024 * 1024 ? len * 2 : len + 1024 * 1024;
+        b = Slab_realloc(b, sizeof(RBuf) + cap + 1);
+        if (!b)
+            die("Slab_realloc()");
+        b->cap = cap;
+        o->ptr = b;
+    }
+    if (len > b->len)
+    {
+        memset(b->data + b->len, 0, len - b->len);
+        b->len = len;
+        b->data[len] = '\0';
+    }
+    return b;
+}
+
+static void set_command(Conn *c, int argc, char **argv)
+{
+    (void)argc;
+    db_set(argv[1], object_create(OBJ_STRING, rbuf_create(argv[2], c->argl[2])));
+    reply_status(c, "OK");
+}
+
+static void get_command(Conn *c, int argc, char **argv)
+{
+    (void)argc;
+    int wrongtype;
+    Object *o = db_lookup_typed(c, argv[1], OBJ_STRING, &wrongtype);
+    if (wrongtype)
+        return;
+    if (!o)
+        reply_null(c);
+    else
+        reply_bulk_rbuf(c, o->ptr);
+}
+
+// ========== Bitmap commands ==========
+
+static int parse_ll(const char *s, long long *out)
+{
+    char *end;
+    errno = 0;
+    long long v = strtoll(s, &end, 10);
+    if (errno || *end || end == s)
+        return 0;
+    *out = v;
+    return 1;
+}
+
+// Parses a bit offset argument, replying with an error if it is invalid.
+static int parse_bit_offset(Conn *c, const char *s, uint64_t *offset)
+{
+    long long v;
+    if (!parse_ll(s, &v) || v < 0 || (unsigned long long)v >= STRING_MAX_LEN * 8)
+    {
+        reply_error(c, "ERR bit offset is not an integer or out of range");
+        return 0;
+    }
+    *offset = v;
+    return 1;
+}
+
+// Converts a [start, end] byte range with negative indexes counting from the
+// end into a clamped range. Returns 0 if the range is empty.
+static int byte_range(long long start, long long end, size_t len, size_t *from, size_t *to)
+{
+    if (start < 0)
+        start += len;
+    if (end < 0)
+        end += len;
+    if (start < 0)
+        start = 0;
+    if (end < 0)
+        end = 0;
+    if ((unsigned long long)end >= len)
+        end = (long long)len - 1;
+    if (len == 0 || start > end)
+        return 0;
+    *from = start;
+    *to = end;
+    return 1;
+}
+
+// SETBIT key offset value, replies with the previous bit
+static void setbit_command(Conn *c, int argc, char **argv)
+{
+    (void)argc;
+    uint64_t offset;
+    if (!parse_bit_offset(c, argv[2], &offset))
+        return;
+    if (strcmp(argv[3], "0") != 0 && strcmp(argv[3], "1") != 0)
+    {
+        reply_error(c, "ERR bit is not an integer or out of range");
+        return;
+    }
+
+    int wrongtype;
+    Object *o = db_lookup_typed(c, argv[1], OBJ_STRING, &wrongtype);
+    if (wrongtype)
+        return;
+    if (!o)
+    {
+        o = object_create(OBJ_STRING, rbuf_alloc(0));
+        db_set(argv[1], o);
+    }
+    RBuf *b = string_make_writable(o, offset / 8 + 1);
+    uint8_t *byte = (uint8_t *)&b->data[offset / 8];
+    uint8_t mask = 0x80 >> (offset & 7);
+    int old = (*byte & mask) != 0;
+    if (argv[3][0] == '1')
+        *byte |= mask;
+    else
+        *byte &= ~mask;
+    reply_integer(c, old);
+}
+
+// GETBIT key offset
+static void getbit_command(Conn *c, int argc, char **argv)
+{
+    (void)argc;
+    uint64_t offset;
+    if (!parse_bit_offset(c, argv[2], &offset))
+        return;
+    int wrongtype;
+    Object *o = db_lookup_typed(c, argv[1], OBJ_STRING, &wrongtype);
+    if (wrongtype)
+        return;
+    RBuf *b = o ? o->ptr : NULL;
+    if (!b || offset / 8 >= b->len)
+        reply_integer(c, 0);
+    else
+        reply_integer(c, ((uint8_t)b->data[offset / 8] >> (7 - (offset & 7))) & 1);
+}
+
+// BITCOUNT key [start end], start and end are byte indexes
+static void bitcount_command(Conn *c, int argc, char **argv)
+{
+    long long start = 0, end = -1;
+    if (argc != 2 && argc != 4)
+    {
+        reply_error(c, "ERR syntax error");
+        return;
+    }
+    if (argc == 4 && (!parse_ll(argv[2], &start) || !parse_ll(argv[3], &end)))
+    {
+        reply_error(c, "ERR value is not an integer or out of range");
+        return;
+    }
+    int wrongtype;
+    Object *o = db_lookup_typed(c, argv[1], OBJ_STRING, &wrongtype);
+    if (wrongtype)
+        return;
+    RBuf *b = o ? o->ptr : NULL;
+    size_t from, to;
+    if (!b || !byte_range(start, end, b->len, &from, &to))
+        reply_integer(c, 0);
+    else
+        reply_integer(c, Bitops_count((uint8_t *)b->data + from, to - from + 1));
+}
+
+// BITPOS key bit [start [end]]
+static void bitpos_command(Conn *c, int argc, char **argv)
+{
+    long long start = 0, end = -1;
+    if (argc > 5)
+    {
+        reply_error(c, "ERR syntax error");
+        return;
+    }
+    if (strcmp(argv[2], "0") != 0 && strcmp(argv[2], "1") != 0)
+    {
+        reply_error(c, "ERR The bit argument must be 1 or 0.");
+        return;
+    }
+    int bit = argv[2][0] == '1';
+    if ((argc > 3 && !parse_ll(argv[3], &start)) || (argc > 4 && !parse_ll(argv[4], &end)))
+    {
+        reply_error(c, "ERR value is not an integer or out of range");
+        return;
+    }
+    int wrongtype;
+    Object *o = db_lookup_typed(c, argv[1], OBJ_STRING, &wrongtype);
+    if (wrongtype)
+        return;
+    if (!o)
+    {
+        reply_integer(c, bit ? -1 : 0);
+        return;
+    }
+    RBuf *b = o->ptr;
+    size_t from, to;
+    if (!byte_range(start, end, b->len, &from, &to))
+    {
+        reply_integer(c, -1);
+        return;
+    }
+    long long pos = Bitops_pos((uint8_t *)b->data + from, to - from + 1, bit);
+    if (pos >= 0)
+        reply_integer(c, pos + (long long)from * 8);
+    else if (!bit && argc <= 4)
+        reply_integer(c, (long long)(to + 1) * 8); // the string is padded with zeros on the right
+    else
+        reply_integer(c, -1);
+}
+
+// BITOP AND|OR|XOR|NOT destkey key [key ...], replies with the length of the
+// result. Missing keys and the bytes past the end of shorter strings count
+// as zeros.
+static void bitop_command(Conn *c, int argc, char **argv)
+{
+    int op;
+    if (strcasecmp(argv[1], "and") == 0)
+        op = BITOP_AND;
+    else if (strcasecmp(argv[1], "or") == 0)
+        op = BITOP_OR;
+    else if (strcasecmp(argv[1], "xor") == 0)
+        op = BITOP_XOR;
+    else if (strcasecmp(argv[1], "not") == 0)
+        op = BITOP_NOT;
+    else
+    {
+        reply_error(c, "ERR syntax error");
+        return;
+    }
+    if (op == BITOP_NOT && argc != 4)
+    {
+        reply_error(c, "ERR BITOP NOT must be called with a single source key.");
+        return;
+    }
+
+    int n = argc - 3;
+    RBuf *srcs[MAX_ARGS];
+    const uint8_t *data[MAX_ARGS];
+    size_t lens[MAX_ARGS];
+    size_t maxlen = 0;
+    static const uint8_t empty[1];
+    for (int i = 0; i < n; i++)
+    {
+        int wrongtype;
+        Object *o = db_lookup_typed(c, argv[i + 3], OBJ_STRING, &wrongtype);
+        if (wrongtype)
+            return;
+        srcs[i] = o ? o->ptr : NULL;
+        data[i] = srcs[i] ? (uint8_t *)srcs[i]->data : empty;
+        lens[i] = srcs[i] ? srcs[i]->len : 0;
+        if (lens[i] > maxlen)
+            maxlen = lens[i];
+    }
+
+    if (maxlen == 0)
+    {
+        db_delete(argv[2]);
+        reply_integer(c, 0);
+        return;
+    }
+    // The destination may also be a source: the result goes to a new buffer
+    RBuf *dst = rbuf_alloc(maxlen);
+    Bitops_op(op, (uint8_t *)dst->data, data, lens, n, maxlen);
+    db_set(argv[2], object_create(OBJ_STRING, dst));
+    reply_integer(c, maxlen);
+}
+
+static void del_command(Conn *c, int argc, char **argv)
+{
+    long long deleted = 0;
+    for (int i = 1; i < argc; i++)
+        deleted += db_delete(argv[i]);
+    reply_integer(c, deleted);
+}
+
+// ========== Expiry ==========
+
+// Keys with a time to live have an entry in server.expires holding the unix
+// time in ms at which they expire. An expired key is deleted when a command
+// touches it, and the expire background job sweeps the rest.
+
+static long long db_get_expire(const char *key)
+{
+    DictEntry *de = Dict_find(server.expires, key);
+    return de ? (long long)(intptr_t)de->val : -1;
+}
+
+static void db_set_expire(const char *key, long long when)
+{
+    DictEntry *de = Dict_find(server.expires, key);
+    if (de)
+    {
+        de->val = (void *)(intptr_t)when;
+        return;
+    }
+    char *k = Slab_strdup(key);
+    if (!k)
+        die("Slab_strdup()");
+    Dict_add(server.expires, k, (void *)(intptr_t)when);
+}
+
+// Deletes the key if its time to live is over, as a write would.
+static void expire_if_needed(const char *key, long long now)
+{
+    long long when = db_get_expire(key);
+    if (when < 0 || when > now)
+        return;
+    signal_modified_key(key);
+    db_delete(key);
+    server.stat_expired_keys++;
+}
+
+// EXPIRE key seconds | PEXPIRE key milliseconds
+static void expire_generic(Conn *c, char **argv, long long unit)
+{
+    long long ttl;
+    if (!parse_ll(argv[2], &ttl) || ttl > LLONG_MAX / unit / 2 || ttl < LLONG_MIN / unit / 2)
+    {
+        reply_error(c, "ERR value is not an integer or out of range");
+        return;
+    }
+    if (!Dict_find(server.keys, argv[1]))
+    {
+        reply_integer(c, 0);
+        return;
+    }
+    if (ttl <= 0)
+        db_delete(argv[1]);
+    else
+        db_set_expire(argv[1], mstime() + ttl * unit);
+    reply_integer(c, 1);
+}
+
+static void expire_command(Conn *c, int argc, char **argv)
+{
+    (void)argc;
+    expire_generic(c, argv, 1000);
+}
+
+static void pexpire_command(Conn *c, int argc, char **argv)
+{
+    (void)argc;
+    expire_generic(c, argv, 1);
+}
+
+// TTL key | PTTL key: -2 if the key is missing, -1 if it does not expire
+static void ttl_generic(Conn *c, char **argv, long long unit)
+{
+    if (!Dict_find(server.keys, argv[1]))
+    {
+        reply_integer(c, -2);
+        return;
+    }
+    long long when = db_get_expire(argv[1]);
+    if (when < 0)
+    {
+        reply_integer(c, -1);
+        return;
+    }
+    long long left = when - mstime();
+    reply_integer(c, left > 0 ? (left + unit - 1) / unit : 0);
+}
+
+static void ttl_command(Conn *c, int argc, char **argv)
+{
+    (void)argc;
+    ttl_generic(c, argv, 1000);
+}
+
+static void pttl_command(Conn *c, int argc, char **argv)
+{
+    (void)argc;
+    ttl_generic(c, argv, 1);
+}
+
+static void persist_command(Conn *c, int argc, char **argv)
+{
+    (void)argc;
+    reply_integer(c, Dict_find(server.keys, argv[1]) ? Dict_delete(server.expires, argv[1]) : 0);
+}
+
+// ========== Stream commands ==========
+
+// Parses "ms-seq", or "ms" alone with missing_seq as the sequence number.
+static int parse_stream_id(const char *s, uint64_t missing_seq, StreamID *id)
+{
+    char *end;
+    if (*s < '0' || *s > '9')
+        return 0;
+    errno = 0;
+    id->ms = strtoull(s, &end, 10);
+    if (errno)
+        return 0;
+    if (*end == '\0')
+    {
+        id->seq = missing_seq;
+        return 1;
+    }
+    if (*end != '-' || end[1] < '0' || end[1] > '9')
+        return 0;
+    id->seq = strtoull(end + 1, &end, 10);
+    return !errno && *end == '\0';
+}
+
+// Parses the start (missing_seq 0, "-" for the first ID) or the end
+// (missing_seq UINT64_MAX, "+" for the last ID) of a range.
+static int parse_range_id(const char *s, uint64_t missing_seq, StreamID *id)
+{
+    if (strcmp(s, "-") == 0)
+        *id = (StreamID){0, 0};
+    else if (strcmp(s, "+") == 0)
+        *id = (StreamID){UINT64_MAX, UINT64_MAX};
+    else
+        return parse_stream_id(s, missing_seq, id);
+    return 1;
+}
+
+// The smallest ID greater than id. Returns 0 if there is none.
+static int stream_id_next(StreamID id, StreamID *next)
+{
+    if (id.seq != UINT64_MAX)
+        *next = (StreamID){id.ms, id.seq + 1};
+    else if (id.ms != UINT64_MAX)
+        *next = (StreamID){id.ms + 1, 0};
+    else
+        return 0;
+    return 1;
+}
+
+static int stream_id_format(StreamID id, char *buf, size_t len)
+{
+    return snprintf(buf, len, "%llu-%llu", (unsigned long long)id.ms, (unsigned long long)id.seq);
+}
+
+static void reply_stream_id(Conn *c, StreamID id)
+{
+    char buf[48];
+    reply_bulk(c, buf, stream_id_format(id, buf, sizeof(buf)));
+}
+
+static void reply_stream_entry(Conn *c, const StreamEntry *e)
+{
+    reply_array_len(c, 2);
+    reply_stream_id(c, e->id);
+    reply_array_len(c, e->nfields * 2);
+    const unsigned char *p = e->fields;
+    for (uint32_t i = 0; i < e->nfields * 2; i++)
+    {
+        size_t len;
+        const char *data = Stream_entry_string(&p, &len);
+        reply_bulk(c, data, len);
+    }
+}
+
+// Entries in [start, end], at most count of them (0 for no limit).
+static uint64_t stream_range_count(const Stream *s, StreamID start, StreamID end, uint64_t count)
+{
+    StreamIter it;
+    StreamEntry e;
+    uint64_t n = 0;
+    Stream_iter_init(&it, s, start, end);
+    while ((!count || n < count) && Stream_iter_next(&it, &e))
+        n++;
+    return n;
+}
+
+// Replies with the first n entries from start on, handing each of them to
+// deliver (if not NULL) as well.
+static void reply_stream_range(Conn *c, const Stream *s, StreamID start, uint64_t n,
+                               void (*deliver)(void *privdata, StreamID id), void *privdata)
+{
+    StreamIter it;
+    StreamEntry e;
+    reply_array_len(c, n);
+    Stream_iter_init(&it, s, start, (StreamID){UINT64_MAX, UINT64_MAX});
+    while (n-- && Stream_iter_next(&it, &e))
+    {
+        reply_stream_entry(c, &e);
+        if (deliver)
+            deliver(privdata, e.id);
+    }
+}
+
+static Stream *stream_lookup(Conn *c, const char *key, int *wrongtype)
+{
+    Object *o = db_lookup_typed(c, key, OBJ_STREAM, wrongtype);
+    return o ? o->ptr : NULL;
+}
+
+// XADD key <ID | ms-* | *> field value [field value ...]
+static void xadd_command(Conn *c, int argc, char **argv)
+{
+    if ((argc - 3) % 2)
+    {
+        reply_error(c, "ERR wrong number of arguments");
+        return;
+    }
+    StreamID id = {0, 0};
+    int autoid = strcmp(argv[2], "*") == 0, autoseq = 0;
+    size_t idlen = strlen(argv[2]);
+    char ms[32];
+    if (!autoid && idlen > 2 && idlen - 2 < sizeof(ms) && strcmp(argv[2] + idlen - 2, "-*") == 0)
+    {
+        memcpy(ms, argv[2], idlen - 2);
+        ms[idlen - 2] = '\0';
+        autoseq = 1;
+    }
+    if (!autoid && !parse_stream_id(autoseq ? ms : argv[2], 0, &id))
+    {
+        reply_error(c, "ERR Invalid stream ID specified as stream command argument");
+        return;
+    }
+
+    int wrongtype;
+    Stream *s = stream_lookup(c, argv[1], &wrongtype);
+    if (wrongtype)
+        return;
+    StreamID last = s ? s->last_id : (StreamID){0, 0};
+    if (autoseq && id.ms == last.ms)
+        id.seq = last.seq + (last.seq != UINT64_MAX); // Stays equal to last, so rejected, on overflow
+    if (!autoid && Stream_id_cmp(id, last) <= 0)
+    {
+        reply_error(c, "ERR The ID specified in XADD is equal or smaller than the target stream top item");
+        return;
+    }
+    if (!s)
+    {
+        s = Stream_create();
+        if (!s)
+            die("Stream_create()");
+        db_set(argv[1], object_create(OBJ_STREAM, s));
+    }
+    if (Stream_append(s, &id, autoid, mstime(), argv + 3, (argc - 3) / 2) < 0)
+        die("Stream_append()");
+    reply_stream_id(c, id);
+}
+
+static void xlen_command(Conn *c, int argc, char **argv)
+{
+    (void)argc;
+    int wrongtype;
+    Stream *s = stream_lookup(c, argv[1], &wrongtype);
+    if (!wrongtype)
+        reply_integer(c, s ? (long long)s->length : 0);
+}
+
+// Parses a COUNT argument. Returns 0 after replying with an error.
+static int parse_count(Conn *c, const char *arg, uint64_t *count)
+{
+    long long v;
+    if (!parse_ll(arg, &v) || v < 0)
+    {
+        reply_error(c, "ERR value is not an integer or out of range");
+        return 0;
+    }
+    *count = v;
+    return 1;
+}
+
+// XRANGE key start end [COUNT count]
+static void xrange_command(Conn *c, int argc, char **argv)
+{
+    StreamID start, end;
+    uint64_t count = 0;
+    if (!parse_range_id(argv[2], 0, &start) || !parse_range_id(argv[3], UINT64_MAX, &end))
+    {
+        reply_error(c, "ERR Invalid stream ID specified as stream command argument");
+        return;
+    }
+    if (argc == 6 && strcasecmp(argv[4], "count") == 0)
+    {
+        if (!parse_count(c, argv[5], &count))
+            return;
+        if (count == 0)
+        {
+            reply_array_len(c, 0);
+            return;
+        }
+    }
+    else if (argc != 4)
+    {
+        reply_error(c, "ERR syntax error");
+        return;
+    }
+
+    int wrongtype;
+    Stream *s = stream_lookup(c, argv[1], &wrongtype);
+    if (wrongtype)
+        return;
+    if (!s)
+    {
+        reply_array_len(c, 0);
+        return;
+    }
+    reply_stream_range(c, s, start, stream_range_count(s, start, end, count), NULL, NULL);
+}
+
+// Options shared by XREAD and XREADGROUP, up to the STREAMS keyword.
+typedef struct ReadArgs
+{
+    uint64_t count;
+    long long block_ms; // -1 when not blocking
+    int noack;
+    int streams; // Index of the first key
+    int nkeys;
+} ReadArgs;
+
+// Parses the options of XREAD from argv[first] on (XREADGROUP accepts NOACK
+// too). Returns 0 after replying with an error.
+static int parse_read_args(Conn *c, int argc, char **argv, int first, int group, ReadArgs *ra)
+{
+    *ra = (ReadArgs){.block_ms = -1};
+    int i;
+    for (i = first; i < argc; i++)
+    {
+        if (strcasecmp(argv[i], "streams") == 0)
+            break;
+        if (strcasecmp(argv[i], "count") == 0 && i + 1 < argc)
+        {
+            if (!parse_count(c, argv[++i], &ra->count))
+                return 0;
+        }
+        else if (strcasecmp(argv[i], "block") == 0 && i + 1 < argc)
+        {
+            if (!parse_ll(argv[++i], &ra->block_ms) || ra->block_ms < 0)
+            {
+                reply_error(c, "ERR timeout is not an integer or out of range");
+                return 0;
+            }
+        }
+        else if (group && strcasecmp(argv[i], "noack") == 0)
+        {
+            ra->noack = 1;
+        }
+        else
+        {
+            reply_error(c, "ERR syntax error");
+            return 0;
+        }
+    }
+    ra->streams = i + 1;
+    ra->nkeys = (argc - ra->streams) / 2;
+    if (i == argc || ra->nkeys == 0 || (argc - ra->streams) % 2)
+    {
+        reply_error(c, "ERR Unbalanced stream list: for each stream key an ID must be specified");
+        return 0;
+    }
+    return 1;
+}
+
+// XREAD [COUNT count] [BLOCK ms] STREAMS key [key ...] ID [ID ...]
+//
+// Replies with the entries after each ID, $ standing for the last ID of the
+// stream. With BLOCK and nothing to return, waits for an XADD to any of the
+// keys for up to ms milliseconds (0 waits forever).
+static void xread_command(Conn *c, int argc, char **argv)
+{
+    ReadArgs ra;
+    if (!parse_read_args(c, argc, argv, 1, 0, &ra))
+        return;
+
+    Stream *streams[MAX_ARGS / 2];
+    StreamID after[MAX_ARGS / 2];
+    uint64_t counts[MAX_ARGS / 2];
+    int ready = 0;
+    long long now = mstime();
+    for (int i = 0; i < ra.nkeys; i++)
+    {
+        const char *key = argv[ra.streams + i], *id = argv[ra.streams + ra.nkeys + i];
+        int wrongtype;
+        expire_if_needed(key, now);
+        streams[i] = stream_lookup(c, key, &wrongtype);
+        if (wrongtype)
+            return;
+        if (strcmp(id, "$") == 0)
+            after[i] = streams[i] ? streams[i]->last_id : (StreamID){0, 0};
+        else if (!parse_stream_id(id, 0, &after[i]))
+        {
+            reply_error(c, "ERR Invalid stream ID specified as stream command argument");
+            return;
+        }
+        StreamID start;
+        counts[i] = 0;
+        if (streams[i] && stream_id_next(after[i], &start))
+            counts[i] = stream_range_count(streams[i], start, (StreamID){UINT64_MAX, UINT64_MAX}, ra.count);
+        ready += counts[i] > 0;
+    }
+
+    if (!ready && ra.block_ms >= 0)
+    {
+        // Wait with $ resolved, so entries added meanwhile are returned
+        char *bargv[MAX_ARGS];
+        char ids[MAX_ARGS / 2][48];
+        memcpy(bargv, argv, argc * sizeof(char *));
+        for (int i = 0; i < ra.nkeys; i++)
+        {
+            stream_id_format(after[i], ids[i], sizeof(ids[i]));
+            bargv[ra.streams + ra.nkeys + i] = ids[i];
+        }
+        conn_block(c, xread_command, argc, bargv, ra.streams, ra.nkeys, ra.block_ms);
+        return;
+    }
+    if (!ready)
+    {
+        reply_append(c, "*-1\r\n", 5);
+        return;
+    }
+    reply_array_len(c, ready);
+    for (int i = 0; i < ra.nkeys; i++)
+    {
+        if (!counts[i])
+            continue;
+        StreamID start;
+        stream_id_next(after[i], &start);
+        reply_array_len(c, 2);
+        reply_bulk(c, argv[ra.streams + i], strlen(argv[ra.streams + i]));
+        reply_stream_range(c, streams[i], start, counts[i], NULL, NULL);
+    }
+}
+
+// XGROUP CREATE key group <ID | $> [MKSTREAM] | XGROUP DESTROY key group
+static void xgroup_command(Conn *c, int argc, char **argv)
+{
+    int create = strcasecmp(argv[1], "create") == 0;
+    int mkstream = create && argc == 6 && strcasecmp(argv[5], "mkstream") == 0;
+    if (!(create && (argc == 5 || mkstream)) && !(strcasecmp(argv[1], "destroy") == 0 && argc == 4))
+    {
+        reply_error(c, "ERR syntax error");
+        return;
+    }
+    int wrongtype;
+    Stream *s = stream_lookup(c, argv[2], &wrongtype);
+    if (wrongtype)
+        return;
+    if (!create)
+    {
+        reply_integer(c, s ? Stream_group_destroy(s, argv[3]) : 0);
+        return;
+    }
+
+    StreamID id;
+    if (strcmp(argv[4], "$") == 0)
+        id = s ? s->last_id : (StreamID){0, 0};
+    else if (!parse_stream_id(argv[4], 0, &id))
+    {
+        reply_error(c, "ERR Invalid stream ID specified as stream command argument");
+        return;
+    }
+    if (!s && !mkstream)
+    {
+        reply_error(c, "ERR The XGROUP subcommand requires the key to exist");
+        return;
+    }
+    if (s && Stream_group_find(s, argv[3]))
+    {
+        reply_error(c, "BUSYGROUP Consumer Group name already exists");
+        return;
+    }
+    if (!s)
+    {
+        s = Stream_create();
+        if (!s)
+            die("Stream_create()");
+        db_set(argv[2], object_create(OBJ_STREAM, s));
+    }
+    if (!Stream_group_create(s, argv[3], id))
+        die("Stream_group_create()");
+    reply_status(c, "OK");
+}
+
+typedef struct GroupDelivery
+{
+    StreamGroup *group;
+    int consumer;
+    int noack;
+    uint64_t now;
+} GroupDelivery;
+
+static void group_deliver(void *privdata, StreamID id)
+{
+    GroupDelivery *gd = privdata;
+    gd->group->last_delivered = id;
+    if (!gd->noack && !Stream_pending_add(gd->group, id, gd->consumer, gd->now))
+        die("Stream_pending_add()");
+}
+
+// Replies with the pending entries of a consumer after id, at most count.
+static void reply_stream_history(Conn *c, const Stream *s, const StreamGroup *g, int consumer, StreamID after,
+                                 uint64_t count)
+{
+    uint64_t first = 0, n = 0;
+    while (first < g->npending && Stream_id_cmp(g->pending[first].id, after) <= 0)
+        first++;
+    for (uint64_t i = first; i < g->npending && (!count || n < count); i++)
+        n += g->pending[i].consumer == (uint32_t)consumer;
+
+    reply_array_len(c, n);
+    for (uint64_t i = first; n; i++)
+    {
+        if (g->pending[i].consumer != (uint32_t)consumer)
+            continue;
+        StreamIter it;
+        StreamEntry e;
+        Stream_iter_init(&it, s, g->pending[i].id, g->pending[i].id);
+        if (Stream_iter_next(&it, &e))
+            reply_stream_entry(c, &e);
+        else
+            reply_null(c);
+        n--;
+    }
+}
+
+// XREADGROUP GROUP group consumer [COUNT count] [BLOCK ms] [NOACK]
+//            STREAMS key [key ...] ID [ID ...]
+//
+// With ID >, delivers the entries the group has not delivered yet to the
+// consumer and adds them to the pending list (unless NOACK), blocking like
+// XREAD if there are none. Any other ID returns the entries pending for the
+// consumer after it.
+static void xreadgroup_command(Conn *c, int argc, char **argv)
+{
+    ReadArgs ra;
+    if (strcasecmp(argv[1], "group") != 0)
+    {
+        reply_error(c, "ERR syntax error");
+        return;
+    }
+    if (!parse_read_args(c, argc, argv, 4, 1, &ra))
+        return;
+
+    Stream *streams[MAX_ARGS / 2];
+    StreamGroup *groups[MAX_ARGS / 2];
+    StreamID after[MAX_ARGS / 2];
+    uint64_t counts[MAX_ARGS / 2];
+    int ready = 0, history = 0;
+    long long now = mstime();
+    for (int i = 0; i < ra.nkeys; i++)
+    {
+        const char *key = argv[ra.streams + i], *id = argv[ra.streams + ra.nkeys + i];
+        int wrongtype;
+        expire_if_needed(key, now);
+        streams[i] = stream_lookup(c, key, &wrongtype);
+        if (wrongtype)
+            return;
+        groups[i] = streams[i] ? Stream_group_find(streams[i], argv[2]) : NULL;
+        if (!groups[i])
+        {
+            char err[256];
+            snprintf(err, sizeof(err), "NOGROUP No such key '%.100s' or consumer group '%.100s'", key, argv[2]);
+            reply_error(c, err);
+            return;
+        }
+        if (strcmp(id, ">") == 0)
+        {
+            StreamID start;
+            counts[i] = 0;
+            if (stream_id_next(groups[i]->last_delivered, &start))
+                counts[i] = stream_range_count(streams[i], start, (StreamID){UINT64_MAX, UINT64_MAX}, ra.count);
+            ready += counts[i] > 0;
+            after[i] = groups[i]->last_delivered;
+        }
+        else if (parse_stream_id(id, 0, &after[i]))
+        {
+            history++;
+        }
+        else
+        {
+            reply_error(c, "ERR Invalid stream ID specified as stream command argument");
+            return;
+        }
+    }
+
+    if (!ready && !history && ra.block_ms >= 0)
+    {
+        conn_block(c, xreadgroup_command, argc, argv, ra.streams, ra.nkeys, ra.block_ms);
+        return;
+    }
+    if (!ready && !history)
+    {
+        reply_append(c, "*-1\r\n", 5);
+        return;
+    }
+
+    reply_array_len(c, ready + history);
+    for (int i = 0; i < ra.nkeys; i++)
+    {
+        const char *key = argv[ra.streams + i];
+        int consumer = Stream_consumer_get(groups[i], argv[3]);
+        if (consumer < 0)
+            die("Stream_consumer_get()");
+        groups[i]->consumers[consumer].seen_ms = now;
+        if (strcmp(argv[ra.streams + ra.nkeys + i], ">") != 0)
+        {
+            reply_array_len(c, 2);
+            reply_bulk(c, key, strlen(key));
+            reply_stream_history(c, streams[i], groups[i], consumer, after[i], ra.count);
+        }
+        else if (counts[i])
+        {
+            StreamID start;
+            stream_id_next(after[i], &start);
+            GroupDelivery gd = {groups[i], consumer, ra.noack, now};
+            reply_array_len(c, 2);
+            reply_bulk(c, key, strlen(key));
+            reply_stream_range(c, streams[i], start, counts[i], group_deliver, &gd);
+        }
+    }
+}
+
+// XACK key group ID [ID ...]
+static void xack_command(Conn *c, int argc, char **argv)
+{
+    StreamID ids[MAX_ARGS];
+    for (int i = 3; i < argc; i++)
+    {
+        if (!parse_stream_id(argv[i], 0, &ids[i]))
+        {
+            reply_error(c, "ERR Invalid stream ID specified as stream command argument");
+            return;
+        }
+    }
+    int wrongtype;
+    Stream *s = stream_lookup(c, argv[1], &wrongtype);
+    if (wrongtype)
+        return;
+    StreamGroup *g = s ? Stream_group_find(s, argv[2]) : NULL;
+    long long acked = 0;
+    for (int i = 3; g && i < argc; i++)
+        acked += Stream_ack(g, ids[i]);
+    reply_integer(c, acked);
+}
+
+// XPENDING key group: the number of pending entries, the smallest and the
+// greatest pending ID, and the number pending per consumer.
+static void xpending_command(Conn *c, int argc, char **argv)
+{
+    (void)argc;
+    int wrongtype;
+    Stream *s = stream_lookup(c, argv[1], &wrongtype);
+    if (wrongtype)
+        return;
+    StreamGroup *g = s ? Stream_group_find(s, argv[2]) : NULL;
+    if (!g)
+    {
+        char err[256];
+        snprintf(err, sizeof(err), "NOGROUP No such key '%.100s' or consumer group '%.100s'", argv[1], argv[2]);
+        reply_error(c, err);
+        return;
+    }
+    reply_array_len(c, 4);
+    reply_integer(c, g->npending);
+    if (!g->npending)
+    {
+        reply_null(c);
+        reply_null(c);
+        reply_append(c, "*-1\r\n", 5);
+        return;
+    }
+    reply_stream_id(c, g->pending[0].id);
+    reply_stream_id(c, g->pending[g->npending - 1].id);
+    uint32_t n = 0;
+    for (uint32_t i = 0; i < g->nconsumers; i++)
+        n += g->consumers[i].pending > 0;
+    reply_array_len(c, n);
+    for (uint32_t i = 0; i < g->nconsumers; i++)
+    {
+        if (!g->consumers[i].pending)
+            continue;
+        char buf[32];
+        reply_array_len(c, 2);
+        reply_bulk(c, g->consumers[i].name, strlen(g->consumers[i].name));
+        reply_bulk(c, buf, snprintf(buf, sizeof(buf), "%llu", (unsigned long long)g->consumers[i].pending));
+    }
+}
+
+// ========== Hash commands ==========
+
+// Returns the hash at key, creating it if missing, or NULL after replying
+// WRONGTYPE.
+static Hash *hash_lookup_create(Conn *c, const char *key)
+{
+    int wrongtype;
+    Object *o = db_lookup_typed(c, key, OBJ_HASH, &wrongtype);
+    if (wrongtype)
+        return NULL;
+    if (o)
+        return o->ptr;
+    Hash *h = Hash_create();
+    if (!h)
+        die("Hash_create()");
+    db_set(key, object_create(OBJ_HASH, h));
+    return h;
+}
+
+static int hash_set(Hash *h, const char *field, const char *value)
+{
+    int rv = Hash_set(h, field, value, server.hash_max_packed_entries, server.hash_max_packed_value);
+    if (rv < 0)
+        die("Hash_set()");
+    return rv;
+}
+
+// HSET key field value [field value ...]
+static void hset_command(Conn *c, int argc, char **argv)
+{
+    if (argc % 2)
+    {
+        reply_error(c, "ERR wrong number of arguments for 'hset' command");
+        return;
+    }
+    Hash *h = hash_lookup_create(c, argv[1]);
+    if (!h)
+        return;
+    long long added = 0;
+    for (int i = 2; i < argc; i += 2)
+        added += hash_set(h, argv[i], argv[i + 1]);
+    reply_integer(c, added);
+}
+
+static void hget_command(Conn *c, int argc, char **argv)
+{
+    (void)argc;
+    int wrongtype;
+    Object *o = db_lookup_typed(c, argv[1], OBJ_HASH, &wrongtype);
+    if (wrongtype)
+        return;
+    size_t len;
+    const char *value = o ? Hash_get(o->ptr, argv[2], &len) : NULL;
+    if (value)
+        reply_bulk(c, value, len);
+    else
+        reply_null(c);
+}
+
+// HDEL key field [field ...]
+static void hdel_command(Conn *c, int argc, char **argv)
+{
+    int wrongtype;
+    Object *o = db_lookup_typed(c, argv[1], OBJ_HASH, &wrongtype);
+    if (wrongtype)
+        return;
+    long long deleted = 0;
+    for (int i = 2; o && i < argc; i++)
+        deleted += Hash_delete(o->ptr, argv[i]);
+    if (o && Hash_size(o->ptr) == 0)
+        db_delete(argv[1]);
+    reply_integer(c, deleted);
+}
+
+static void hgetall_command(Conn *c, int argc, char **argv)
+{
+    (void)argc;
+    int wrongtype;
+    Object *o = db_lookup_typed(c, argv[1], OBJ_HASH, &wrongtype);
+    if (wrongtype)
+        return;
+    if (!o)
+    {
+        reply_array_len(c, 0);
+        return;
+    }
+    reply_array_len(c, Hash_size(o->ptr) * 2);
+    HashIter it;
+    const char *field, *value;
+    size_t flen, vlen;
+    Hash_iter_init(&it, o->ptr);
+    while (Hash_next(&it, &field, &flen, &value, &vlen))
+    {
+        reply_bulk(c, field, flen);
+        reply_bulk(c, value, vlen);
+    }
+    Hash_iter_release(&it);
+}
+
+// HINCRBY key field increment
+static void hincrby_command(Conn *c, int argc, char **argv)
+{
+    (void)argc;
+    long long incr, v = 0;
+    if (!parse_ll(argv[3], &incr))
+    {
+        reply_error(c, "ERR value is not an integer or out of range");
+        return;
+    }
+    Hash *h = hash_lookup_create(c, argv[1]);
+    if (!h)
+        return;
+    size_t len;
+    const char *value = Hash_get(h, argv[2], &len);
+    char buf[32];
+    if (value)
+    {
+        // Packed values are not NUL-terminated
+        if (len < sizeof(buf))
+        {
+            memcpy(buf, value, len);
+            buf[len] = '\0';
+        }
+        if (len >= sizeof(buf) || !parse_ll(buf, &v))
+        {
+            reply_error(c, "ERR hash value is not an integer");
+            return;
+        }
+    }
+    if ((incr > 0 && v > LLONG_MAX - incr) || (incr < 0 && v < LLONG_MIN - incr))
+    {
+        reply_error(c, "ERR increment or decrement would overflow");
+        return;
+    }
+    snprintf(buf, sizeof(buf), "%lld", v + incr);
+    hash_set(h, argv[2], buf);
+    reply_integer(c, v + incr);
+}
+
+// ========== Bloom and cuckoo filter commands ==========
+
+#define BLOOM_DEFAULT_ERROR_RATE 0.01
+#define BLOOM_DEFAULT_CAPACITY 100
+#define CUCKOO_DEFAULT_CAPACITY 1024
+
+// Every filter operation hashes the item once; the filters derive all their
+// probe positions from this hash.
+static uint64_t filter_hash(const char *item)
+{
+    return MurmurHash64A(item, strlen(item), 0);
+}
+
+// BF.RESERVE key error_rate capacity
+static void bf_reserve_command(Conn *c, int argc, char **argv)
+{
+    (void)argc;
+    if (Dict_find(server.keys, argv[1]))
+    {
+        reply_error(c, "ERR item exists");
+        return;
+    }
+    double error_rate = strtod(argv[2], NULL);
+    long long capacity = atoll(argv[3]);
+    Bloom *b = capacity > 0 ? Bloom_create(capacity, error_rate) : NULL;
+    if (!b)
+    {
+        reply_error(c, "ERR invalid error rate or capacity");
+        return;
+    }
+    db_set(argv[1], object_create(OBJ_BLOOM, b));
+    reply_status(c, "OK");
+}
+
+// BF.ADD key item, creates the filter with default parameters if missing
+static void bf_add_command(Conn *c, int argc, char **argv)
+{
+    (void)argc;
+    int wrongtype;
+    Object *o = db_lookup_typed(c, argv[1], OBJ_BLOOM, &wrongtype);
+    if (wrongtype)
+        return;
+    if (!o)
+    {
+        Bloom *b = Bloom_create(BLOOM_DEFAULT_CAPACITY, BLOOM_DEFAULT_ERROR_RATE);
+        if (!b)
+            die("Bloom_create()");
+        o = object_create(OBJ_BLOOM, b);
+        db_set(argv[1], o);
+    }
+    int rv = Bloom_add(o->ptr, filter_hash(argv[2]));
+    if (rv < 0)
+        reply_error(c, "ERR filter cannot grow");
+    else
+        reply_integer(c, rv);
+}
+
+// BF.EXISTS key item
+static void bf_exists_command(Conn *c, int argc, char **argv)
+{
+    (void)argc;
+    int wrongtype;
+    Object *o = db_lookup_typed(c, argv[1], OBJ_BLOOM, &wrongtype);
+    if (wrongtype)
+        return;
+    reply_integer(c, o ? Bloom_exists(o->ptr, filter_hash(argv[2])) : 0);
+}
+
+// CF.RESERVE key capacity
+static void cf_reserve_command(Conn *c, int argc, char **argv)
+{
+    (void)argc;
+    if (Dict_find(server.keys, argv[1]))
+    {
+        reply_error(c, "ERR item exists");
+        return;
+    }
+    long long capacity = atoll(argv[2]);
+    Cuckoo *cf = capacity > 0 ? Cuckoo_create(capacity) : NULL;
+    if (!cf)
+    {
+        reply_error(c, "ERR invalid capacity");
+        return;
+    }
+    db_set(argv[1], object_create(OBJ_CUCKOO, cf));
+    reply_status(c, "OK");
+}
+
+// CF.ADD key item, creates the filter with the default capacity if missing
+static void cf_add_command(Conn *c, int argc, char **argv)
+{
+    (void)argc;
+    int wrongtype;
+    Object *o = db_lookup_typed(c, argv[1], OBJ_CUCKOO, &wrongtype);
+    if (wrongtype)
+        return;
+    if (!o)
+    {
+        Cuckoo *cf = Cuckoo_create(CUCKOO_DEFAULT_CAPACITY);
+        if (!cf)
+            die("Cuckoo_create()");
+        o = object_create(OBJ_CUCKOO, cf);
+        db_set(argv[1], o);
+    }
+    if (Cuckoo_add(o->ptr, filter_hash(argv[2])) < 0)
+        reply_error(c, "ERR filter cannot grow");
+    else
+        reply_integer(c, 1);
+}
+
+// CF.DEL key item
+static void cf_del_command(Conn *c, int argc, char **argv)
+{
+    (void)argc;
+    int wrongtype;
+    Object *o = db_lookup_typed(c, argv[1], OBJ_CUCKOO, &wrongtype);
+    if (wrongtype)
+        return;
+    reply_integer(c, o ? Cuckoo_delete(o->ptr, filter_hash(argv[2])) : 0);
+}
+
+// CF.EXISTS key item
+static void cf_exists_command(Conn *c, int argc, char **argv)
+{
+    (void)argc;
+    int wrongtype;
+    Object *o = db_lookup_typed(c, argv[1], OBJ_CUCKOO, &wrongtype);
+    if (wrongtype)
+        return;
+    reply_integer(c, o ? Cuckoo_exists(o->ptr, filter_hash(argv[2])) : 0);
+}
+
+// ========== Count-Min sketch and Top-K commands ==========
+
+#define TOPK_DEFAULT_DEPTH 7
+#define TOPK_DEFAULT_DECAY 0.9
+
+static int parse_u32(const char *s, uint32_t *out)
+{
+    char *end;
+    errno = 0;
+    unsigned long long v = strtoull(s, &end, 10);
+    if (errno || *end || end == s || v > UINT32_MAX || s[0] == '-')
+        return 0;
+    *out = (uint32_t)v;
+    return 1;
+}
+
+static void sketch_create_reply(Conn *c, const char *key, int type, void *sketch)
+{
+    if (!sketch)
+    {
+        reply_error(c, "ERR invalid sketch parameters");
+        return;
+    }
+    db_set(key, object_create(type, sketch));
+    reply_status(c, "OK");
+}
+
+// CMS.INITBYDIM key width depth
+static void cms_initbydim_command(Conn *c, int argc, char **argv)
+{
+    (void)argc;
+    uint32_t width, depth;
+    if (Dict_find(server.keys, argv[1]))
+    {
+        reply_error(c, "ERR key already exists");
+        return;
+    }
+    int ok = parse_u32(argv[2], &width) && parse_u32(argv[3], &depth);
+    sketch_create_reply(c, argv[1], OBJ_CMS, ok ? CountMin_create(width, depth) : NULL);
+}
+
+// CMS.INITBYPROB key error probability
+static void cms_initbyprob_command(Conn *c, int argc, char **argv)
+{
+    (void)argc;
+    if (Dict_find(server.keys, argv[1]))
+    {
+        reply_error(c, "ERR key already exists");
+        return;
+    }
+    sketch_create_reply(c, argv[1], OBJ_CMS, CountMin_create_by_prob(strtod(argv[2], NULL), strtod(argv[3], NULL)));
+}
+
+static CountMin *cms_lookup(Conn *c, const char *key)
+{
+    int wrongtype;
+    Object *o = db_lookup_typed(c, key, OBJ_CMS, &wrongtype);
+    if (wrongtype)
+        return NULL;
+    if (!o)
+    {
+        reply_error(c, "ERR CMS: key does not exist");
+        return NULL;
+    }
+    return o->ptr;
+}
+
+// CMS.INCRBY key item increment [item increment ...]
+static void cms_incrby_command(Conn *c, int argc, char **argv)
+{
+    if (argc % 2)
+    {
+        reply_error(c, "ERR wrong number of arguments");
+        return;
+    }
+    CountMin *cms = cms_lookup(c, argv[1]);
+    if (!cms)
+        return;
+    uint32_t incr[MAX_ARGS / 2];
+    for (int i = 3; i < argc; i += 2)
+    {
+        if (!parse_u32(argv[i], &incr[i / 2 - 1]))
+        {
+            reply_error(c, "ERR CMS: invalid increment");
+            return;
+        }
+    }
+    reply_array_len(c, argc / 2 - 1);
+    for (int i = 2; i < argc; i += 2)
+        reply_integer(c, CountMin_incrby(cms, filter_hash(argv[i]), incr[i / 2 - 1]));
+}
+
+// CMS.QUERY key item [item ...]
+static void cms_query_command(Conn *c, int argc, char **argv)
+{
+    CountMin *cms = cms_lookup(c, argv[1]);
+    if (!cms)
+        return;
+    reply_array_len(c, argc - 2);
+    for (int i = 2; i < argc; i++)
+        reply_integer(c, CountMin_query(cms, filter_hash(argv[i])));
+}
+
+// TOPK.RESERVE key k [width depth decay]
+static void topk_reserve_command(Conn *c, int argc, char **argv)
+{
+    uint32_t k, width, depth = TOPK_DEFAULT_DEPTH;
+    double decay = TOPK_DEFAULT_DECAY;
+    if (argc != 3 && argc != 6)
+    {
+        reply_error(c, "ERR wrong number of arguments");
+        return;
+    }
+    if (Dict_find(server.keys, argv[1]))
+    {
+        reply_error(c, "ERR key already exists");
+        return;
+    }
+    int ok = parse_u32(argv[2], &k);
+    width = ok && k <= UINT32_MAX / 8 ? k * 8 : 0;
+    if (argc == 6)
+    {
+        ok = ok && parse_u32(argv[3], &width) && parse_u32(argv[4], &depth);
+        decay = strtod(argv[5], NULL);
+    }
+    sketch_create_reply(c, argv[1], OBJ_TOPK, ok ? TopK_create(k, width, depth, decay) : NULL);
+}
+
+static TopK *topk_lookup(Conn *c, const char *key)
+{
+    int wrongtype;
+    Object *o = db_lookup_typed(c, key, OBJ_TOPK, &wrongtype);
+    if (wrongtype)
+        return NULL;
+    if (!o)
+    {
+        reply_error(c, "ERR TOPK: key does not exist");
+        return NULL;
+    }
+    return o->ptr;
+}
+
+// TOPK.ADD key item [item ...], replies with the item expelled from the list
+// by each addition (or nil)
+static void topk_add_command(Conn *c, int argc, char **argv)
+{
+    TopK *tk = topk_lookup(c, argv[1]);
+    if (!tk)
+        return;
+    reply_array_len(c, argc - 2);
+    for (int i = 2; i < argc; i++)
+    {
+        char *expelled = TopK_add(tk, argv[i], filter_hash(argv[i]), 1);
+        if (expelled)
+            reply_bulk(c, expelled, strlen(expelled));
+        else
+            reply_null(c);
+        free(expelled);
+    }
+}
+
+// TOPK.QUERY key item [item ...]
+static void topk_query_command(Conn *c, int argc, char **argv)
+{
+    TopK *tk = topk_lookup(c, argv[1]);
+    if (!tk)
+        return;
+    reply_array_len(c, argc - 2);
+    for (int i = 2; i < argc; i++)
+        reply_integer(c, TopK_query(tk, argv[i], filter_hash(argv[i])));
+}
+
+// TOPK.LIST key [WITHCOUNT]
+static void topk_list_command(Conn *c, int argc, char **argv)
+{
+    TopK *tk = topk_lookup(c, argv[1]);
+    if (!tk)
+        return;
+    int withcount = argc > 2 && strcasecmp(argv[2], "withcount") == 0;
+    TopKEntry *entries = malloc(tk->k * sizeof(TopKEntry));
+    if (!entries)
+        die("malloc()");
+    uint32_t n = TopK_list(tk, entries);
+    reply_array_len(c, withcount ? 2 * n : n);
+    for (uint32_t i = 0; i < n; i++)
+    {
+        reply_bulk(c, entries[i].item, strlen(entries[i].item));
+        if (withcount)
+            reply_integer(c, entries[i].count);
+    }
+    free(entries);
+}
+
+static void hist_info_line(TextBuf *t, const char *prefix, const char *name, const LatencyHist *h)
+{
+    text_printf(t, "%s%s:calls=%llu,usec=%llu,usec_per_call=%.2f,max_usec=%.2f,"
+                   "p50=%.3f,p99=%.3f,p99.9=%.3f\r\n",
+                prefix, name,
+                (unsigned long long)h->calls,
+                (unsigned long long)(h->total_ns / 1000),
+                h->calls ? (double)h->total_ns / h->calls / 1000.0 : 0.0,
+                h->max_ns / 1000.0,
+                hist_percentile(h, 50.0) / 1000.0,
+                hist_percentile(h, 99.0) / 1000.0,
+                hist_percentile(h, 99.9) / 1000.0);
+}
+
+// Resident set size from /proc, 0 if unavailable.
+static size_t process_rss(void)
+{
+    FILE *f = fopen("/proc/self/statm", "r");
+    if (!f)
+        return 0;
+    unsigned long size, resident = 0;
+    if (fscanf(f, "%lu %lu", &size, &resident) != 2)
+        resident = 0;
+    fclose(f);
+    return resident * sysconf(_SC_PAGESIZE);
+}
+
+static void jobs_info(TextBuf *t);
+
+// INFO [section]: server, memory, stats, jobs, commandstats and latencystats. Times
+// are wall-clock durations of the command body; the server is single threaded
+// and commands never block, so they are a close proxy for CPU time.
+static void info_command(Conn *c, int argc, char **argv)
+{
+    const char *section = argc > 1 ? argv[1] : "all";
+    int all = strcasecmp(section, "all") == 0 || strcasecmp(section, "everything") == 0;
+    TextBuf t = {0};
+
+    if (all || strcasecmp(section, "server") == 0)
+    {
+        text_printf(&t, "# Server\r\n");
+        text_printf(&t, "process_id:%d\r\n", (int)getpid());
+        text_printf(&t, "uptime_in_seconds:%lld\r\n", (long long)(time(NULL) - server.start_time));
+        for (int i = 0; i < listeners_num; i++)
+            text_printf(&t, "listener%d:name=%s,family=%s\r\n", i, listeners[i].name,
+                        listeners[i].family == AF_UNIX ? "unix" : "inet");
+        text_printf(&t, "bitops_impl:%s\r\n", Bitops_impl());
+        text_printf(&t, "io_threads:%d\r\n", server.io_threads_num);
+        text_printf(&t, "\r\n");
+    }
+    if (all || strcasecmp(section, "memory") == 0)
+    {
+        SlabStats st;
+        Slab_get_stats(&st);
+        size_t rss = process_rss();
+        text_printf(&t, "# Memory\r\n");
+        text_printf(&t, "used_memory:%zu\r\n", st.used);
+        text_printf(&t, "used_memory_rss:%zu\r\n", rss);
+        text_printf(&t, "allocator_active:%zu\r\n", st.active);
+        text_printf(&t, "allocator_slabs:%zu\r\n", st.slabs);
+        text_printf(&t, "allocator_frag_ratio:%.2f\r\n", st.used ? (double)st.active / st.used : 1.0);
+        text_printf(&t, "mem_fragmentation_ratio:%.2f\r\n", st.used ? (double)rss / st.used : 1.0);
+        text_printf(&t, "active_defrag_running:%d\r\n", server.defrag_running);
+        text_printf(&t, "active_defrag_hits:%llu\r\n", (unsigned long long)server.stat_defrag_hits);
+        text_printf(&t, "active_defrag_misses:%llu\r\n", (unsigned long long)server.stat_defrag_misses);
+        text_printf(&t, "lazyfree_pending_objects:%zu\r\n", server.lazyfree_num - server.lazyfree_head);
+        text_printf(&t, "lazyfree_pending_bytes:%zu\r\n", server.lazyfree_bytes);
+        text_printf(&t, "lazyfreed_objects:%llu\r\n", (unsigned long long)server.stat_lazyfreed);
+        text_printf(&t, "\r\n");
+    }
+    if (all || strcasecmp(section, "stats") == 0)
+    {
+        text_printf(&t, "# Stats\r\n");
+        text_printf(&t, "total_connections_received:%llu\r\n", (unsigned long long)server.stat_numconnections);
+        text_printf(&t, "total_commands_processed:%llu\r\n", (unsigned long long)server.stat_numcommands);
+        text_printf(&t, "keys:%zu\r\n", Dict_size(server.keys));
+        text_printf(&t, "expires:%zu\r\n", Dict_size(server.expires));
+        text_printf(&t, "expired_keys:%llu\r\n", (unsigned long long)server.stat_expired_keys);
+        text_printf(&t, "blocked_clients:%d\r\n", server.blocked_clients);
+        text_printf(&t, "tracking_clients:%d\r\n", server.tracking_clients);
+        text_printf(&t, "tracking_total_keys:%zu\r\n", Dict_size(server.tracking_table));
+        text_printf(&t, "tracking_invalidations:%llu\r\n", (unsigned long long)server.stat_tracking_invalidations);
+        text_printf(&t, "client_output_buffer_limit_disconnections:%llu\r\n",
+                    (unsigned long long)server.stat_output_limit_disconnections);
+        text_printf(&t, "\r\n");
+    }
+    if (all || strcasecmp(section, "jobs") == 0)
+    {
+        text_printf(&t, "# Jobs\r\n");
+        jobs_info(&t);
+        text_printf(&t, "\r\n");
+    }
+    if (all || strcasecmp(section, "commandstats") == 0)
+    {
+        text_printf(&t, "# Commandstats\r\n");
+        for (int i = 0; i < COMMAND_NUM; i++)
+            if (command_table[i].stats.calls)
+                hist_info_line(&t, "cmdstat_", command_table[i].name, &command_table[i].stats);
+        text_printf(&t, "\r\n");
+    }
+    if (all || strcasecmp(section, "latencystats") == 0)
+    {
+        text_printf(&t, "# Latencystats\r\n");
+        for (int i = 0; i < latency_events_num; i++)
+            hist_info_line(&t, "", latency_events[i].name, &latency_events[i].hist);
+        text_printf(&t, "\r\n");
+    }
+    reply_text(c, &t);
+}
+
+static void hist_dump(TextBuf *t, const char *name, const LatencyHist *h)
+{
+    text_printf(t, "%s calls=%llu\n", name, (unsigned long long)h->calls);
+    for (int i = 0; i < LAT_BUCKETS; i++)
+        if (h->buckets[i])
+            text_printf(t, "  <%lluns %llu\n",
+                        i ? (unsigned long long)(1ULL << (i < 64 ? i : 63)) : 1ULL,
+                        (unsigned long long)h->buckets[i]);
+}
+
+// LATENCY LATEST | HISTOGRAM [name ...] | RESET
+//
+// LATEST lists the most recent and the maximum sample of each event, HISTOGRAM
+// dumps the non-empty buckets of commands and events (all of them, or the
+// given names), RESET clears every counter.
+static void latency_command(Conn *c, int argc, char **argv)
+{
+    TextBuf t = {0};
+
+    if (strcasecmp(argv[1], "latest") == 0)
+    {
+        for (int i = 0; i < latency_events_num; i++)
+        {
+            LatencyEvent *ev = &latency_events[i];
+            text_printf(&t, "%s %lld %.2f %.2f\n", ev->name, (long long)ev->last_time,
+                        ev->last_ns / 1000.0, ev->hist.max_ns / 1000.0);
+        }
+    }
+    else if (strcasecmp(argv[1], "histogram") == 0)
+    {
+        for (int i = 0; i < COMMAND_NUM; i++)
+        {
+            Command *cmd = &command_table[i];
+            int wanted = argc == 2 ? cmd->stats.calls != 0 : 0;
+            for (int j = 2; j < argc; j++)
+                wanted |= strcasecmp(argv[j], cmd->name) == 0;
+            if (wanted)
+                hist_dump(&t, cmd->name, &cmd->stats);
+        }
+        for (int i = 0; i < latency_events_num; i++)
+        {
+            LatencyEvent *ev = &latency_events[i];
+            int wanted = argc == 2;
+            for (int j = 2; j < argc; j++)
+                wanted |= strcasecmp(argv[j], ev->name) == 0;
+            if (wanted)
+                hist_dump(&t, ev->name, &ev->hist);
+        }
+    }
+    else if (strcasecmp(argv[1], "reset") == 0)
+    {
+        for (int i = 0; i < COMMAND_NUM; i++)
+            memset(&command_table[i].stats, 0, sizeof(LatencyHist));
+        memset(latency_events, 0, sizeof(latency_events));
+        latency_events_num = 0;
+        reply_status(c, "OK");
+        return;
+    }
+    else
+    {
+        reply_error(c, "ERR unknown LATENCY subcommand");
+        return;
+    }
+    reply_text(c, &t);
+}
+
+// ========== Slow log ==========
+
+static void slowlog_entry_free(SlowlogEntry *e)
+{
+    for (int i = 0; i < e->argc; i++)
+        free(e->argv[i]);
+    free(e->argv);
+    e->argv = NULL;
+    e->argc = 0;
+}
+
+static void slowlog_reset(void)
+{
+    // Entries sit wherever slowlog_next_id put them, not at the front
+    for (uint64_t i = 0; i < server.slowlog_cap; i++)
+        if (server.slowlog[i].argv)
+            slowlog_entry_free(&server.slowlog[i]);
+    server.slowlog_len = 0;
+}
+
+// (Re)allocates the ring buffer after slowlog-max-len or the threshold changed.
+// Resizing drops the logged entries.
+static void slowlog_init(void)
+{
+    slowlog_reset();
+    free(server.slowlog);
+    server.slowlog_cap = server.slowlog_max_len ? server.slowlog_max_len : 1;
+    server.slowlog = calloc(server.slowlog_cap, sizeof(SlowlogEntry));
+    if (!server.slowlog)
+        die("calloc()");
+    server.slowlog_threshold_ns = server.slowlog_log_slower_than < 0
+                                      ? UINT64_MAX
+                                      : (uint64_t)server.slowlog_log_slower_than * 1000;
+}
+
+// Only called for commands over the threshold: fast commands pay nothing but
+// the comparison in process_command().
+static void slowlog_push(Conn *c, int argc, char **argv, uint64_t duration_ns)
+{
+    if (server.slowlog_max_len == 0)
+        return;
+
+    SlowlogEntry *e = &server.slowlog[server.slowlog_next_id % server.slowlog_max_len];
+    if (e->argv)
+        slowlog_entry_free(e);
+    else
+        server.slowlog_len++;
+
+    e->id = server.slowlog_next_id++;
+    e->time = time(NULL);
+    e->duration_us = duration_ns / 1000;
+    snprintf(e->addr, sizeof(e->addr), "%s", c->addr);
+    e->orig_argc = argc;
+    e->argc = argc < SLOWLOG_ENTRY_MAX_ARGC ? argc : SLOWLOG_ENTRY_MAX_ARGC;
+    e->argv = malloc(e->argc * sizeof(char *));
+    if (!e->argv)
+        die("malloc()");
+    for (int i = 0; i < e->argc; i++)
+    {
+        size_t len = c->argl[i];
+        if (len > SLOWLOG_ENTRY_MAX_STRING)
+        {
+            char buf[SLOWLOG_ENTRY_MAX_STRING + 48];
+            snprintf(buf, sizeof(buf), "%.*s... (%zu more bytes)",
+                     SLOWLOG_ENTRY_MAX_STRING, argv[i], len - SLOWLOG_ENTRY_MAX_STRING);
+            e->argv[i] = strdup(buf);
+        }
+        else
+        {
+            e->argv[i] = strdup(argv[i]);
+        }
+        if (!e->argv[i])
+            die("strdup()");
+    }
+}
+
+// SLOWLOG GET [count] | LEN | RESET
+//
+// GET lists the newest entries first (10 by default, -1 for all), one per
+// line: id, unix time, duration in microseconds, client address, arguments.
+static void slowlog_command(Conn *c, int argc, char **argv)
+{
+    if (strcasecmp(argv[1], "len") == 0)
+    {
+        reply_integer(c, server.slowlog_len);
+    }
+    else if (strcasecmp(argv[1], "reset") == 0)
+    {
+        slowlog_reset();
+        reply_status(c, "OK");
+    }
+    else if (strcasecmp(argv[1], "get") == 0)
+    {
+        long long count = argc > 2 ? atoll(argv[2]) : 10;
+        if (count < 0 || (uint64_t)count > server.slowlog_len)
+            count = server.slowlog_len;
+
+        TextBuf t = {0};
+        for (long long i = 0; i < count; i++)
+        {
+            SlowlogEntry *e = &server.slowlog[(server.slowlog_next_id - 1 - i) % server.slowlog_max_len];
+            text_printf(&t, "%llu %lld %llu %s", (unsigned long long)e->id, (long long)e->time,
+                        (unsigned long long)e->duration_us, e->addr);
+            for (int j = 0; j < e->argc; j++)
+                text_printf(&t, " %s", e->argv[j]);
+            if (e->orig_argc > e->argc)
+                text_printf(&t, " ... (%d more arguments)", e->orig_argc - e->argc);
+            text_printf(&t, "\n");
+        }
+        reply_text(c, &t);
+    }
+    else
+    {
+        reply_error(c, "ERR unknown SLOWLOG subcommand");
+    }
+}
+
+// ========== Configuration ==========
+
+static void sched_init(void);
+
+typedef struct ConfigEntry
+{
+    const char *name;
+    long long *value;
+    long long min, max;
+    void (*apply)(void); // Called after the value changed, may be NULL
+} ConfigEntry;
+
+static ConfigEntry config_table[] = {
+    {"slowlog-log-slower-than", &server.slowlog_log_slower_than, -1, LLONG_MAX / 1000, slowlog_init},
+    {"slowlog-max-len", &server.slowlog_max_len, 0, 1 << 20, slowlog_init},
+    {"zerocopy-min-size", &server.zerocopy_min_size, 0, LLONG_MAX, NULL},
+    {"tracking-table-max-keys", &server.tracking_table_max_keys, 0, LLONG_MAX, NULL},
+    {"activedefrag", &server.active_defrag, 0, 1, NULL},
+    {"active-defrag-ignore-bytes", &server.active_defrag_ignore_bytes, 0, LLONG_MAX, NULL},
+    {"active-defrag-threshold", &server.active_defrag_threshold, 0, 1000, NULL},
+    {"hz", &server.hz, 1, 500, NULL},
+    {"latency-slo-us", &server.latency_slo_us, 1, 10000000, NULL},
+    {"sched-budget-us", &server.sched_budget_us, 1, 10000000, sched_init},
+    {"sched-min-budget-us", &server.sched_min_budget_us, 0, 10000000, NULL},
+    {"hash-max-packed-entries", &server.hash_max_packed_entries, 0, 1 << 20, NULL},
+    {"hash-max-packed-value", &server.hash_max_packed_value, 0, UINT16_MAX, NULL},
+    {"client-query-buffer-limit", &server.client_query_buffer_limit, 0, LLONG_MAX, NULL},
+    {"client-output-buffer-limit-normal-hard", &server.output_limits[CONN_CLASS_NORMAL].hard, 0, LLONG_MAX, NULL},
+    {"client-output-buffer-limit-normal-soft", &server.output_limits[CONN_CLASS_NORMAL].soft, 0, LLONG_MAX, NULL},
+    {"client-output-buffer-limit-normal-soft-seconds", &server.output_limits[CONN_CLASS_NORMAL].soft_seconds, 0, LLONG_MAX, NULL},
+    {"client-output-buffer-limit-monitor-hard", &server.output_limits[CONN_CLASS_MONITOR].hard, 0, LLONG_MAX, NULL},
+    {"client-output-buffer-limit-monitor-soft", &server.output_limits[CONN_CLASS_MONITOR].soft, 0, LLONG_MAX, NULL},
+    {"client-output-buffer-limit-monitor-soft-seconds", &server.output_limits[CONN_CLASS_MONITOR].soft_seconds, 0, LLONG_MAX, NULL},
+};
+
+#define CONFIG_NUM (int)(sizeof(config_table) / sizeof(config_table[0]))
+
+// CONFIG GET name | SET name value
+static void config_command(Conn *c, int argc, char **argv)
+{
+    ConfigEntry *entry = NULL;
+    for (int i = 0; i < CONFIG_NUM; i++)
+        if (strcasecmp(config_table[i].name, argv[2]) == 0)
+            entry = &config_table[i];
+
+    if (strcasecmp(argv[1], "get") == 0 && argc == 3)
+    {
+        if (!entry)
+        {
+            reply_error(c, "ERR unknown configuration parameter");
+            return;
+        }
+        char buf[32];
+        int n = snprintf(buf, sizeof(buf), "%lld", *entry->value);
+        reply_bulk(c, buf, n);
+    }
+    else if (strcasecmp(argv[1], "set") == 0 && argc == 4)
+    {
+        if (!entry)
+        {
+            reply_error(c, "ERR unknown configuration parameter");
+            return;
+        }
+        char *end;
+        errno = 0;
+        long long v = strtoll(argv[3], &end, 10);
+        if (errno || *end || v < entry->min || v > entry->max)
+        {
+            reply_error(c, "ERR invalid value");
+            return;
+        }
+        *entry->value = v;
+        if (entry->apply)
+            entry->apply();
+        reply_status(c, "OK");
+    }
+    else
+    {
+        reply_error(c, "ERR syntax error");
+    }
+}
+
+// ========== Active defragmentation ==========
+
+// Once the slabs hold noticeably more memory than the live objects, the
+// keyspace is walked a slice at a time and the keys, objects and strings
+// sitting in sparse slabs are moved into fuller ones, so the sparse slabs
+// empty out and go back to the kernel.
+
+static void *defrag_alloc(void *ptr)
+{
+    void *moved = Slab_defrag(ptr);
+    if (!moved)
+    {
+        server.stat_defrag_misses++;
+        return ptr;
+    }
+    server.stat_defrag_hits++;
+    return moved;
+}
+
+static void defrag_entry(void *privdata, DictEntry *de)
+{
+    (void)privdata;
+    de->key = defrag_alloc(de->key);
+    Object *o = de->val = defrag_alloc(de->val);
+    // A string pinned by a pending reply is referenced from there too. Pins
+    // are only taken on this thread, so a count of 1 cannot change under us.
+    if (o->type == OBJ_STRING && __atomic_load_n(&((RBuf *)o->ptr)->refcount, __ATOMIC_ACQUIRE) == 1)
+        o->ptr = defrag_alloc(o->ptr);
+}
+
+// Starts a defrag pass if the allocator is fragmented enough. Checked once
+// per second, the pass itself runs as a background job.
+static void defrag_start_if_needed(void)
+{
+    if (!server.active_defrag || server.defrag_running)
+        return;
+    SlabStats st;
+    Slab_get_stats(&st);
+    if (st.active - st.used < (size_t)server.active_defrag_ignore_bytes ||
+        st.active * 100 <= st.used * (100 + server.active_defrag_threshold))
+        return;
+    server.defrag_running = 1;
+    server.defrag_cursor = 0;
+}
+
+// ========== Background jobs ==========
+
+// Maintenance work runs in slices at the end of each event loop iteration.
+// Every job reports whether it has work and whether it is falling behind.
+// The tick budget doubles while some job is behind and halves back to
+// sched-budget-us once none is, but commands come first: the jobs only get
+// what is left of latency-slo-us after the commands of the iteration, and
+// never less than sched-min-budget-us so they cannot starve. The jobs with
+// work share the budget, starting from a different one every tick, and time
+// a job leaves unused goes to the ones after it.
+
+#define JOB_IDLE 0
+#define JOB_WORK 1
+#define JOB_BACKLOG 2
+
+typedef struct Job
+{
+    const char *name;
+    int (*state)(void);             // JOB_IDLE, JOB_WORK or JOB_BACKLOG
+    void (*run)(uint64_t deadline); // Works until now_ns() reaches deadline or nothing is left
+    uint64_t calls;
+    uint64_t total_ns;
+} Job;
+
+#define EXPIRE_SCAN_BUCKETS 16
+
+typedef struct ExpireScan
+{
+    long long now;
+    char **keys; // Copies of the expired keys found
+    size_t num, cap;
+    size_t sampled;
+} ExpireScan;
+
+static void expire_scan_entry(void *privdata, DictEntry *de)
+{
+    ExpireScan *st = privdata;
+    st->sampled++;
+    if ((long long)(intptr_t)de->val > st->now)
+        return;
+    if (st->num == st->cap)
+    {
+        st->cap = st->cap ? st->cap * 2 : 64;
+        st->keys = realloc(st->keys, st->cap * sizeof(char *));
+        if (!st->keys)
+            die("realloc()");
+    }
+    st->keys[st->num] = strdup(de->key);
+    if (!st->keys[st->num])
+        die("strdup()");
+    st->num++;
+}
+
+static int expire_state(void)
+{
+    if (Dict_size(server.expires) == 0)
+        return JOB_IDLE;
+    if (server.expire_backlog)
+        return JOB_BACKLOG;
+    return mstime() >= server.expire_next_ms ? JOB_WORK : JOB_IDLE;
+}
+
+// Sweeps the keys with a time to live, hz times per second. A sweep stops at
+// the deadline and carries on at the next tick; if more than a quarter of the
+// keys it looked at had expired, it reports a backlog.
+static void expire_run(uint64_t deadline)
+{
+    ExpireScan st = {.now = mstime()};
+    size_t expired = 0;
+    int done = 0;
+    while (!done && now_ns() < deadline)
+    {
+        for (int i = 0; i < EXPIRE_SCAN_BUCKETS && !done; i++)
+        {
+            server.expire_cursor = Dict_scan(server.expires, server.expire_cursor, expire_scan_entry, &st);
+            done = server.expire_cursor == 0;
+        }
+        for (size_t i = 0; i < st.num; i++)
+        {
+            signal_modified_key(st.keys[i]);
+            db_delete(st.keys[i]);
+            free(st.keys[i]);
+        }
+        expired += st.num;
+        st.num = 0;
+    }
+    free(st.keys);
+    server.stat_expired_keys += expired;
+    server.expire_backlog = expired * 4 > st.sampled;
+    if (done)
+        server.expire_next_ms = st.now + 1000 / server.hz;
+}
+
+static int rehash_state(void)
+{
+    return Dict_is_rehashing(server.keys) || Dict_is_rehashing(server.expires) ||
+                   Dict_is_rehashing(server.tracking_table)
+               ? JOB_WORK
+               : JOB_IDLE;
+}
+
+// Finishes the resizes that the dict operations move along a bucket at a
+// time, so an idle server does not keep two tables around.
+static void rehash_run(uint64_t deadline)
+{
+    int more = 1;
+    while (more && now_ns() < deadline)
+    {
+        more = Dict_rehash(server.keys, 100);
+        more |= Dict_rehash(server.expires, 100);
+        more |= Dict_rehash(server.tracking_table, 100);
+    }
+}
+
+static int defrag_state(void)
+{
+    return server.defrag_running ? JOB_WORK : JOB_IDLE;
+}
+
+static void defrag_run(uint64_t deadline)
+{
+    while (server.defrag_running && now_ns() < deadline)
+    {
+        for (int i = 0; i < 16 && server.defrag_running; i++)
+        {
+            server.defrag_cursor = Dict_scan(server.keys, server.defrag_cursor, defrag_entry, NULL);
+            server.defrag_running = server.defrag_cursor != 0;
+        }
+    }
+}
+
+#define LAZYFREE_BACKLOG_BYTES (64 * 1024 * 1024)
+
+static int lazyfree_state(void)
+{
+    if (server.lazyfree_head == server.lazyfree_num)
+        return JOB_IDLE;
+    return server.lazyfree_bytes > LAZYFREE_BACKLOG_BYTES ? JOB_BACKLOG : JOB_WORK;
+}
+
+static void lazyfree_run(uint64_t deadline)
+{
+    while (server.lazyfree_head < server.lazyfree_num && now_ns() < deadline)
+    {
+        Object *o = server.lazyfree[server.lazyfree_head++];
+        server.lazyfree_bytes -= object_bytes(o);
+        object_free(o);
+        server.stat_lazyfreed++;
+    }
+    if (server.lazyfree_head == server.lazyfree_num)
+        server.lazyfree_head = server.lazyfree_num = 0;
+}
+
+static Job jobs[] = {
+    {"expire", expire_state, expire_run, 0, 0},
+    {"rehash", rehash_state, rehash_run, 0, 0},
+    {"defrag", defrag_state, defrag_run, 0, 0},
+    {"lazyfree", lazyfree_state, lazyfree_run, 0, 0},
+};
+
+#define JOB_NUM (int)(sizeof(jobs) / sizeof(jobs[0]))
+
+static void jobs_info(TextBuf *t)
+{
+    text_printf(t, "sched_state:%s\r\n",
+                server.sched_state == JOB_BACKLOG ? "backlog" : server.sched_state == JOB_WORK ? "work" : "idle");
+    text_printf(t, "sched_tick_budget_us:%llu\r\n", (unsigned long long)(server.sched_tick_ns / 1000));
+    for (int j = 0; j < JOB_NUM; j++)
+        text_printf(t, "job_%s:calls=%llu,usec=%llu\r\n", jobs[j].name, (unsigned long long)jobs[j].calls,
+                    (unsigned long long)(jobs[j].total_ns / 1000));
+}
+
+// Restarts the adaptive budget from sched-budget-us, it only grows from there
+// while the jobs report a backlog.
+static void sched_init(void)
+{
+    server.sched_tick_ns = server.sched_budget_us * 1000;
+}
+
+// Runs the jobs for one tick. busy_ns is the time the iteration already
+// spent on commands and I/O.
+static void sched_run(uint64_t busy_ns)
+{
+    int state[JOB_NUM];
+    int active = 0;
+    server.sched_state = JOB_IDLE;
+    for (int j = 0; j < JOB_NUM; j++)
+    {
+        state[j] = jobs[j].state();
+        active += state[j] != JOB_IDLE;
+        if (state[j] > server.sched_state)
+            server.sched_state = state[j];
+    }
+
+    uint64_t base = server.sched_budget_us * 1000;
+    uint64_t slo = server.latency_slo_us * 1000;
+    if (server.sched_state == JOB_BACKLOG)
+        server.sched_tick_ns = server.sched_tick_ns * 2 < slo ? server.sched_tick_ns * 2 : slo;
+    else
+        server.sched_tick_ns = server.sched_tick_ns / 2 > base ? server.sched_tick_ns / 2 : base;
+    if (!active)
+        return;
+
+    uint64_t budget = server.sched_tick_ns;
+    if (busy_ns + budget > slo)
+        budget = slo > busy_ns ? slo - busy_ns : 0;
+    if (budget < (uint64_t)server.sched_min_budget_us * 1000)
+        budget = server.sched_min_budget_us * 1000;
+
+    uint64_t start = now_ns();
+    uint64_t end = start + budget;
+    for (int n = 0, j = server.sched_next; n < JOB_NUM; n++, j = (j + 1) % JOB_NUM)
+    {
+        if (state[j] == JOB_IDLE)
+            continue;
+        uint64_t now = now_ns();
+        if (now >= end)
+            break;
+        jobs[j].run(now + (end - now) / active--);
+        jobs[j].calls++;
+        jobs[j].total_ns += now_ns() - now;
+    }
+    server.sched_next = (server.sched_next + 1) % JOB_NUM;
+    latency_add_sample("background-jobs", now_ns() - start);
+}
+
+// ========== Dispatch ==========
+
+// Sends the command to every MONITOR connection as
+// +<unix time> [<client address>] "arg" "arg" ...
+static void monitor_feed(Conn *c, int argc, char **argv)
+{
+    TextBuf t = {0};
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    text_printf(&t, "+%lld.%06ld [%s]", (long long)ts.tv_sec, ts.tv_nsec / 1000, c->addr);
+    for (int i = 0; i < argc; i++)
+    {
+        // Quoted and escaped, a binary argument must not break the status line
+        text_printf(&t, " \"");
+        for (size_t j = 0; j < c->argl[i]; j++)
+        {
+            unsigned char ch = argv[i][j];
+            if (ch == '"' || ch == '\\')
+                text_printf(&t, "\\%c", ch);
+            else if (ch == '\n')
+                text_printf(&t, "\\n");
+            else if (ch == '\r')
+                text_printf(&t, "\\r");
+            else if (ch == '\t')
+                text_printf(&t, "\\t");
+            else if (ch < 0x20 || ch >= 0x7f)
+                text_printf(&t, "\\x%02x", ch);
+            else
+                text_printf(&t, "%c", ch);
+        }
+        text_printf(&t, "\"");
+    }
+    text_printf(&t, "\r\n");
+
+    for (ListItem *li = server.monitors.first; li; li = li->next)
+    {
+        Conn *monitor = ((ConnListItem *)li)->conn;
+        if (monitor != c)
+            reply_append(monitor, t.data, t.len);
+    }
+    free(t.data);
+}
+
+static void monitor_add(Conn *c)
+{
+    ConnListItem *item = malloc(sizeof(ConnListItem));
+    if (!item)
+        die("malloc()");
+    item->conn = c;
+    List_push(&server.monitors, (ListItem *)item);
+    c->monitor_item = (ListItem *)item;
+    c->conn_class = CONN_CLASS_MONITOR;
+}
+
+static void monitor_command(Conn *c, int argc, char **argv)
+{
+    (void)argc;
+    (void)argv;
+    if (!c->monitor_item)
+        monitor_add(c);
+    reply_status(c, "OK");
+}
+
+static void process_command(Conn *c, int argc, char **argv, const size_t *argl)
+{
+    c->argl = argl;
+    Command *cmd = lookup_command(argv[0]);
+    if (!cmd)
+    {
+        reply_error(c, "ERR unknown command");
+        return;
+    }
+    if ((cmd->arity > 0 && argc != cmd->arity) || (cmd->arity < 0 && argc < -cmd->arity))
+    {
+        reply_error(c, "ERR wrong number of arguments");
+        return;
+    }
+
+    if (server.monitors.size)
+        monitor_feed(c, argc, argv);
+
+    if (cmd->firstkey && Dict_size(server.expires))
+    {
+        long long now = mstime();
+        int last = cmd->lastkey < 0 ? argc + cmd->lastkey : cmd->lastkey;
+        for (int i = cmd->firstkey; i <= last && i < argc; i += cmd->keystep)
+            expire_if_needed(argv[i], now);
+    }
+
+    uint64_t start = now_ns();
+    cmd->proc(c, argc, argv);
+    uint64_t duration = now_ns() - start;
+    hist_add(&cmd->stats, duration);
+    if (duration > server.slowlog_threshold_ns)
+        slowlog_push(c, argc, argv, duration);
+    server.stat_numcommands++;
+
+    if (cmd->flags & (CMD_READONLY | CMD_WRITE))
+        tracking_command_keys(c, cmd, argc, argv);
+}
+
+static void conn_push_arg(Conn *c, char *arg, size_t len)
+{
+    if (c->pargv_num == c->pargv_cap)
+    {
+        c->pargv_cap = c->pargv_cap ? c->pargv_cap * 2 : 64;
+        c->pargv = realloc(c->pargv, c->pargv_cap * sizeof(char *));
+        c->pargl = realloc(c->pargl, c->pargv_cap * sizeof(size_t));
+        if (!c->pargv || !c->pargl)
+            die("realloc()");
+    }
+    c->pargv[c->pargv_num] = arg;
+    c->pargl[c->pargv_num++] = len;
+}
+
+static void conn_push_command(Conn *c, int argc)
+{
+    if (c->pcmd_num == c->pcmd_cap)
+    {
+        c->pcmd_cap = c->pcmd_cap ? c->pcmd_cap * 2 : 16;
+        c->pargc = realloc(c->pargc, c->pcmd_cap * sizeof(int));
+        if (!c->pargc)
+            die("realloc()");
+    }
+    c->pargc[c->pcmd_num++] = argc;
+}
+
+// Reads the number of the "<type>N\r\n" line at *pos. Returns 1 and moves
+// *pos past the line, 0 if it is not complete yet, -1 if it is malformed.
+static int parse_header(char **pos, char *end, char type, long long *value)
+{
+    char *p = *pos;
+    size_t avail = end - p < PROTO_MAX_HEADER ? (size_t)(end - p) : PROTO_MAX_HEADER;
+    char *nl = memchr(p, '\n', avail);
+    if (!nl)
+        return avail < PROTO_MAX_HEADER ? 0 : -1;
+    if (*p != type || nl - p < 3 || nl[-1] != '\r' || !(isdigit((unsigned char)p[1]) || p[1] == '-'))
+        return -1;
+    char *num_end;
+    errno = 0;
+    *value = strtoll(p + 1, &num_end, 10);
+    if (errno || num_end != nl - 1)
+        return -1;
+    *pos = nl + 1;
+    return 1;
+}
+
+// Parses the RESP command at *pos, an array of bulk strings: "*N\r\n", then
+// N times "$len\r\n" and len bytes of any value followed by "\r\n". Its
+// arguments are queued, and NUL terminated in place over the '\r' after
+// them, only once the whole command is in, so that a partial one is left as
+// it came for the next read or a hot restart. Returns 1 and moves *pos past
+// the command, 0 if it is not complete yet, -1 on a protocol error.
+static int parse_multibulk(Conn *c, char **pos, char *end)
+{
+    char *p = *pos;
+    long long argc, len;
+    int rv = parse_header(&p, end, '*', &argc);
+    if (rv <= 0)
+        return rv;
+    if (argc > PROTO_MAX_MULTIBULK_LEN)
+        return -1;
+
+    size_t first = c->pargv_num;
+    for (long long i = 0; i < argc; i++)
+    {
+        rv = parse_header(&p, end, '$', &len);
+        if (rv > 0 && (len < 0 || len > PROTO_MAX_BULK_LEN))
+            rv = -1;
+        else if (rv > 0 && end - p < len + 2)
+            rv = 0;
+        else if (rv > 0 && (p[len] != '\r' || p[len + 1] != '\n'))
+            rv = -1;
+        if (rv <= 0)
+        {
+            c->pargv_num = first;
+            return rv;
+        }
+        if (argc <= MAX_ARGS)
+            conn_push_arg(c, p, len);
+        p += len + 2;
+    }
+    for (size_t i = first; i < c->pargv_num; i++)
+        c->pargv[i][c->pargl[i]] = '\0';
+    if (argc > 0)
+        conn_push_command(c, argc <= MAX_ARGS ? argc : 0);
+    *pos = p;
+    return 1;
+}
+
+// Splits the complete commands of the read buffer into arguments, kept
+// until execute_input() runs them. A command starting with '*' is RESP (see
+// parse_multibulk()), any other is an inline line of space separated
+// arguments. A command with more than MAX_ARGS arguments is queued with
+// none, for execute_input() to reject. Parsing stops at a protocol error.
+// This only touches the connection, so it can run on an I/O thread.
+static void parse_input(Conn *c)
+{
+    char *start = c->rbuf + c->parsed;
+    char *end = c->rbuf + c->rlen;
+
+    while (start < end && !c->proto_error)
+    {
+        if (*start == '*')
+        {
+            int rv = parse_multibulk(c, &start, end);
+            if (rv < 0)
+                c->proto_error = 1;
+            if (rv <= 0)
+                break;
+            continue;
+        }
+
+        char *nl = memchr(start, '\n', end - start);
+        if (!nl)
+            break;
+        char *line = start;
+        start = nl + 1;
+        *nl = '\0';
+        if (nl > line && nl[-1] == '\r')
+            nl[-1] = '\0';
+
+        int argc = 0, too_many = 0;
+        char *save = NULL;
+        for (char *tok = strtok_r(line, " \t", &save); tok; tok = strtok_r(NULL, " \t", &save))
+        {
+            if (argc == MAX_ARGS)
+            {
+                c->pargv_num -= argc;
+                argc = 0;
+                too_many = 1;
+                break;
+            }
+            conn_push_arg(c, tok, strlen(tok));
+            argc++;
+        }
+        if (argc || too_many)
+            conn_push_command(c, argc);
+    }
+    c->parsed = start - c->rbuf;
+}
+
+// Runs the parsed commands and drops their bytes from the read buffer.
+static void execute_input(Conn *c)
+{
+    char **argv = c->pargv;
+    size_t i;
+    for (i = 0; i < c->pcmd_num && !c->close_asap && !c->block_proc; i++)
+    {
+        if (!c->pargc[i])
+        {
+            reply_error(c, "ERR too many arguments");
+            continue;
+        }
+        process_command(c, c->pargc[i], argv, c->pargl + (argv - c->pargv));
+        argv += c->pargc[i];
+    }
+    if (c->block_proc && i < c->pcmd_num)
+    {
+        // Keep the commands after the blocked one. The connection is not
+        // read from while blocked, so their arguments stay in place.
+        c->pcmd_num -= i;
+        memmove(c->pargc, c->pargc + i, c->pcmd_num * sizeof(int));
+        size_t done = argv - c->pargv;
+        c->pargv_num -= done;
+        memmove(c->pargv, argv, c->pargv_num * sizeof(char *));
+        memmove(c->pargl, c->pargl + done, c->pargv_num * sizeof(size_t));
+        return;
+    }
+    c->pcmd_num = c->pargv_num = 0;
+
+    if (c->proto_error)
+    {
+        // Nothing after the bad command can be framed: drop it, and close
+        // once the error is sent
+        reply_error(c, "ERR Protocol error");
+        c->proto_error = 0;
+        c->closing = 1;
+        c->rlen = c->parsed;
+    }
+
+    c->rlen -= c->parsed;
+    memmove(c->rbuf, c->rbuf + c->parsed, c->rlen);
+    c->parsed = 0;
+}
+
+// Runs the blocked command of c again, then the commands pipelined after it
+// if it did not block again.
+static void blocked_retry(Conn *c)
+{
+    command_proc proc = c->block_proc;
+    int argc = c->block_argc;
+    char **argv = conn_unblock(c);
+    c->argl = (const size_t *)(argv + argc);
+    c->block_retry = 1;
+    proc(c, argc, argv);
+    c->block_retry = 0;
+    free(argv);
+    if (!c->block_proc)
+        execute_input(c);
 }
 
-static void die(const char *msg)
+// Gives the blocked command of c its null reply and goes on with the input.
+static void blocked_timeout(Conn *c)
 {
-    int err = errno;
-    fprintf(stderr, "[%d] %s\n", err, msg);
-    abort();
+    free(conn_unblock(c));
+    reply_append(c, "*-1\r\n", 5);
+    execute_input(c);
 }
 
-static void do_something(int connfd)
+// Serves the connections blocked on the keys written since the last call,
+// in the order they blocked. Their replies go out with the next POLLOUT.
+static void blocked_serve(void)
 {
-    char rbuf[64] = {};
-    char confbuf[4] = {0};
-    size_t n, msg_config;
-    do
+    while (server.ready_num)
     {
-        msg_config = recv(connfd, confbuf, sizeof(4), MSG_WAITALL);
-        if (msg_config < 0)
+        // Commands run below may make more keys ready
+        char **keys = server.ready_keys;
+        int num = server.ready_num;
+        server.ready_keys = NULL;
+        server.ready_num = server.ready_cap = 0;
+        for (int i = 0; i < num; i++)
         {
-            msg("recv() error - msg_config");
-            return;
+            DictEntry *de = Dict_find(server.blocking_keys, keys[i]);
+            if (de)
+            {
+                // The set changes as connections unblock and block again
+                BlockedSet *bs = de->val;
+                int n = bs->num;
+                Conn **list = malloc(n * sizeof(Conn *));
+                if (!list)
+                    die("malloc()");
+                memcpy(list, bs->conns, n * sizeof(Conn *));
+                bs->ready = 0;
+                for (int j = 0; j < n; j++)
+                    if (list[j]->block_proc && !list[j]->close_asap)
+                        blocked_retry(list[j]);
+                free(list);
+            }
+            free(keys[i]);
         }
+        free(keys);
+    }
+}
 
-        int n_ping = atoi(&confbuf[1]);
+static void blocked_check_timeouts(void)
+{
+    if (!server.blocked_clients)
+        return;
+    long long now = mstime();
+    for (int fd = 0; fd < conns_cap; fd++)
+    {
+        Conn *c = conns[fd];
+        if (c && c->block_proc && c->block_deadline && now >= c->block_deadline)
+            blocked_timeout(c);
+    }
+}
 
-        n = recv(connfd, rbuf, n_ping * (sizeof(PING_MSG) - 1), MSG_WAITALL);
-        if (n < 0)
+// ========== Listeners and event loop ==========
+
+static void fd_set_nonblock(int fd)
+{
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0)
+        die("fcntl()");
+}
+
+// Binds a listener described as "ip:port" (AF_INET), "/path/to.sock"
+// (AF_UNIX) or "@name" (Linux abstract AF_UNIX socket).
+static void listener_add(const char *spec)
+{
+    if (listeners_num == MAX_LISTENERS)
+        die("too many listeners");
+
+    Listener *l = &listeners[listeners_num];
+    struct sockaddr_storage ss = {};
+    socklen_t sslen;
+    snprintf(l->name, sizeof(l->name), "%s", spec);
+
+    if (spec[0] == '/' || spec[0] == '@')
+    {
+        struct sockaddr_un *sun = (struct sockaddr_un *)&ss;
+        size_t len = strlen(spec);
+        if (len >= sizeof(sun->sun_path))
+            die("unix socket path too long");
+        sun->sun_family = AF_UNIX;
+        memcpy(sun->sun_path, spec, len);
+        if (spec[0] == '@')
         {
-            msg("recv() error");
-            return;
+            // Abstract sockets start with a NUL byte and are not NUL terminated
+            sun->sun_path[0] = '\0';
+            sslen = offsetof(struct sockaddr_un, sun_path) + len;
         }
-        fprintf(stderr, "client says: %s\n", rbuf);
-
-        char wbuf[] = "+PONG\r\n";
-        for (int i = 0; i < n_ping; i++)
+        else
         {
-            write(connfd, wbuf, strlen(wbuf));
+            unlink(spec); // stale socket left by a previous run
+            sslen = sizeof(*sun);
         }
-    } while (n != 0);
-}
+    }
+    else
+    {
+        struct sockaddr_in *sin = (struct sockaddr_in *)&ss;
+        const char *colon = strrchr(spec, ':');
+        char host[INET_ADDRSTRLEN] = "0.0.0.0";
+        if (colon && (size_t)(colon - spec) < sizeof(host))
+        {
+            memcpy(host, spec, colon - spec);
+            host[colon - spec] = '\0';
+        }
+        sin->sin_family = AF_INET;
+        sin->sin_port = htons(atoi(colon ? colon + 1 : spec));
+        if (inet_pton(AF_INET, host, &sin->sin_addr) != 1)
+            die("invalid listen address");
+        sslen = sizeof(*sin);
+    }
 
-int main()
-{
-    int fd = socket(AF_INET, SOCK_STREAM, 0);
-    if (fd < 0)
+    l->family = ss.ss_family;
+    l->fd = socket(l->family, SOCK_STREAM, 0);
+    if (l->fd < 0)
     {
         die("socket()");
     }
 
     // this is needed for most server applications
-    int val = 1;
-    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &val, sizeof(val));
+    if (l->family == AF_INET)
+    {
+        int val = 1;
+        setsockopt(l->fd, SOL_SOCKET, SO_REUSEADDR, &val, sizeof(val));
+    }
 
     // bind
-    struct sockaddr_in addr = {};
-    addr.sin_family = AF_INET;
-    addr.sin_port = ntohs(1234);
-    addr.sin_addr.s_addr = ntohl(0); // wildcard address 0.0.0.0
-    int rv = bind(fd, (const struct sockaddr *)&addr, sizeof(addr));
+    int rv = bind(l->fd, (const struct sockaddr *)&ss, sslen);
     if (rv)
     {
         die("bind()");
     }
 
     // listen
-    rv = listen(fd, SOMAXCONN);
+    rv = listen(l->fd, SOMAXCONN);
     if (rv)
     {
         die("listen()");
     }
+    fd_set_nonblock(l->fd);
+    listeners_num++;
+}
+
+static void conn_close(Conn *c)
+{
+    conns[c->fd] = NULL;
+    if (c->close_asap)
+        server.close_asap_num--;
+    if (c->monitor_item)
+        free(List_remove(&server.monitors, c->monitor_item));
+    if (c->tracking)
+        server.tracking_clients--;
+    if (c->inval_num)
+        tracking_discard(c);
+    if (c->block_proc)
+        free(conn_unblock(c));
+    for (int i = c->parts_head; i < c->parts_num; i++)
+        rbuf_release(c->parts[i].ref);
+    if (c->tail)
+        rbuf_release(c->tail);
+    Slab_free(c->rbuf);
+    free(c->pargv);
+    free(c->pargl);
+    free(c->pargc);
+    free(c->parts);
+    free(c->inval_keys);
+
+    // The kernel may still read the pages of zerocopy sends, keep the socket
+    // and those buffers until it reports the completions
+    if (c->zc_pending_num)
+        zerocopy_reap(c);
+    if (c->zc_pending_num)
+    {
+        ConnListItem *item = malloc(sizeof(ConnListItem));
+        if (!item)
+            die("malloc()");
+        item->conn = c;
+        c->zc_linger_deadline = mstime() + ZEROCOPY_LINGER_MS;
+        List_push(&server.zerocopy_lingering, (ListItem *)item);
+        return;
+    }
+    close(c->fd);
+    free(c->zc_pending);
+    Slab_free(c);
+}
+
+// Allocates the state of a client connection and registers it in conns[].
+static Conn *conn_create(int fd)
+{
+    Conn *c = Slab_calloc(sizeof(Conn));
+    if (!c)
+        die("Slab_calloc()");
+    c->fd = fd;
+    c->id = ++server.next_client_id;
+
+    if (fd >= conns_cap)
+    {
+        int cap = conns_cap ? conns_cap : 64;
+        while (cap <= fd)
+            cap *= 2;
+        conns = realloc(conns, cap * sizeof(Conn *));
+        if (!conns)
+            die("realloc()");
+        memset(conns + conns_cap, 0, (cap - conns_cap) * sizeof(Conn *));
+        conns_cap = cap;
+    }
+    conns[fd] = c;
+    return c;
+}
+
+static void accept_conns(Listener *l)
+{
     while (1)
     {
         // accept
-        struct sockaddr_in client_addr = {};
+        struct sockaddr_storage client_addr = {};
         socklen_t addrlen = sizeof(client_addr);
-        int connfd = accept(fd, (struct sockaddr *)&client_addr, &addrlen);
+        int connfd = accept(l->fd, (struct sockaddr *)&client_addr, &addrlen);
         if (connfd < 0)
         {
-            continue; // error
-            printf("Failed connection. Skipped.\n");
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                msg("accept() error");
+            return;
+        }
+        fd_set_nonblock(connfd);
+        server.stat_numconnections++;
+
+        Conn *c = conn_create(connfd);
+        if (l->family == AF_INET)
+        {
+            struct sockaddr_in *sin = (struct sockaddr_in *)&client_addr;
+            char ip[INET_ADDRSTRLEN];
+            inet_ntop(AF_INET, &sin->sin_addr, ip, sizeof(ip));
+            snprintf(c->addr, sizeof(c->addr), "%s:%d", ip, ntohs(sin->sin_port));
+
+            int one = 1;
+            if (server.zerocopy_min_size > 0 &&
+                setsockopt(connfd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) == 0)
+                c->zerocopy = 1;
+        }
+        else
+        {
+            snprintf(c->addr, sizeof(c->addr), "%s:0", l->name);
+        }
+    }
+}
+
+// Reads everything available into the read buffer, setting closing on EOF
+// and io_error on failure, or once the buffer is over the query buffer limit
+// (e.g. a client that never sends a newline). Safe to run on an I/O thread.
+static void conn_read(Conn *c)
+{
+    while (1)
+    {
+        if (c->rcap - c->rlen < READ_CHUNK)
+        {
+            c->rcap = c->rcap ? c->rcap * 2 : READ_CHUNK * 2;
+            c->rbuf = Slab_realloc(c->rbuf, c->rcap);
+            if (!c->rbuf)
+                die("Slab_realloc()");
+        }
+        size_t avail = c->rcap - c->rlen;
+        ssize_t n = read(c->fd, c->rbuf + c->rlen, avail);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+            msg("read() error");
+            c->io_error = 1;
+            return;
+        }
+        if (n == 0)
+        {
+            c->closing = 1;
+            break;
+        }
+        c->rlen += n;
+        if (server.client_query_buffer_limit && c->rlen > (size_t)server.client_query_buffer_limit)
+        {
+            fprintf(stderr, "closing client %s: %zu bytes of pending input over the query buffer limit\n",
+                    c->addr, c->rlen);
+            c->io_error = 1;
+            return;
+        }
+        if ((size_t)n < avail)
+            break; // short read, the socket is drained
+    }
+}
+
+// ========== I/O threads ==========
+
+// With --io-threads N, reading and parsing, and writing the replies, of the
+// connections ready in an event loop iteration are spread over N workers:
+// the main thread and N - 1 I/O threads. Commands still run on the main
+// thread only. Each thread has an inbound MPSC queue fed by the main thread;
+// finished connections come back through one MPSC queue drained by the main
+// thread, which waits for the whole batch before it goes on, so a connection
+// is never touched by two threads at once. eventfds wake up the sleeping side.
+
+#define MAX_IO_THREADS 64
+
+enum
+{
+    IO_OP_READ,
+    IO_OP_WRITE,
+};
+
+typedef struct IOThread
+{
+    pthread_t thread;
+    MpscQueue queue;
+    int efd;
+} IOThread;
+
+static IOThread io_threads[MAX_IO_THREADS];
+static MpscQueue io_done;
+static int io_done_efd;
+
+static Conn *io_conn(MpscNode *n)
+{
+    return (Conn *)((char *)n - offsetof(Conn, io_node));
+}
+
+static void io_do(Conn *c)
+{
+    if (c->io_op == IO_OP_READ)
+    {
+        conn_read(c);
+        if (!c->io_error)
+            parse_input(c);
+    }
+    else if (flush_output(c) < 0)
+    {
+        c->io_error = 1;
+    }
+}
+
+static void efd_signal(int efd)
+{
+    uint64_t one = 1;
+    while (write(efd, &one, sizeof(one)) < 0 && errno == EINTR)
+        ;
+}
+
+static void efd_wait(int efd)
+{
+    uint64_t v;
+    while (read(efd, &v, sizeof(v)) < 0 && errno == EINTR)
+        ;
+}
+
+static void *io_thread_main(void *arg)
+{
+    IOThread *t = arg;
+    while (1)
+    {
+        MpscNode *n;
+        while ((n = Mpsc_pop(&t->queue)) != NULL)
+        {
+            io_do(io_conn(n));
+            Mpsc_push(&io_done, n);
+            efd_signal(io_done_efd);
+        }
+        efd_wait(t->efd);
+    }
+    return NULL;
+}
+
+static void io_threads_start(void)
+{
+    Mpsc_init(&io_done);
+    io_done_efd = eventfd(0, 0);
+    if (io_done_efd < 0)
+        die("eventfd()");
+    for (int i = 1; i < server.io_threads_num; i++)
+    {
+        IOThread *t = &io_threads[i];
+        Mpsc_init(&t->queue);
+        t->efd = eventfd(0, 0);
+        if (t->efd < 0)
+            die("eventfd()");
+        if (pthread_create(&t->thread, NULL, io_thread_main, t) != 0)
+            die("pthread_create()");
+    }
+}
+
+// Runs op on every connection and returns once all of them are done.
+static void io_run(Conn **batch, int n, int op)
+{
+    int workers = server.io_threads_num < n ? server.io_threads_num : n;
+    int dispatched = 0;
+
+    for (int i = 0; i < n; i++)
+    {
+        batch[i]->io_op = op;
+        int w = i % (workers ? workers : 1);
+        if (w == 0)
+            continue;
+        Mpsc_push(&io_threads[w].queue, &batch[i]->io_node);
+        dispatched++;
+    }
+    for (int w = 1; w < workers; w++)
+        efd_signal(io_threads[w].efd);
+
+    for (int i = 0; i < n; i += workers ? workers : 1)
+        io_do(batch[i]);
+
+    while (dispatched)
+    {
+        if (Mpsc_pop(&io_done))
+            dispatched--;
+        else
+            efd_wait(io_done_efd);
+    }
+}
+
+// ========== Hot restart ==========
+
+// A server started with --upgrade-socket PATH hands itself over to a new
+// process started with --takeover PATH, so the binary can be replaced
+// without refusing connections or starting with an empty keyspace. The old
+// process has already run every complete command it read; it writes the
+// keyspace and the state of each connection (partial input, unsent output)
+// to a memfd, then passes the memfd, the listening sockets and the client
+// sockets over PATH with SCM_RIGHTS. It exits once the new process confirms,
+// without closing anything, and keeps serving if the handoff fails.
+
+#define HANDOFF_MAGIC "SMRHAND2"
+#define HANDOFF_BATCH_FDS 64 // Client sockets per message
+#define HANDOFF_TIMEOUT 10   // Seconds the old process waits for the new one
+
+#define HANDOFF_CONN_MONITOR (1 << 0)
+#define HANDOFF_CONN_TRACKING (1 << 1)
+
+typedef struct HandoffHello
+{
+    char magic[8];
+    uint32_t nlisteners; // Listening sockets attached after the memfd
+    uint32_t nconns;     // Client sockets, sent HANDOFF_BATCH_FDS at a time
+    uint64_t snapshot_len;
+} HandoffHello;
+
+static int send_fds(int sock, const void *buf, size_t len, const int *fds, int nfds)
+{
+    char cbuf[CMSG_SPACE((MAX_LISTENERS + HANDOFF_BATCH_FDS) * sizeof(int))] = {0};
+    struct iovec iov = {(void *)buf, len};
+    struct msghdr mh = {.msg_iov = &iov, .msg_iovlen = 1};
+    if (nfds)
+    {
+        mh.msg_control = cbuf;
+        mh.msg_controllen = CMSG_SPACE(nfds * sizeof(int));
+        struct cmsghdr *cm = CMSG_FIRSTHDR(&mh);
+        cm->cmsg_level = SOL_SOCKET;
+        cm->cmsg_type = SCM_RIGHTS;
+        cm->cmsg_len = CMSG_LEN(nfds * sizeof(int));
+        memcpy(CMSG_DATA(cm), fds, nfds * sizeof(int));
+    }
+    return sendmsg(sock, &mh, 0) == (ssize_t)len ? 0 : -1;
+}
+
+// Receives a message of exactly len bytes. Returns the number of descriptors
+// that came with it (at most maxfds), or -1.
+static int recv_fds(int sock, void *buf, size_t len, int *fds, int maxfds)
+{
+    char cbuf[CMSG_SPACE((MAX_LISTENERS + HANDOFF_BATCH_FDS) * sizeof(int))];
+    struct iovec iov = {buf, len};
+    struct msghdr mh = {.msg_iov = &iov, .msg_iovlen = 1, .msg_control = cbuf, .msg_controllen = sizeof(cbuf)};
+    if (recvmsg(sock, &mh, MSG_CMSG_CLOEXEC) != (ssize_t)len || (mh.msg_flags & (MSG_TRUNC | MSG_CTRUNC)))
+        return -1;
+    int nfds = 0;
+    for (struct cmsghdr *cm = CMSG_FIRSTHDR(&mh); cm; cm = CMSG_NXTHDR(&mh, cm))
+    {
+        if (cm->cmsg_level != SOL_SOCKET || cm->cmsg_type != SCM_RIGHTS)
+            continue;
+        int n = (cm->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        if (nfds + n > maxfds)
+            return -1;
+        memcpy(fds + nfds, CMSG_DATA(cm), n * sizeof(int));
+        nfds += n;
+    }
+    return nfds;
+}
+
+static size_t put_bytes(unsigned char *out, size_t off, const void *data, size_t len)
+{
+    uint64_t len64 = len;
+    off = Serial_put(out, off, &len64, sizeof(len64));
+    return Serial_put(out, off, data, len);
+}
+
+static size_t dump_object(const Object *o, unsigned char *out)
+{
+    switch (o->type)
+    {
+    case OBJ_BLOOM:
+        return Bloom_dump(o->ptr, out);
+    case OBJ_CUCKOO:
+        return Cuckoo_dump(o->ptr, out);
+    case OBJ_CMS:
+        return CountMin_dump(o->ptr, out);
+    case OBJ_TOPK:
+        return TopK_dump(o->ptr, out);
+    case OBJ_STREAM:
+        return Stream_dump(o->ptr, out);
+    case OBJ_HASH:
+        return Hash_dump(o->ptr, out);
+    }
+    return 0;
+}
+
+static size_t put_object(unsigned char *out, size_t off, const Object *o)
+{
+    uint8_t type = o->type;
+    off = Serial_put(out, off, &type, sizeof(type));
+    if (o->type == OBJ_STRING)
+        return put_bytes(out, off, ((RBuf *)o->ptr)->data, ((RBuf *)o->ptr)->len);
+
+    uint64_t len = dump_object(o, NULL);
+    off = Serial_put(out, off, &len, sizeof(len));
+    dump_object(o, out ? out + off : NULL);
+    return off + len;
+}
+
+// Writes the snapshot to out (if not NULL) and returns its size: the
+// listeners, then the given connections, then the keyspace with the expire
+// time of each key (-1 if none).
+static size_t snapshot_write(unsigned char *out, Conn **list, uint32_t n)
+{
+    size_t off = Serial_put(out, 0, HANDOFF_MAGIC, 8);
+    for (int i = 0; i < listeners_num; i++)
+    {
+        off = Serial_put(out, off, &listeners[i].family, sizeof(listeners[i].family));
+        off = Serial_put(out, off, listeners[i].name, sizeof(listeners[i].name));
+    }
+
+    for (uint32_t i = 0; i < n; i++)
+    {
+        Conn *c = list[i];
+        uint8_t flags = (c->monitor_item ? HANDOFF_CONN_MONITOR : 0) | (c->tracking ? HANDOFF_CONN_TRACKING : 0);
+        off = Serial_put(out, off, &flags, sizeof(flags));
+        off = Serial_put(out, off, c->addr, sizeof(c->addr));
+        off = put_bytes(out, off, c->rbuf + c->parsed, c->rlen - c->parsed);
+        uint64_t outlen = 0;
+        for (int j = c->parts_head; j < c->parts_num; j++)
+            outlen += c->parts[j].len;
+        off = Serial_put(out, off, &outlen, sizeof(outlen));
+        for (int j = c->parts_head; j < c->parts_num; j++)
+            off = Serial_put(out, off, c->parts[j].ref->data + c->parts[j].off, c->parts[j].len);
+    }
+
+    uint64_t nkeys = Dict_size(server.keys);
+    off = Serial_put(out, off, &nkeys, sizeof(nkeys));
+    DictIterator it;
+    Dict_iter_init(&it, server.keys);
+    for (DictEntry *de = Dict_next(&it); de; de = Dict_next(&it))
+    {
+        int64_t when = db_get_expire(de->key);
+        off = put_bytes(out, off, de->key, strlen(de->key));
+        off = Serial_put(out, off, &when, sizeof(when));
+        off = put_object(out, off, de->val);
+    }
+    Dict_iter_release(&it);
+    return off;
+}
+
+// Reads a length prefixed byte string, pointing *data into the snapshot.
+static int get_bytes(SerialReader *r, const unsigned char **data, uint64_t *len)
+{
+    if (!Serial_get(r, len, sizeof(*len)) || *len > (uint64_t)(r->end - r->p))
+        return 0;
+    *data = r->p;
+    r->p += *len;
+    return 1;
+}
+
+static Object *get_object(SerialReader *r)
+{
+    uint8_t type;
+    const unsigned char *data;
+    uint64_t len;
+    if (!Serial_get(r, &type, sizeof(type)) || !get_bytes(r, &data, &len))
+        return NULL;
+    void *ptr;
+    switch (type)
+    {
+    case OBJ_STRING:
+        ptr = rbuf_create((const char *)data, len);
+        break;
+    case OBJ_BLOOM:
+        ptr = Bloom_load(data, len);
+        break;
+    case OBJ_CUCKOO:
+        ptr = Cuckoo_load(data, len);
+        break;
+    case OBJ_CMS:
+        ptr = CountMin_load(data, len);
+        break;
+    case OBJ_TOPK:
+        ptr = TopK_load(data, len);
+        break;
+    case OBJ_STREAM:
+        ptr = Stream_load(data, len);
+        break;
+    case OBJ_HASH:
+        ptr = Hash_load(data, len);
+        break;
+    default:
+        return NULL;
+    }
+    return ptr ? object_create(type, ptr) : NULL;
+}
+
+// Runs in the old process when a new one connects to the upgrade socket.
+static void handoff_serve(void)
+{
+    int sock = accept(server.upgrade_fd, NULL, NULL);
+    if (sock < 0)
+        return;
+    struct timeval tv = {HANDOFF_TIMEOUT, 0};
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    msg("handing over to a new process");
+
+    // Blocked commands cannot be carried over, they time out now
+    for (int fd = 0; server.blocked_clients && fd < conns_cap; fd++)
+        while (conns[fd] && conns[fd]->block_proc)
+            blocked_timeout(conns[fd]);
+
+    // The tracking table stays behind, so tracking clients drop their whole
+    // cache (a null key list invalidates everything)
+    tracking_flush();
+    Conn **list = malloc((conns_cap + 1) * sizeof(Conn *));
+    if (!list)
+        die("malloc()");
+    uint32_t n = 0;
+    for (int fd = 0; fd < conns_cap; fd++)
+    {
+        Conn *c = conns[fd];
+        if (!c)
+            continue;
+        if (c->tracking)
+        {
+            static const char push[] = ">2\r\n$10\r\ninvalidate\r\n*-1\r\n";
+            reply_append(c, push, sizeof(push) - 1);
+        }
+        if (c->close_asap || flush_output(c) < 0 || (c->closing && !conn_has_output(c)))
+            conn_close(c);
+        else
+            list[n++] = c;
+    }
+
+    int ok = 0;
+    int memfd = memfd_create("sm-redis-snapshot", MFD_CLOEXEC);
+    HandoffHello hello = {.nlisteners = listeners_num, .nconns = n, .snapshot_len = snapshot_write(NULL, list, n)};
+    memcpy(hello.magic, HANDOFF_MAGIC, sizeof(hello.magic));
+    unsigned char *snap = MAP_FAILED;
+    if (memfd >= 0 && ftruncate(memfd, hello.snapshot_len) == 0)
+        snap = mmap(NULL, hello.snapshot_len, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+    if (snap != MAP_FAILED)
+    {
+        snapshot_write(snap, list, n);
+        munmap(snap, hello.snapshot_len);
+
+        int fds[1 + MAX_LISTENERS + HANDOFF_BATCH_FDS];
+        fds[0] = memfd;
+        for (int i = 0; i < listeners_num; i++)
+            fds[1 + i] = listeners[i].fd;
+        ok = send_fds(sock, &hello, sizeof(hello), fds, 1 + listeners_num) == 0;
+        for (uint32_t i = 0; ok && i < n; i += HANDOFF_BATCH_FDS)
+        {
+            uint32_t batch = n - i < HANDOFF_BATCH_FDS ? n - i : HANDOFF_BATCH_FDS;
+            for (uint32_t j = 0; j < batch; j++)
+                fds[j] = list[i + j]->fd;
+            ok = send_fds(sock, &batch, sizeof(batch), fds, batch) == 0;
+        }
+        char ack;
+        ok = ok && read(sock, &ack, 1) == 1 && ack == 'K';
+    }
+    if (ok)
+    {
+        msg("handoff complete, exiting");
+        exit(0);
+    }
+
+    msg("handoff failed, still serving");
+    if (memfd >= 0)
+        close(memfd);
+    close(sock);
+    free(list);
+}
+
+// Runs in the new process at startup, in place of binding the listeners.
+static void handoff_takeover(const char *path)
+{
+    struct sockaddr_un sun = {.sun_family = AF_UNIX};
+    if (strlen(path) >= sizeof(sun.sun_path))
+        die("upgrade socket path too long");
+    strcpy(sun.sun_path, path);
+    int sock = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+    if (sock < 0 || connect(sock, (struct sockaddr *)&sun, sizeof(sun)) < 0)
+        die("connect() to the upgrade socket");
+
+    HandoffHello hello;
+    int fds[1 + MAX_LISTENERS + HANDOFF_BATCH_FDS];
+    int nfds = recv_fds(sock, &hello, sizeof(hello), fds, 1 + MAX_LISTENERS);
+    if (nfds < 1 || memcmp(hello.magic, HANDOFF_MAGIC, 8) != 0 || hello.nlisteners > MAX_LISTENERS ||
+        nfds != 1 + (int)hello.nlisteners)
+        die("bad handoff message");
+    unsigned char *snap = mmap(NULL, hello.snapshot_len, PROT_READ, MAP_SHARED, fds[0], 0);
+    if (snap == MAP_FAILED)
+        die("mmap()");
+    close(fds[0]);
+
+    SerialReader r = {snap, snap + hello.snapshot_len};
+    char magic[8];
+    if (!Serial_get(&r, magic, sizeof(magic)) || memcmp(magic, HANDOFF_MAGIC, 8) != 0)
+        die("bad snapshot");
+    for (uint32_t i = 0; i < hello.nlisteners; i++)
+    {
+        Listener *l = &listeners[listeners_num++];
+        l->fd = fds[1 + i];
+        if (!Serial_get(&r, &l->family, sizeof(l->family)) || !Serial_get(&r, l->name, sizeof(l->name)))
+            die("bad snapshot");
+        l->name[sizeof(l->name) - 1] = '\0';
+    }
+
+    for (uint32_t i = 0, batch = 0, next = 0; i < hello.nconns; i++, next++)
+    {
+        if (next == batch)
+        {
+            if (recv_fds(sock, &batch, sizeof(batch), fds, HANDOFF_BATCH_FDS) != (int)batch || batch == 0)
+                die("bad handoff message");
+            next = 0;
+        }
+        // SO_ZEROCOPY may be on, but c->zerocopy stays off: the kernel numbers
+        // the sends of the socket from where the old process left off
+        Conn *c = conn_create(fds[next]);
+        uint8_t flags;
+        const unsigned char *in, *out;
+        uint64_t inlen, outlen;
+        if (!Serial_get(&r, &flags, sizeof(flags)) || !Serial_get(&r, c->addr, sizeof(c->addr)) ||
+            !get_bytes(&r, &in, &inlen) || !get_bytes(&r, &out, &outlen))
+            die("bad snapshot");
+        c->addr[sizeof(c->addr) - 1] = '\0';
+        if (inlen)
+        {
+            c->rcap = inlen + READ_CHUNK;
+            c->rbuf = Slab_alloc(c->rcap);
+            if (!c->rbuf)
+                die("Slab_alloc()");
+            memcpy(c->rbuf, in, inlen);
+            c->rlen = inlen;
+        }
+        reply_append(c, (const char *)out, outlen);
+        if (flags & HANDOFF_CONN_MONITOR)
+            monitor_add(c);
+        if (flags & HANDOFF_CONN_TRACKING)
+        {
+            c->tracking = 1;
+            server.tracking_clients++;
+        }
+    }
+
+    uint64_t nkeys;
+    if (!Serial_get(&r, &nkeys, sizeof(nkeys)))
+        die("bad snapshot");
+    for (uint64_t i = 0; i < nkeys; i++)
+    {
+        const unsigned char *key;
+        uint64_t keylen;
+        int64_t when;
+        Object *o;
+        if (!get_bytes(&r, &key, &keylen) || !Serial_get(&r, &when, sizeof(when)) || !(o = get_object(&r)))
+            die("bad snapshot");
+        char *k = Slab_alloc(keylen + 1);
+        if (!k)
+            die("Slab_alloc()");
+        memcpy(k, key, keylen);
+        k[keylen] = '\0';
+        if (!Dict_add(server.keys, k, o))
+            die("bad snapshot");
+        if (when >= 0)
+            db_set_expire(k, when);
+    }
+    munmap(snap, hello.snapshot_len);
+
+    if (write(sock, "K", 1) != 1)
+        die("write() to the upgrade socket");
+    close(sock);
+    char buf[64];
+    snprintf(buf, sizeof(buf), "took over %u connections and %llu keys", hello.nconns, (unsigned long long)nkeys);
+    msg(buf);
+
+    // Input left over by the old process may hold complete commands
+    for (int fd = 0; fd < conns_cap; fd++)
+    {
+        if (conns[fd] && conns[fd]->rlen)
+        {
+            parse_input(conns[fd]);
+            execute_input(conns[fd]);
+        }
+    }
+}
+
+// Binds the socket a future process connects to for a takeover. A path
+// still bound by the process being replaced is taken over too.
+static void upgrade_listen(const char *path)
+{
+    struct sockaddr_un sun = {.sun_family = AF_UNIX};
+    if (strlen(path) >= sizeof(sun.sun_path))
+        die("upgrade socket path too long");
+    strcpy(sun.sun_path, path);
+    unlink(path);
+    server.upgrade_fd = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+    if (server.upgrade_fd < 0 || bind(server.upgrade_fd, (struct sockaddr *)&sun, sizeof(sun)) < 0 ||
+        listen(server.upgrade_fd, 1) < 0)
+        die("upgrade socket");
+    fd_set_nonblock(server.upgrade_fd);
+}
+
+// ========== Event loop ==========
+
+static void event_loop(void)
+{
+    struct pollfd *pfds = NULL;
+    Conn **batch = NULL, **wbatch = NULL;
+    int pfds_cap = 0;
+
+    while (1)
+    {
+        int nfds = listeners_num;
+        if (pfds_cap < listeners_num + conns_cap + 1)
+        {
+            pfds_cap = listeners_num + conns_cap + 1;
+            pfds = realloc(pfds, pfds_cap * sizeof(struct pollfd));
+            batch = realloc(batch, pfds_cap * sizeof(Conn *));
+            wbatch = realloc(wbatch, pfds_cap * sizeof(Conn *));
+            if (!pfds || !batch || !wbatch)
+                die("realloc()");
+        }
+        for (int i = 0; i < listeners_num; i++)
+            pfds[i] = (struct pollfd){.fd = listeners[i].fd, .events = POLLIN};
+        for (int fd = 0; fd < conns_cap; fd++)
+        {
+            Conn *c = conns[fd];
+            if (!c || c->close_asap)
+                continue;
+            // A blocked connection is only watched for the peer going away
+            short events = c->closing ? 0 : c->block_proc ? POLLRDHUP : POLLIN;
+            if (conn_has_output(c))
+                events |= POLLOUT;
+            pfds[nfds++] = (struct pollfd){.fd = fd, .events = events};
+        }
+        int nconnfds = nfds;
+        if (server.upgrade_fd >= 0)
+            pfds[nfds++] = (struct pollfd){.fd = server.upgrade_fd, .events = POLLIN};
+
+        // Wake up hz times per second for the soft output limits and the
+        // expire sweeps, sooner while the background jobs have work
+        int timeout = server.sched_state == JOB_BACKLOG ? 0 : server.sched_state == JOB_WORK ? 1 : 1000 / server.hz;
+        int rv = poll(pfds, nfds, timeout);
+        if (rv < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            die("poll()");
+        }
+
+        // One loop iteration is the work done for the ready events, not the
+        // time spent waiting for them.
+        uint64_t start = now_ns();
+        time_t prev_unixtime = server.unixtime;
+        server.unixtime = time(NULL);
+
+        int nread = 0, nwrite = 0;
+        for (int i = listeners_num; i < nconnfds; i++)
+        {
+            Conn *c = conns[pfds[i].fd];
+            if (!c || c->close_asap || !pfds[i].revents)
+                continue;
+            // POLLERR that only meant zerocopy completions is not an error
+            if ((pfds[i].revents & POLLERR) && zerocopy_reap(c))
+                pfds[i].revents &= ~POLLERR;
+            if (c->block_proc && (pfds[i].revents & (POLLRDHUP | POLLHUP | POLLERR)))
+            {
+                conn_close(c);
+                continue;
+            }
+            if (pfds[i].revents & (POLLIN | POLLHUP | POLLERR))
+                batch[nread++] = c;
+            else if (pfds[i].revents & POLLOUT)
+                wbatch[nwrite++] = c;
+        }
+
+        // Read and parse, then run the commands on this thread, then write
+        io_run(batch, nread, IO_OP_READ);
+        for (int i = 0; i < nread; i++)
+        {
+            Conn *c = batch[i];
+            if (c->io_error)
+                conn_close(c);
+            else
+            {
+                execute_input(c);
+                if (!c->close_asap)
+                    wbatch[nwrite++] = c;
+            }
+        }
+        // Connections not written below get POLLOUT in the next iteration
+        blocked_serve();
+        blocked_check_timeouts();
+        tracking_flush();
+        io_run(wbatch, nwrite, IO_OP_WRITE);
+        for (int i = 0; i < nwrite; i++)
+        {
+            Conn *c = wbatch[i];
+            if (!c->close_asap && (c->io_error || (c->closing && !conn_has_output(c))))
+                conn_close(c);
+        }
+
+        for (int i = 0; i < listeners_num; i++)
+            if (pfds[i].revents & POLLIN)
+                accept_conns(&listeners[i]);
+
+        int check_soft = server.unixtime != prev_unixtime;
+        if (server.close_asap_num || check_soft)
+        {
+            for (int fd = 0; fd < conns_cap; fd++)
+            {
+                Conn *c = conns[fd];
+                if (c && !c->close_asap && check_soft && c->soft_limit_since)
+                    conn_check_output_limits(c);
+                if (c && c->close_asap)
+                    conn_close(c);
+            }
         }
+        zerocopy_linger_check();
+        if (check_soft)
+            defrag_start_if_needed();
+        sched_run(now_ns() - start);
+        if (nfds > nconnfds && (pfds[nconnfds].revents & POLLIN))
+            handoff_serve();
+        latency_add_sample("event-loop", now_ns() - start);
+    }
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "usage: %s [--listen ip:port | /path/to.sock | @abstract-name] ... [--io-threads N]\n"
+                    "       [--upgrade-socket /path] [--takeover /path]\n", prog);
+    exit(1);
+}
 
-        do_something(connfd);
-        close(connfd);
+int main(int argc, char **argv)
+{
+    server.start_time = server.unixtime = time(NULL);
+    List_init(&server.monitors);
+    List_init(&server.zerocopy_lingering);
+    slowlog_init();
+    sched_init();
+    server.keys = Dict_create(&keyspace_dict_type);
+    server.expires = Dict_create(&expires_dict_type);
+    server.tracking_table = Dict_create(&tracking_dict_type);
+    server.blocking_keys = Dict_create(&blocking_dict_type);
+    if (!server.keys || !server.expires || !server.tracking_table || !server.blocking_keys)
+        die("Dict_create()");
+    signal(SIGPIPE, SIG_IGN);
+
+    const char *upgrade_path = NULL, *takeover_path = NULL;
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--listen") == 0 && i + 1 < argc)
+            listener_add(argv[++i]);
+        else if (strcmp(argv[i], "--upgrade-socket") == 0 && i + 1 < argc)
+            upgrade_path = argv[++i];
+        else if (strcmp(argv[i], "--takeover") == 0 && i + 1 < argc)
+            takeover_path = argv[++i];
+        else if (strcmp(argv[i], "--io-threads") == 0 && i + 1 < argc)
+        {
+            server.io_threads_num = atoi(argv[++i]);
+            if (server.io_threads_num < 1 || server.io_threads_num > MAX_IO_THREADS)
+                usage(argv[0]);
+        }
+        else
+            usage(argv[0]);
+    }
+    if (takeover_path)
+    {
+        // The listeners come from the process being replaced
+        if (listeners_num)
+            usage(argv[0]);
+        handoff_takeover(takeover_path);
     }
+    if (listeners_num == 0)
+        listener_add("0.0.0.0:1234"); // wildcard address, the historical default
+    if (upgrade_path)
+        upgrade_listen(upgrade_path);
 
-CLOSE:
-    close(fd);
+    io_threads_start();
+    event_loop();
     return 0;
-}
\ No newline at end of file
+}
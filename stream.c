@@ -0,0 +1,558 @@
+#include <stdlib.h>
+#include <string.h>
+#include "stream.h"
+#include "serial.h"
+
+#define STREAM_BLOCK_CAP (STREAM_BLOCK_SIZE - sizeof(StreamBlock))
+
+// LEB128: 7 bits per byte, low bits first, high bit set on all but the last.
+static size_t varint_len(uint64_t v)
+{
+    size_t n = 1;
+    while (v >= 0x80)
+    {
+        v >>= 7;
+        n++;
+    }
+    return n;
+}
+
+static unsigned char *varint_put(unsigned char *p, uint64_t v)
+{
+    while (v >= 0x80)
+    {
+        *p++ = (v & 0x7f) | 0x80;
+        v >>= 7;
+    }
+    *p++ = v;
+    return p;
+}
+
+static uint64_t varint_get(const unsigned char **p)
+{
+    uint64_t v = 0;
+    for (int shift = 0;; shift += 7)
+    {
+        unsigned char b = *(*p)++;
+        v |= (uint64_t)(b & 0x7f) << shift;
+        if (!(b & 0x80))
+            return v;
+    }
+}
+
+// Bounds checked varint_get(), for data from a snapshot.
+static int varint_get_checked(const unsigned char **p, const unsigned char *end, uint64_t *v)
+{
+    *v = 0;
+    for (int shift = 0; shift < 64 && *p < end; shift += 7)
+    {
+        unsigned char b = *(*p)++;
+        *v |= (uint64_t)(b & 0x7f) << shift;
+        if (!(b & 0x80))
+            return 1;
+    }
+    return 0;
+}
+
+static void id_encode(StreamID id, unsigned char key[16])
+{
+    for (int i = 0; i < 8; i++)
+    {
+        key[i] = id.ms >> (56 - 8 * i);
+        key[8 + i] = id.seq >> (56 - 8 * i);
+    }
+}
+
+int Stream_id_cmp(StreamID a, StreamID b)
+{
+    if (a.ms != b.ms)
+        return a.ms < b.ms ? -1 : 1;
+    if (a.seq != b.seq)
+        return a.seq < b.seq ? -1 : 1;
+    return 0;
+}
+
+Stream *Stream_create(void)
+{
+    Stream *s = calloc(1, sizeof(Stream));
+    if (!s)
+        return NULL;
+    s->index = Radix_create();
+    if (!s->index)
+    {
+        free(s);
+        return NULL;
+    }
+    return s;
+}
+
+static void group_free(StreamGroup *g)
+{
+    for (uint32_t i = 0; i < g->nconsumers; i++)
+        free(g->consumers[i].name);
+    free(g->consumers);
+    free(g->pending);
+    free(g->name);
+}
+
+void Stream_free(Stream *s)
+{
+    if (!s)
+        return;
+    StreamBlock *b = s->head;
+    while (b)
+    {
+        StreamBlock *next = b->next;
+        free(b);
+        b = next;
+    }
+    Radix_free(s->index, NULL);
+    for (uint32_t i = 0; i < s->ngroups; i++)
+        group_free(&s->groups[i]);
+    free(s->groups);
+    free(s);
+}
+
+// Links a new last block of the given data capacity starting at first.
+static StreamBlock *block_append(Stream *s, StreamID first, uint32_t cap)
+{
+    StreamBlock *b = malloc(sizeof(StreamBlock) + cap);
+    if (!b)
+        return NULL;
+    b->next = NULL;
+    b->first = b->last = first;
+    b->count = b->used = 0;
+    b->cap = cap;
+    unsigned char key[16];
+    id_encode(first, key);
+    if (Radix_insert(s->index, key, sizeof(key), b) < 0)
+    {
+        free(b);
+        return NULL;
+    }
+    if (s->tail)
+        s->tail->next = b;
+    else
+        s->head = b;
+    s->tail = b;
+    s->bytes += sizeof(StreamBlock) + cap;
+    return b;
+}
+
+int Stream_append(Stream *s, StreamID *id, int autoid, uint64_t now_ms, char **fv, uint32_t nfields)
+{
+    StreamID new_id = *id;
+    if (autoid)
+    {
+        if (now_ms > s->last_id.ms)
+            new_id = (StreamID){now_ms, 0};
+        else if (s->last_id.seq != UINT64_MAX)
+            new_id = (StreamID){s->last_id.ms, s->last_id.seq + 1};
+        else
+            new_id = (StreamID){s->last_id.ms + 1, 0};
+    }
+    if (Stream_id_cmp(new_id, s->last_id) <= 0)
+        return 0;
+
+    StreamBlock *b = s->tail;
+    uint64_t ms_delta = b ? new_id.ms - b->first.ms : 0;
+    size_t len = varint_len(ms_delta) + varint_len(new_id.seq) + varint_len(nfields);
+    for (uint32_t i = 0; i < nfields * 2; i++)
+    {
+        size_t n = strlen(fv[i]);
+        len += varint_len(n) + n;
+    }
+    if (!b || len > b->cap - b->used)
+    {
+        // A new block starts at this entry, so the ms delta becomes 0
+        len -= varint_len(ms_delta) - 1;
+        ms_delta = 0;
+        if (len > UINT32_MAX)
+            return -1;
+        b = block_append(s, new_id, len > STREAM_BLOCK_CAP ? len : STREAM_BLOCK_CAP);
+        if (!b)
+            return -1;
+    }
+
+    unsigned char *p = b->data + b->used;
+    p = varint_put(p, ms_delta);
+    p = varint_put(p, new_id.seq);
+    p = varint_put(p, nfields);
+    for (uint32_t i = 0; i < nfields * 2; i++)
+    {
+        size_t n = strlen(fv[i]);
+        p = varint_put(p, n);
+        memcpy(p, fv[i], n);
+        p += n;
+    }
+    b->used += len;
+    b->count++;
+    b->last = new_id;
+    s->last_id = new_id;
+    s->length++;
+    *id = new_id;
+    return 1;
+}
+
+size_t Stream_bytes(const Stream *s)
+{
+    size_t bytes = sizeof(Stream) + s->bytes + Radix_bytes(s->index) + s->ngroups * sizeof(StreamGroup);
+    for (uint32_t i = 0; i < s->ngroups; i++)
+        bytes += s->groups[i].nconsumers * sizeof(StreamConsumer) + s->groups[i].pending_cap * sizeof(StreamPending);
+    return bytes;
+}
+
+// Decodes the entry at p of block b, returning the start of the next one.
+static const unsigned char *entry_decode(const StreamBlock *b, const unsigned char *p, StreamEntry *e)
+{
+    e->id.ms = b->first.ms + varint_get(&p);
+    e->id.seq = varint_get(&p);
+    e->nfields = varint_get(&p);
+    e->fields = p;
+    for (uint32_t i = 0; i < e->nfields * 2; i++)
+    {
+        uint64_t len = varint_get(&p);
+        p += len;
+    }
+    return p;
+}
+
+const char *Stream_entry_string(const unsigned char **p, size_t *len)
+{
+    *len = varint_get(p);
+    const char *data = (const char *)*p;
+    *p += *len;
+    return data;
+}
+
+void Stream_iter_init(StreamIter *it, const Stream *s, StreamID start, StreamID end)
+{
+    it->block = NULL;
+    it->end = end;
+    if (!s->length || Stream_id_cmp(start, end) > 0 || Stream_id_cmp(start, s->last_id) > 0)
+        return;
+
+    unsigned char key[16];
+    id_encode(start, key);
+    const StreamBlock *b = Radix_floor(s->index, key, sizeof(key));
+    if (!b)
+        b = s->head;
+    if (Stream_id_cmp(b->last, start) < 0)
+        b = b->next;
+    if (!b)
+        return;
+
+    // Skip the entries of the first block before start
+    it->block = b;
+    it->p = b->data;
+    it->left = b->count;
+    while (it->left)
+    {
+        StreamEntry e;
+        const unsigned char *next = entry_decode(b, it->p, &e);
+        if (Stream_id_cmp(e.id, start) >= 0)
+            break;
+        it->p = next;
+        it->left--;
+    }
+}
+
+int Stream_iter_next(StreamIter *it, StreamEntry *e)
+{
+    if (!it->block)
+        return 0;
+    while (!it->left)
+    {
+        it->block = it->block->next;
+        if (!it->block)
+            return 0;
+        it->p = it->block->data;
+        it->left = it->block->count;
+    }
+    const unsigned char *next = entry_decode(it->block, it->p, e);
+    if (Stream_id_cmp(e->id, it->end) > 0)
+    {
+        it->block = NULL;
+        return 0;
+    }
+    it->p = next;
+    it->left--;
+    return 1;
+}
+
+StreamGroup *Stream_group_find(const Stream *s, const char *name)
+{
+    for (uint32_t i = 0; i < s->ngroups; i++)
+        if (strcmp(s->groups[i].name, name) == 0)
+            return &s->groups[i];
+    return NULL;
+}
+
+StreamGroup *Stream_group_create(Stream *s, const char *name, StreamID last_delivered)
+{
+    if (Stream_group_find(s, name))
+        return NULL;
+    StreamGroup *groups = realloc(s->groups, (s->ngroups + 1) * sizeof(StreamGroup));
+    if (!groups)
+        return NULL;
+    s->groups = groups;
+    StreamGroup *g = &groups[s->ngroups];
+    memset(g, 0, sizeof(*g));
+    g->name = strdup(name);
+    if (!g->name)
+        return NULL;
+    g->last_delivered = last_delivered;
+    s->ngroups++;
+    return g;
+}
+
+int Stream_group_destroy(Stream *s, const char *name)
+{
+    StreamGroup *g = Stream_group_find(s, name);
+    if (!g)
+        return 0;
+    group_free(g);
+    s->ngroups--;
+    memmove(g, g + 1, (s->groups + s->ngroups - g) * sizeof(StreamGroup));
+    return 1;
+}
+
+int Stream_consumer_get(StreamGroup *g, const char *name)
+{
+    for (uint32_t i = 0; i < g->nconsumers; i++)
+        if (strcmp(g->consumers[i].name, name) == 0)
+            return i;
+    StreamConsumer *consumers = realloc(g->consumers, (g->nconsumers + 1) * sizeof(StreamConsumer));
+    if (!consumers)
+        return -1;
+    g->consumers = consumers;
+    StreamConsumer *c = &consumers[g->nconsumers];
+    memset(c, 0, sizeof(*c));
+    c->name = strdup(name);
+    if (!c->name)
+        return -1;
+    return g->nconsumers++;
+}
+
+// Position of id in the pending list, or of the first greater entry.
+static uint64_t pending_search(const StreamGroup *g, StreamID id)
+{
+    uint64_t lo = 0, hi = g->npending;
+    while (lo < hi)
+    {
+        uint64_t mid = (lo + hi) / 2;
+        if (Stream_id_cmp(g->pending[mid].id, id) < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+StreamPending *Stream_pending_find(const StreamGroup *g, StreamID id)
+{
+    uint64_t i = pending_search(g, id);
+    if (i < g->npending && Stream_id_cmp(g->pending[i].id, id) == 0)
+        return &g->pending[i];
+    return NULL;
+}
+
+int Stream_pending_add(StreamGroup *g, StreamID id, int consumer, uint64_t now_ms)
+{
+    // New deliveries have the greatest IDs, so they go to the end
+    uint64_t i = pending_search(g, id);
+    if (i < g->npending && Stream_id_cmp(g->pending[i].id, id) == 0)
+    {
+        StreamPending *pe = &g->pending[i];
+        g->consumers[pe->consumer].pending--;
+        pe->consumer = consumer;
+        pe->deliveries++;
+        pe->delivered_ms = now_ms;
+        g->consumers[consumer].pending++;
+        return 1;
+    }
+    if (g->npending == g->pending_cap)
+    {
+        uint64_t cap = g->pending_cap ? g->pending_cap * 2 : 16;
+        StreamPending *pending = realloc(g->pending, cap * sizeof(StreamPending));
+        if (!pending)
+            return 0;
+        g->pending = pending;
+        g->pending_cap = cap;
+    }
+    memmove(g->pending + i + 1, g->pending + i, (g->npending - i) * sizeof(StreamPending));
+    g->pending[i] = (StreamPending){id, consumer, 1, now_ms};
+    g->npending++;
+    g->consumers[consumer].pending++;
+    return 1;
+}
+
+int Stream_ack(StreamGroup *g, StreamID id)
+{
+    StreamPending *pe = Stream_pending_find(g, id);
+    if (!pe)
+        return 0;
+    g->consumers[pe->consumer].pending--;
+    g->npending--;
+    memmove(pe, pe + 1, (g->pending + g->npending - pe) * sizeof(StreamPending));
+    return 1;
+}
+
+static size_t put_string(unsigned char *out, size_t off, const char *str)
+{
+    uint32_t len = strlen(str);
+    off = Serial_put(out, off, &len, sizeof(len));
+    return Serial_put(out, off, str, len);
+}
+
+static char *get_string(SerialReader *r)
+{
+    uint32_t len;
+    if (!Serial_get(r, &len, sizeof(len)) || len > (size_t)(r->end - r->p))
+        return NULL;
+    char *str = malloc(len + 1);
+    if (!str)
+        return NULL;
+    Serial_get(r, str, len);
+    str[len] = '\0';
+    return str;
+}
+
+size_t Stream_dump(const Stream *s, unsigned char *out)
+{
+    uint64_t nblocks = 0;
+    for (const StreamBlock *b = s->head; b; b = b->next)
+        nblocks++;
+    size_t off = Serial_put(out, 0, &s->last_id, sizeof(s->last_id));
+    off = Serial_put(out, off, &nblocks, sizeof(nblocks));
+    for (const StreamBlock *b = s->head; b; b = b->next)
+    {
+        off = Serial_put(out, off, &b->first, sizeof(b->first));
+        off = Serial_put(out, off, &b->count, sizeof(b->count));
+        off = Serial_put(out, off, &b->used, sizeof(b->used));
+        off = Serial_put(out, off, b->data, b->used);
+    }
+
+    off = Serial_put(out, off, &s->ngroups, sizeof(s->ngroups));
+    for (uint32_t i = 0; i < s->ngroups; i++)
+    {
+        const StreamGroup *g = &s->groups[i];
+        off = put_string(out, off, g->name);
+        off = Serial_put(out, off, &g->last_delivered, sizeof(g->last_delivered));
+        off = Serial_put(out, off, &g->nconsumers, sizeof(g->nconsumers));
+        for (uint32_t j = 0; j < g->nconsumers; j++)
+        {
+            off = put_string(out, off, g->consumers[j].name);
+            off = Serial_put(out, off, &g->consumers[j].seen_ms, sizeof(g->consumers[j].seen_ms));
+        }
+        off = Serial_put(out, off, &g->npending, sizeof(g->npending));
+        off = Serial_put(out, off, g->pending, g->npending * sizeof(StreamPending));
+    }
+    return off;
+}
+
+// Checks that the entries of a loaded block lie within it and are in order,
+// and sets its last ID.
+static int block_check(StreamBlock *b, StreamID prev)
+{
+    const unsigned char *p = b->data, *end = b->data + b->used;
+    for (uint32_t i = 0; i < b->count; i++)
+    {
+        uint64_t delta, nfields, len;
+        StreamID id = b->first;
+        if (!varint_get_checked(&p, end, &delta) || !varint_get_checked(&p, end, &id.seq) ||
+            !varint_get_checked(&p, end, &nfields) || nfields > b->used)
+            return 0;
+        id.ms += delta;
+        if ((i == 0 && Stream_id_cmp(id, b->first) != 0) || Stream_id_cmp(id, prev) <= 0)
+            return 0;
+        for (uint64_t j = 0; j < nfields * 2; j++)
+        {
+            if (!varint_get_checked(&p, end, &len) || len > (size_t)(end - p))
+                return 0;
+            p += len;
+        }
+        b->last = prev = id;
+    }
+    return b->count > 0 && p == end;
+}
+
+Stream *Stream_load(const unsigned char *in, size_t len)
+{
+    SerialReader r = {in, in + len};
+    StreamID last_id;
+    uint64_t nblocks;
+    Stream *s = Stream_create();
+    if (!s || !Serial_get(&r, &last_id, sizeof(last_id)) || !Serial_get(&r, &nblocks, sizeof(nblocks)))
+        goto err;
+    for (uint64_t i = 0; i < nblocks; i++)
+    {
+        StreamID first;
+        uint32_t count, used;
+        if (!Serial_get(&r, &first, sizeof(first)) || !Serial_get(&r, &count, sizeof(count)) ||
+            !Serial_get(&r, &used, sizeof(used)) || used > (size_t)(r.end - r.p) ||
+            (s->tail && Stream_id_cmp(first, s->tail->last) <= 0))
+            goto err;
+        StreamID prev = s->tail ? s->tail->last : (StreamID){0, 0};
+        StreamBlock *b = block_append(s, first, used > STREAM_BLOCK_CAP ? used : STREAM_BLOCK_CAP);
+        if (!b)
+            goto err;
+        Serial_get(&r, b->data, used);
+        b->count = count;
+        b->used = used;
+        if (!block_check(b, prev))
+            goto err;
+        s->length += count;
+    }
+    if (s->tail && Stream_id_cmp(last_id, s->tail->last) < 0)
+        goto err;
+    s->last_id = last_id;
+
+    uint32_t ngroups;
+    if (!Serial_get(&r, &ngroups, sizeof(ngroups)))
+        goto err;
+    for (uint32_t i = 0; i < ngroups; i++)
+    {
+        char *name = get_string(&r);
+        StreamID last_delivered;
+        StreamGroup *g = NULL;
+        if (name && Serial_get(&r, &last_delivered, sizeof(last_delivered)))
+            g = Stream_group_create(s, name, last_delivered);
+        free(name);
+        uint32_t nconsumers;
+        if (!g || !Serial_get(&r, &nconsumers, sizeof(nconsumers)))
+            goto err;
+        for (uint32_t j = 0; j < nconsumers; j++)
+        {
+            uint64_t seen_ms;
+            name = get_string(&r);
+            int idx = name ? Stream_consumer_get(g, name) : -1;
+            free(name);
+            if (idx != (int)j || !Serial_get(&r, &seen_ms, sizeof(seen_ms)))
+                goto err;
+            g->consumers[j].seen_ms = seen_ms;
+        }
+        uint64_t npending;
+        if (!Serial_get(&r, &npending, sizeof(npending)) || npending > (r.end - r.p) / sizeof(StreamPending))
+            goto err;
+        g->pending = malloc(npending * sizeof(StreamPending) + 1);
+        if (!g->pending)
+            goto err;
+        Serial_get(&r, g->pending, npending * sizeof(StreamPending));
+        g->npending = g->pending_cap = npending;
+        for (uint64_t j = 0; j < npending; j++)
+        {
+            if (g->pending[j].consumer >= nconsumers ||
+                (j && Stream_id_cmp(g->pending[j - 1].id, g->pending[j].id) >= 0))
+                goto err;
+            g->consumers[g->pending[j].consumer].pending++;
+        }
+    }
+    if (r.p != r.end)
+        goto err;
+    return s;
+
+err:
+    Stream_free(s);
+    return NULL;
+}
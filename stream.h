@@ -0,0 +1,123 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include "radix.h"
+
+// Append-only log of entries, each a list of field-value pairs under an ID
+// of a millisecond time and a sequence number, always greater than the ID
+// before it. Entries are packed back to back into blocks of about
+// STREAM_BLOCK_SIZE bytes (IDs as varint deltas from the first ID of the
+// block), so appends write to the end of the last block and range scans
+// read blocks front to back. A radix tree maps the first ID of each block,
+// as 16 big-endian bytes, to the block, which finds the start of a range
+// without walking the blocks before it.
+//
+// Consumer groups track the last ID delivered to the group and, per entry
+// delivered but not acknowledged yet, its consumer (the pending entries
+// list, sorted by ID).
+
+#define STREAM_BLOCK_SIZE 4096
+
+typedef struct StreamID
+{
+    uint64_t ms;
+    uint64_t seq;
+} StreamID;
+
+typedef struct StreamBlock
+{
+    struct StreamBlock *next;
+    StreamID first, last;
+    uint32_t count; // Entries
+    uint32_t used;  // Bytes of data
+    uint32_t cap;
+    unsigned char data[];
+} StreamBlock;
+
+typedef struct StreamConsumer
+{
+    char *name;
+    uint64_t pending; // Entries of the group's pending list owned by this consumer
+    uint64_t seen_ms; // Last time it read from the group
+} StreamConsumer;
+
+typedef struct StreamPending
+{
+    StreamID id;
+    uint32_t consumer; // Index in the group's consumers
+    uint32_t deliveries;
+    uint64_t delivered_ms;
+} StreamPending;
+
+typedef struct StreamGroup
+{
+    char *name;
+    StreamID last_delivered;
+    StreamConsumer *consumers;
+    uint32_t nconsumers;
+    StreamPending *pending; // Sorted by ID
+    uint64_t npending, pending_cap;
+} StreamGroup;
+
+typedef struct Stream
+{
+    StreamBlock *head, *tail;
+    Radix *index; // First ID of each block -> block
+    uint64_t length;
+    StreamID last_id;
+    size_t bytes;
+    StreamGroup *groups;
+    uint32_t ngroups;
+} Stream;
+
+// One entry, as returned by the iterator. fields points at nfields * 2
+// length-prefixed strings, read with Stream_entry_string().
+typedef struct StreamEntry
+{
+    StreamID id;
+    uint32_t nfields;
+    const unsigned char *fields;
+} StreamEntry;
+
+typedef struct StreamIter
+{
+    const StreamBlock *block;
+    const unsigned char *p; // Next entry in block
+    uint32_t left;          // Entries of block from p on
+    StreamID end;
+} StreamIter;
+
+Stream *Stream_create(void);
+void Stream_free(Stream *s);
+
+int Stream_id_cmp(StreamID a, StreamID b);
+// Appends an entry of nfields field-value pairs (NUL-terminated strings,
+// fv[2 * i] the field and fv[2 * i + 1] its value). With autoid set, the ID
+// is the current time (ms) and the next sequence number, or *id otherwise.
+// Returns 1 and the ID in *id, 0 if the ID is not greater than the last
+// one, -1 if out of memory.
+int Stream_append(Stream *s, StreamID *id, int autoid, uint64_t now_ms, char **fv, uint32_t nfields);
+size_t Stream_bytes(const Stream *s);
+
+// Iterates over the entries with IDs in [start, end].
+void Stream_iter_init(StreamIter *it, const Stream *s, StreamID start, StreamID end);
+int Stream_iter_next(StreamIter *it, StreamEntry *e);
+// Reads the next string of an entry, advancing *p.
+const char *Stream_entry_string(const unsigned char **p, size_t *len);
+
+StreamGroup *Stream_group_find(const Stream *s, const char *name);
+// Returns NULL if the group exists or out of memory.
+StreamGroup *Stream_group_create(Stream *s, const char *name, StreamID last_delivered);
+int Stream_group_destroy(Stream *s, const char *name);
+// Returns the index of the consumer, creating it if needed, or -1 if out of memory.
+int Stream_consumer_get(StreamGroup *g, const char *name);
+// Records the delivery of id to a consumer, adding it to the pending list
+// or moving it there. Returns 0 if out of memory.
+int Stream_pending_add(StreamGroup *g, StreamID id, int consumer, uint64_t now_ms);
+StreamPending *Stream_pending_find(const StreamGroup *g, StreamID id);
+// Removes id from the pending list. Returns 1 if it was pending.
+int Stream_ack(StreamGroup *g, StreamID id);
+
+// Snapshot encoding, see Bloom_dump() in bloom.h.
+size_t Stream_dump(const Stream *s, unsigned char *out);
+Stream *Stream_load(const unsigned char *in, size_t len);
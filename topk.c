@@ -0,0 +1,264 @@
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "topk.h"
+#include "serial.h"
+
+#define TOPK_DECAY_TABLE 256
+#define TOPK_MAX_DEPTH 64
+
+// decay^count for small counts, beyond that the decay probability is ~0
+static double decay_table[TOPK_DECAY_TABLE];
+static double decay_table_base = -1;
+
+static uint64_t decay_rand(void)
+{
+    static uint64_t state = 0x2545f4914f6cdd1dULL;
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+    return state;
+}
+
+TopK *TopK_create(uint32_t k, uint32_t width, uint32_t depth, double decay)
+{
+    if (k == 0 || width == 0 || depth == 0 || depth > TOPK_MAX_DEPTH ||
+        (uint64_t)width * depth > (1ULL << 32) || !(decay > 0 && decay <= 1))
+        return NULL;
+    TopK *tk = calloc(1, sizeof(TopK));
+    if (!tk)
+        return NULL;
+    tk->buckets = calloc((size_t)width * depth, sizeof(TopKBucket));
+    tk->heap = calloc(k, sizeof(TopKEntry));
+    if (!tk->buckets || !tk->heap)
+    {
+        TopK_free(tk);
+        return NULL;
+    }
+    tk->k = k;
+    tk->width = width;
+    tk->depth = depth;
+    tk->decay = decay;
+    return tk;
+}
+
+void TopK_free(TopK *tk)
+{
+    if (!tk)
+        return;
+    if (tk->heap)
+        for (uint32_t i = 0; i < tk->heap_size; i++)
+            free(tk->heap[i].item);
+    free(tk->heap);
+    free(tk->buckets);
+    free(tk);
+}
+
+static double decay_probability(const TopK *tk, uint32_t count)
+{
+    if (decay_table_base != tk->decay)
+    {
+        for (int i = 0; i < TOPK_DECAY_TABLE; i++)
+            decay_table[i] = pow(tk->decay, i);
+        decay_table_base = tk->decay;
+    }
+    return count < TOPK_DECAY_TABLE ? decay_table[count] : 0;
+}
+
+static void heap_swap(TopKEntry *heap, uint32_t a, uint32_t b)
+{
+    TopKEntry tmp = heap[a];
+    heap[a] = heap[b];
+    heap[b] = tmp;
+}
+
+static void heap_sift_down(TopKEntry *heap, uint32_t size, uint32_t i)
+{
+    while (1)
+    {
+        uint32_t min = i, l = 2 * i + 1, r = 2 * i + 2;
+        if (l < size && heap[l].count < heap[min].count)
+            min = l;
+        if (r < size && heap[r].count < heap[min].count)
+            min = r;
+        if (min == i)
+            return;
+        heap_swap(heap, i, min);
+        i = min;
+    }
+}
+
+static void heap_sift_up(TopKEntry *heap, uint32_t i)
+{
+    while (i && heap[(i - 1) / 2].count > heap[i].count)
+    {
+        heap_swap(heap, i, (i - 1) / 2);
+        i = (i - 1) / 2;
+    }
+}
+
+// Linear scan on the fingerprint first: the heap is small (k entries) and
+// compact, the string compare only runs on a fingerprint match.
+static int heap_find(const TopK *tk, const char *item, uint32_t fp)
+{
+    for (uint32_t i = 0; i < tk->heap_size; i++)
+        if (tk->heap[i].fp == fp && strcmp(tk->heap[i].item, item) == 0)
+            return i;
+    return -1;
+}
+
+// Counts incr occurrences of the item. Returns the item expelled from the
+// top-k list to make room for it (to be freed by the caller), or NULL.
+char *TopK_add(TopK *tk, const char *item, uint64_t hash, uint32_t incr)
+{
+    uint32_t fp = (uint32_t)(hash >> 32);
+    uint32_t h1 = (uint32_t)hash;
+    uint32_t h2 = fp | 1;
+    uint32_t max_count = 0;
+
+    for (uint32_t i = 0; i < tk->depth; i++)
+    {
+        uint64_t col = ((uint64_t)(h1 + i * h2) * tk->width) >> 32;
+        TopKBucket *b = &tk->buckets[(size_t)i * tk->width + col];
+        if (b->count == 0 || b->fp == fp)
+        {
+            b->fp = fp;
+            b->count = b->count + incr < b->count ? UINT32_MAX : b->count + incr;
+        }
+        else
+        {
+            // Each occurrence may decay the owner; once the bucket is empty
+            // the remaining occurrences take it over.
+            for (uint32_t n = 0; n < incr; n++)
+            {
+                double p = decay_probability(tk, b->count);
+                if ((double)(decay_rand() >> 11) * 0x1p-53 < p && --b->count == 0)
+                {
+                    b->fp = fp;
+                    b->count = incr - n;
+                    break;
+                }
+            }
+        }
+        if (b->fp == fp && b->count > max_count)
+            max_count = b->count;
+    }
+
+    int pos = heap_find(tk, item, fp);
+    if (pos >= 0)
+    {
+        if (max_count > tk->heap[pos].count)
+        {
+            tk->heap[pos].count = max_count;
+            heap_sift_down(tk->heap, tk->heap_size, pos);
+        }
+        return NULL;
+    }
+    if (tk->heap_size < tk->k)
+    {
+        if (max_count == 0)
+            return NULL;
+        char *copy = strdup(item);
+        if (!copy)
+            return NULL;
+        tk->heap[tk->heap_size] = (TopKEntry){fp, max_count, copy};
+        heap_sift_up(tk->heap, tk->heap_size++);
+        return NULL;
+    }
+    if (max_count <= tk->heap[0].count)
+        return NULL;
+
+    char *copy = strdup(item);
+    if (!copy)
+        return NULL;
+    char *expelled = tk->heap[0].item;
+    tk->heap[0] = (TopKEntry){fp, max_count, copy};
+    heap_sift_down(tk->heap, tk->heap_size, 0);
+    return expelled;
+}
+
+int TopK_query(const TopK *tk, const char *item, uint64_t hash)
+{
+    return heap_find(tk, item, (uint32_t)(hash >> 32)) >= 0;
+}
+
+static int entry_cmp_desc(const void *a, const void *b)
+{
+    const TopKEntry *x = a, *y = b;
+    return (x->count < y->count) - (x->count > y->count);
+}
+
+// Copies the heavy hitters to out (room for k entries), most frequent first.
+// The item strings still belong to the sketch.
+uint32_t TopK_list(const TopK *tk, TopKEntry *out)
+{
+    memcpy(out, tk->heap, tk->heap_size * sizeof(TopKEntry));
+    qsort(out, tk->heap_size, sizeof(TopKEntry), entry_cmp_desc);
+    return tk->heap_size;
+}
+
+size_t TopK_dump(const TopK *tk, unsigned char *out)
+{
+    size_t off = Serial_put(out, 0, &tk->k, sizeof(tk->k));
+    off = Serial_put(out, off, &tk->width, sizeof(tk->width));
+    off = Serial_put(out, off, &tk->depth, sizeof(tk->depth));
+    off = Serial_put(out, off, &tk->decay, sizeof(tk->decay));
+    off = Serial_put(out, off, tk->buckets, (size_t)tk->width * tk->depth * sizeof(TopKBucket));
+    off = Serial_put(out, off, &tk->heap_size, sizeof(tk->heap_size));
+    for (uint32_t i = 0; i < tk->heap_size; i++)
+    {
+        const TopKEntry *e = &tk->heap[i];
+        uint32_t len = strlen(e->item);
+        off = Serial_put(out, off, &e->fp, sizeof(e->fp));
+        off = Serial_put(out, off, &e->count, sizeof(e->count));
+        off = Serial_put(out, off, &len, sizeof(len));
+        off = Serial_put(out, off, e->item, len);
+    }
+    return off;
+}
+
+TopK *TopK_load(const unsigned char *in, size_t len)
+{
+    SerialReader r = {in, in + len};
+    uint32_t k, width, depth, heap_size;
+    double decay;
+    if (!Serial_get(&r, &k, sizeof(k)) || !Serial_get(&r, &width, sizeof(width)) ||
+        !Serial_get(&r, &depth, sizeof(depth)) || !Serial_get(&r, &decay, sizeof(decay)) ||
+        (uint64_t)width * depth * sizeof(TopKBucket) > (size_t)(r.end - r.p))
+        return NULL;
+    TopK *tk = TopK_create(k, width, depth, decay);
+    if (!tk)
+        return NULL;
+    Serial_get(&r, tk->buckets, (size_t)width * depth * sizeof(TopKBucket));
+    if (!Serial_get(&r, &heap_size, sizeof(heap_size)) || heap_size > k)
+        goto err;
+    for (uint32_t i = 0; i < heap_size; i++)
+    {
+        TopKEntry *e = &tk->heap[i];
+        uint32_t len;
+        if (!Serial_get(&r, &e->fp, sizeof(e->fp)) || !Serial_get(&r, &e->count, sizeof(e->count)) ||
+            !Serial_get(&r, &len, sizeof(len)) || len > (size_t)(r.end - r.p))
+            goto err;
+        e->item = malloc(len + 1);
+        if (!e->item)
+            goto err;
+        tk->heap_size = i + 1;
+        Serial_get(&r, e->item, len);
+        e->item[len] = '\0';
+    }
+    if (r.p != r.end)
+        goto err;
+    return tk;
+
+err:
+    TopK_free(tk);
+    return NULL;
+}
+
+size_t TopK_bytes(const TopK *tk)
+{
+    size_t bytes = sizeof(TopK) + (size_t)tk->width * tk->depth * sizeof(TopKBucket) + tk->k * sizeof(TopKEntry);
+    for (uint32_t i = 0; i < tk->heap_size; i++)
+        bytes += strlen(tk->heap[i].item) + 1;
+    return bytes;
+}
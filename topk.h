@@ -0,0 +1,45 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+// Top-K heavy hitters with HeavyKeeper: depth rows of width buckets, each
+// holding a fingerprint and a count, in one flat row-major array. A bucket
+// owned by another fingerprint decays with probability decay^count, so only
+// frequent items hold on to their buckets. A min-heap of k entries keeps the
+// current heavy hitters with their names.
+
+typedef struct TopKBucket
+{
+    uint32_t fp;
+    uint32_t count;
+} TopKBucket;
+
+typedef struct TopKEntry
+{
+    uint32_t fp;
+    uint32_t count;
+    char *item; // NULL for an unused slot
+} TopKEntry;
+
+typedef struct TopK
+{
+    uint32_t k;
+    uint32_t width;
+    uint32_t depth;
+    double decay;
+    TopKBucket *buckets; // depth * width, row-major
+    TopKEntry *heap;     // Min-heap on count, k entries
+    uint32_t heap_size;
+} TopK;
+
+TopK *TopK_create(uint32_t k, uint32_t width, uint32_t depth, double decay);
+void TopK_free(TopK *tk);
+
+char *TopK_add(TopK *tk, const char *item, uint64_t hash, uint32_t incr);
+int TopK_query(const TopK *tk, const char *item, uint64_t hash);
+uint32_t TopK_list(const TopK *tk, TopKEntry *out);
+size_t TopK_bytes(const TopK *tk);
+
+// Snapshot encoding, see Bloom_dump() in bloom.h.
+size_t TopK_dump(const TopK *tk, unsigned char *out);
+TopK *TopK_load(const unsigned char *in, size_t len);